@@ -0,0 +1,205 @@
+#include "common.h"
+
+
+#define BUCKETS_MIN_ 16
+
+
+static
+upd_bcache_block_t**
+bcache_bucket_(
+  upd_iso_t*    iso,
+  upd_file_id_t id,
+  uint64_t      index);
+
+static
+bool
+bcache_alloc_buckets_(
+  upd_iso_t* iso);
+
+static
+void
+bcache_remove_(
+  upd_iso_t*          iso,
+  upd_bcache_block_t* b);
+
+static
+bool
+bcache_evict_(
+  upd_iso_t* iso);
+
+
+upd_bcache_block_t* upd_bcache_find(
+    upd_iso_t* iso, upd_file_id_t id, uint64_t index) {
+  if (HEDLEY_UNLIKELY(iso->bcache.buckets == NULL)) {
+    ++iso->bcache.misses;
+    return NULL;
+  }
+
+  upd_bcache_block_t* b = *bcache_bucket_(iso, id, index);
+  for (; b; b = b->next) {
+    if (HEDLEY_LIKELY(b->id == id && b->index == index)) {
+      if (HEDLEY_UNLIKELY(b->prefetch)) {
+        b->prefetch = false;
+        ++iso->bcache.prefetch_hits;
+      }
+      b->ref = true;
+      ++iso->bcache.hits;
+      return b;
+    }
+  }
+  ++iso->bcache.misses;
+  return NULL;
+}
+
+upd_bcache_block_t* upd_bcache_new(
+    upd_iso_t* iso, upd_file_id_t id, uint64_t index) {
+  (void) iso;
+
+  upd_bcache_block_t* b = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&b, sizeof(*b)+UPD_BCACHE_BLOCK))) {
+    return NULL;
+  }
+  *b = (upd_bcache_block_t) {
+    .id    = id,
+    .index = index,
+    .data  = (uint8_t*) (b+1),
+  };
+  return b;
+}
+
+void upd_bcache_insert(
+    upd_iso_t* iso, upd_bcache_block_t** list, upd_bcache_block_t* b) {
+  const bool prefetch = b->prefetch;
+
+  if (HEDLEY_UNLIKELY(b->size == 0 || b->size > iso->bcache.budget)) {
+    goto ABORT;
+  }
+  if (HEDLEY_UNLIKELY(!iso->bcache.buckets && !bcache_alloc_buckets_(iso))) {
+    goto ABORT;
+  }
+
+  upd_bcache_block_t** bucket = bcache_bucket_(iso, b->id, b->index);
+  for (upd_bcache_block_t* c = *bucket; c; c = c->next) {
+    if (HEDLEY_UNLIKELY(c->id == b->id && c->index == b->index)) {
+      goto ABORT;  /* another read has filled it while reading */
+    }
+  }
+
+  while (iso->bcache.bytes + b->size > iso->bcache.budget) {
+    if (HEDLEY_UNLIKELY(!bcache_evict_(iso))) {
+      goto ABORT;
+    }
+  }
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&iso->bcache.ring, b, SIZE_MAX))) {
+    goto ABORT;
+  }
+  b->ring = iso->bcache.ring.n-1;
+  b->next = *bucket;
+  *bucket = b;
+
+  b->fnext = *list;
+  b->fprev = list;
+  if (HEDLEY_LIKELY(b->fnext)) {
+    b->fnext->fprev = &b->fnext;
+  }
+  *list = b;
+
+  iso->bcache.bytes += b->size;
+  return;
+
+ABORT:
+  if (HEDLEY_UNLIKELY(prefetch)) {
+    ++iso->bcache.prefetch_waste;
+  }
+  upd_free(&b);
+}
+
+void upd_bcache_drop(upd_iso_t* iso, upd_bcache_block_t** list) {
+  while (*list) {
+    bcache_remove_(iso, *list);
+  }
+}
+
+void upd_bcache_set_budget(upd_iso_t* iso, size_t budget) {
+  iso->bcache.budget = budget;
+  while (iso->bcache.bytes > budget && bcache_evict_(iso));
+}
+
+void upd_bcache_clear(upd_iso_t* iso) {
+  while (iso->bcache.ring.n) {
+    bcache_remove_(iso, iso->bcache.ring.p[iso->bcache.ring.n-1]);
+  }
+  upd_array_clear(&iso->bcache.ring);
+  upd_free(&iso->bcache.buckets);
+  iso->bcache.nbuckets = 0;
+}
+
+
+static upd_bcache_block_t** bcache_bucket_(
+    upd_iso_t* iso, upd_file_id_t id, uint64_t index) {
+  uint64_t h = (id ^ (index << 20)) * UINT64_C(0x9E3779B97F4A7C15);
+  h ^= h >> 32;
+  return &iso->bcache.buckets[h & (iso->bcache.nbuckets-1)];
+}
+
+static bool bcache_alloc_buckets_(upd_iso_t* iso) {
+  size_t n = BUCKETS_MIN_;
+  while (n*UPD_BCACHE_BLOCK < iso->bcache.budget) {
+    n *= 2;
+  }
+  if (HEDLEY_UNLIKELY(!upd_malloc(&iso->bcache.buckets, sizeof(void*)*n))) {
+    return false;
+  }
+  memset(iso->bcache.buckets, 0, sizeof(void*)*n);
+  iso->bcache.nbuckets = n;
+  return true;
+}
+
+static void bcache_remove_(upd_iso_t* iso, upd_bcache_block_t* b) {
+  upd_bcache_block_t** itr = bcache_bucket_(iso, b->id, b->index);
+  while (*itr != b) {
+    itr = &(*itr)->next;
+  }
+  *itr = b->next;
+
+  *b->fprev = b->fnext;
+  if (HEDLEY_LIKELY(b->fnext)) {
+    b->fnext->fprev = b->fprev;
+  }
+
+  /* swap with the last one to remove in O(1) */
+  upd_bcache_block_t* last = iso->bcache.ring.p[iso->bcache.ring.n-1];
+  iso->bcache.ring.p[b->ring] = last;
+  last->ring = b->ring;
+  upd_array_remove(&iso->bcache.ring, iso->bcache.ring.n-1);
+
+  if (HEDLEY_UNLIKELY(b->prefetch)) {
+    ++iso->bcache.prefetch_waste;
+  }
+
+  assert(iso->bcache.bytes >= b->size);
+  iso->bcache.bytes -= b->size;
+  upd_free(&b);
+}
+
+static bool bcache_evict_(upd_iso_t* iso) {
+  const size_t n = iso->bcache.ring.n;
+  if (HEDLEY_UNLIKELY(n == 0)) {
+    return false;
+  }
+
+  /* gives a second chance to the referenced blocks */
+  for (;;) {
+    if (HEDLEY_UNLIKELY(iso->bcache.hand >= iso->bcache.ring.n)) {
+      iso->bcache.hand = 0;
+    }
+    upd_bcache_block_t* b = iso->bcache.ring.p[iso->bcache.hand];
+    if (HEDLEY_LIKELY(!b->ref)) {
+      bcache_remove_(iso, b);
+      ++iso->bcache.evicts;
+      return true;
+    }
+    b->ref = false;
+    ++iso->bcache.hand;
+  }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "common.h"
+
+
+#define UPD_BCACHE_BLOCK   (1024*64)         /* = 64 KiB */
+#define UPD_BCACHE_DEFAULT (1024*1024*32)    /* = 32 MiB */
+
+
+/*  Block cache shared by all files in the iso, keyed by (file id, block index).
+ * Blocks are evicted by CLOCK algorithm when the budget is exceeded. */
+struct upd_bcache_block_t {
+  upd_bcache_block_t* next;  /* next in the same bucket */
+
+  /* blocks of the same file are linked to be dropped at once */
+  upd_bcache_block_t*  fnext;
+  upd_bcache_block_t** fprev;
+
+  upd_file_id_t id;
+  uint64_t      index;
+  size_t        ring;  /* position in the clock ring */
+  size_t        size;
+
+  bool ref;
+  bool prefetch;  /* filled by readahead and not hit yet */
+
+  uint8_t* data;
+};
+
+
+/* Marks the found block as referenced, and counts hits and misses. */
+HEDLEY_NON_NULL(1)
+upd_bcache_block_t*
+upd_bcache_find(
+  upd_iso_t*    iso,
+  upd_file_id_t id,
+  uint64_t      index);
+
+/* Returns a detached block which can hold UPD_BCACHE_BLOCK bytes. */
+HEDLEY_NON_NULL(1)
+upd_bcache_block_t*
+upd_bcache_new(
+  upd_iso_t*    iso,
+  upd_file_id_t id,
+  uint64_t      index);
+
+/*  Callee takes the ownership of the block, and may free it immediately.
+ * The block is linked to the list, which the file must keep until it drops
+ * the list. */
+HEDLEY_NON_NULL(1, 2, 3)
+void
+upd_bcache_insert(
+  upd_iso_t*           iso,
+  upd_bcache_block_t** list,
+  upd_bcache_block_t*  b);
+
+/* Drops all blocks in the list. */
+HEDLEY_NON_NULL(1, 2)
+void
+upd_bcache_drop(
+  upd_iso_t*           iso,
+  upd_bcache_block_t** list);
+
+HEDLEY_NON_NULL(1)
+void
+upd_bcache_set_budget(
+  upd_iso_t* iso,
+  size_t     budget);
+
+HEDLEY_NON_NULL(1)
+void
+upd_bcache_clear(
+  upd_iso_t* iso);
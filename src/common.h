@@ -36,11 +36,20 @@
 #include <libupd/pathfind.h>
 
 
-typedef struct upd_pkg_t upd_pkg_t;
-
+typedef struct upd_bcache_block_t upd_bcache_block_t;
+typedef struct upd_dcache_entry_t upd_dcache_entry_t;
+typedef struct upd_file_nstat_t   upd_file_nstat_t;
+typedef struct upd_htable_t       upd_htable_t;
+typedef struct upd_nwatch_t       upd_nwatch_t;
+typedef struct upd_pkg_t          upd_pkg_t;
+
+#include "htable.h"
 #include "iso.h"
 
+#include "bcache.h"
 #include "config.h"
+#include "dcache.h"
 #include "driver.h"
 #include "file.h"
+#include "nwatch.h"
 #include "pkg.h"
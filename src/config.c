@@ -70,6 +70,11 @@ struct task_file_t_ {
 
   const upd_driver_t* driver;
   yaml_node_t*        rules;
+  yaml_node_t*        ignore;
+  uint64_t            debounce;
+  size_t              max_depth;
+  size_t              max_entries;
+  yaml_node_t*        snapshot;
 };
 
 struct task_server_t_ {
@@ -83,6 +88,14 @@ struct task_server_t_ {
   size_t         hostlen;
 
   uint16_t port;
+
+  yaml_node_t* socket;  /* serves on unix socket instead of tcp if set */
+
+  size_t concurrency;
+  size_t pool;
+  size_t threads;
+  bool   fdpass;
+  bool   websocket;
 };
 
 
@@ -129,6 +142,13 @@ config_tobool_(
   yaml_node_t* node,
   bool*        b);
 
+static
+bool
+config_tosize_(
+  ctx_t_*      ctx,
+  yaml_node_t* node,
+  size_t*      i);
+
 static
 bool
 config_check_npath_(
@@ -193,6 +213,11 @@ void
 task_parse_server_cb_(
   task_t_* task);
 
+static
+void
+task_parse_cache_cb_(
+  task_t_* task);
+
 
 static
 void
@@ -418,6 +443,19 @@ static bool config_tobool_(ctx_t_* ctx, yaml_node_t* node, bool* b) {
   return false;
 }
 
+static bool config_tosize_(ctx_t_* ctx, yaml_node_t* node, size_t* i) {
+  intmax_t v;
+  if (HEDLEY_UNLIKELY(!config_toimax_(ctx, node, &v))) {
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(v < 0 || (uintmax_t) v > SIZE_MAX)) {
+    config_lognf_(ctx, node, "expected non-negative integer");
+    return false;
+  }
+  *i = v;
+  return true;
+}
+
 static bool config_check_npath_(ctx_t_* ctx, const uint8_t* npath) {
   const size_t interlen =
     cwk_path_get_intersection((char*) ctx->path, (char*) npath); 
@@ -639,6 +677,12 @@ static void config_read_cb_(uv_fs_t* req) {
           .node = val,
           .cb   = task_parse_server_cb_,
         });
+    } else if (match_("cache")) {
+      q = task_queue_with_dup_(&(task_t_) {
+          .ctx  = ctx,
+          .node = val,
+          .cb   = task_parse_cache_cb_,
+        });
     } else {
       config_lognf_(ctx, key, "unknown block");
       continue;
@@ -966,11 +1010,21 @@ static void task_parse_file_cb_(task_t_* task) {
       yaml_node_t* npath;
       yaml_node_t* driver;
       yaml_node_t* rules;
+      yaml_node_t* ignore;
+      yaml_node_t* debounce;
+      yaml_node_t* max_depth;
+      yaml_node_t* max_entries;
+      yaml_node_t* snapshot;
     } fields = { NULL };
     config_find_all_fields_(ctx, val, (config_field_t_[]) {
-        { "npath",  &fields.npath,  YAML_SCALAR_NODE,  },
-        { "driver", &fields.driver, YAML_SCALAR_NODE,  },
-        { "rules",  &fields.rules,  YAML_MAPPING_NODE, },
+        { "npath",       &fields.npath,       YAML_SCALAR_NODE,   },
+        { "driver",      &fields.driver,      YAML_SCALAR_NODE,   },
+        { "rules",       &fields.rules,       YAML_MAPPING_NODE,  },
+        { "ignore",      &fields.ignore,      YAML_SEQUENCE_NODE, },
+        { "debounce",    &fields.debounce,    YAML_SCALAR_NODE,   },
+        { "max_depth",   &fields.max_depth,   YAML_SCALAR_NODE,   },
+        { "max_entries", &fields.max_entries, YAML_SCALAR_NODE,   },
+        { "snapshot",    &fields.snapshot,    YAML_SCALAR_NODE,   },
         { NULL },
       });
 
@@ -993,6 +1047,37 @@ static void task_parse_file_cb_(task_t_* task) {
       if (HEDLEY_UNLIKELY(fields.rules)) {
         config_lognf_(ctx, key, "rules are ignored");
       }
+      const bool opts =
+        fields.ignore    || fields.debounce    ||
+        fields.max_depth || fields.max_entries || fields.snapshot;
+      if (HEDLEY_UNLIKELY(opts)) {
+        config_lognf_(ctx, key, "options for upd.syncdir are ignored");
+      }
+    }
+
+    size_t max_depth   = SIZE_MAX;
+    size_t max_entries = SIZE_MAX;
+    if (HEDLEY_UNLIKELY(fields.max_depth)) {
+      if (HEDLEY_UNLIKELY(!config_tosize_(ctx, fields.max_depth, &max_depth))) {
+        continue;
+      }
+    }
+    if (HEDLEY_UNLIKELY(fields.max_entries)) {
+      if (HEDLEY_UNLIKELY(!config_tosize_(
+          ctx, fields.max_entries, &max_entries))) {
+        continue;
+      }
+    }
+
+    intmax_t debounce = UPD_DRIVER_SYNCDIR_DEBOUNCE;
+    if (HEDLEY_UNLIKELY(fields.debounce)) {
+      if (HEDLEY_UNLIKELY(!config_toimax_(ctx, fields.debounce, &debounce))) {
+        continue;
+      }
+      if (HEDLEY_UNLIKELY(debounce < 0)) {
+        config_lognf_(ctx, fields.debounce, "debounce must be positive or 0");
+        continue;
+      }
     }
 
     const uint8_t* k    = key->data.scalar.value;
@@ -1027,8 +1112,13 @@ static void task_parse_file_cb_(task_t_* task) {
       .dirlen  = upd_path_dirname(k, klen),
       .name    = b,
       .namelen = blen,
-      .driver  = driver,
-      .rules   = fields.rules,
+      .driver      = driver,
+      .rules       = fields.rules,
+      .ignore      = fields.ignore,
+      .debounce    = debounce,
+      .max_depth   = max_depth,
+      .max_entries = max_entries,
+      .snapshot    = fields.snapshot,
     };
     if (HEDLEY_UNLIKELY(fields.npath)) {
       ftask->npath    = fields.npath->data.scalar.value;
@@ -1042,7 +1132,7 @@ static void task_parse_file_cb_(task_t_* task) {
     }
 
     ++task->refcnt;
-    const bool pf = upd_pathfind_with_dup(&(upd_pathfind_t) {
+    const bool pf = upd_dcache_pathfind_with_dup(&(upd_pathfind_t) {
         .iso    = iso,
         .path   = (uint8_t*) ftask->dir,
         .len    = ftask->dirlen,
@@ -1097,24 +1187,87 @@ static void task_parse_server_cb_(task_t_* task) {
     struct {
       yaml_node_t* host;
       yaml_node_t* port;
+      yaml_node_t* socket;
+      yaml_node_t* concurrency;
+      yaml_node_t* pool;
+      yaml_node_t* threads;
+      yaml_node_t* fdpass;
+      yaml_node_t* websocket;
     } fields = { NULL };
     config_find_all_fields_(ctx, val, (config_field_t_[]) {
-        { "host", &fields.host, YAML_SCALAR_NODE, },
-        { "port", &fields.port, YAML_SCALAR_NODE, },
+        { "host",        &fields.host,        YAML_SCALAR_NODE, },
+        { "port",        &fields.port,        YAML_SCALAR_NODE, },
+        { "socket",      &fields.socket,      YAML_SCALAR_NODE, },
+        { "concurrency", &fields.concurrency, YAML_SCALAR_NODE, },
+        { "pool",        &fields.pool,        YAML_SCALAR_NODE, },
+        { "threads",     &fields.threads,     YAML_SCALAR_NODE, },
+        { "fdpass",      &fields.fdpass,      YAML_SCALAR_NODE, },
+        { "websocket",   &fields.websocket,   YAML_SCALAR_NODE, },
         { NULL },
       });
-    if (HEDLEY_UNLIKELY(!fields.host || !fields.port)) {
-      config_lognf_(ctx, key, "'host' and 'port' required");
-      continue;
+
+    intmax_t port = 0;
+    if (HEDLEY_LIKELY(fields.socket == NULL)) {
+      if (HEDLEY_UNLIKELY(!fields.host || !fields.port)) {
+        config_lognf_(ctx, key, "'host' and 'port', or 'socket' required");
+        continue;
+      }
+      if (HEDLEY_UNLIKELY(!config_toimax_(ctx, fields.port, &port))) {
+        continue;
+      }
+      if (HEDLEY_UNLIKELY(port <= 0 || UINT16_MAX < port)) {
+        config_lognf_(ctx, fields.port, "invalid port number");
+        continue;
+      }
+    } else if (HEDLEY_UNLIKELY(fields.host || fields.port)) {
+      config_lognf_(ctx, key, "'host' and 'port' are ignored with 'socket'");
     }
 
-    intmax_t port;
-    if (HEDLEY_UNLIKELY(!config_toimax_(ctx, fields.port, &port))) {
-      continue;
+    size_t concurrency = 0;
+    if (HEDLEY_UNLIKELY(fields.concurrency)) {
+      if (HEDLEY_UNLIKELY(!config_tosize_(
+          ctx, fields.concurrency, &concurrency))) {
+        continue;
+      }
     }
-    if (HEDLEY_UNLIKELY(port <= 0 || UINT16_MAX < port)) {
-      config_lognf_(ctx, fields.port, "invalid port number");
-      continue;
+    size_t pool = 0;
+    if (HEDLEY_UNLIKELY(fields.pool)) {
+      if (HEDLEY_UNLIKELY(!config_tosize_(ctx, fields.pool, &pool))) {
+        continue;
+      }
+    }
+    size_t threads = 1;
+    if (HEDLEY_UNLIKELY(fields.threads)) {
+      if (HEDLEY_UNLIKELY(!config_tosize_(ctx, fields.threads, &threads))) {
+        continue;
+      }
+      if (HEDLEY_UNLIKELY(threads == 0)) {
+        config_lognf_(ctx, fields.threads, "'threads' must be positive");
+        continue;
+      }
+      if (HEDLEY_UNLIKELY(fields.socket && threads > 1)) {
+        config_lognf_(ctx, fields.threads, "'threads' requires tcp");
+      }
+    }
+    bool fdpass = false;
+    if (HEDLEY_UNLIKELY(fields.fdpass)) {
+      if (HEDLEY_UNLIKELY(!config_tobool_(ctx, fields.fdpass, &fdpass))) {
+        continue;
+      }
+      if (HEDLEY_UNLIKELY(fields.socket == NULL)) {
+        config_lognf_(ctx, fields.fdpass, "'fdpass' requires 'socket'");
+      }
+    }
+    bool websocket = false;
+    if (HEDLEY_UNLIKELY(fields.websocket)) {
+      if (HEDLEY_UNLIKELY(!config_tobool_(
+          ctx, fields.websocket, &websocket))) {
+        continue;
+      }
+      if (HEDLEY_UNLIKELY(fields.socket)) {
+        config_lognf_(ctx, fields.websocket,
+          "'websocket' is not supported with 'socket'");
+      }
     }
 
     const uint8_t* host    = (uint8_t*) "0.0.0.0";
@@ -1138,10 +1291,17 @@ static void task_parse_server_cb_(task_t_* task) {
       .host    = host,
       .hostlen = hostlen,
       .port    = port,
+      .socket  = fields.socket,
+
+      .concurrency = concurrency,
+      .pool        = pool,
+      .threads     = threads,
+      .fdpass      = fdpass,
+      .websocket   = websocket,
     };
 
     ++task->refcnt;
-    const bool pf = upd_pathfind_with_dup(&(upd_pathfind_t) {
+    const bool pf = upd_dcache_pathfind_with_dup(&(upd_pathfind_t) {
         .iso   = iso,
         .path  = (uint8_t*) srv->path,
         .len   = srv->pathlen,
@@ -1160,6 +1320,56 @@ EXIT:
   task_unref_(task);
 }
 
+static void task_parse_cache_cb_(task_t_* task) {
+  ctx_t_*      ctx  = task->ctx;
+  upd_iso_t*   iso  = ctx->iso;
+  yaml_node_t* node = task->node;
+
+  if (HEDLEY_UNLIKELY(node == NULL)) {
+    goto EXIT;
+  }
+  if (HEDLEY_UNLIKELY(!(ctx->load->feats & UPD_CONFIG_SERVER))) {
+    config_lognf_(ctx, node, "'cache' block is not allowed in this context");
+    goto EXIT;
+  }
+
+  struct {
+    yaml_node_t* bytes;
+    yaml_node_t* write_behind;
+  } fields = { NULL };
+  config_find_all_fields_(ctx, node, (config_field_t_[]) {
+      { "bytes",        &fields.bytes,        YAML_SCALAR_NODE, },
+      { "write_behind", &fields.write_behind, YAML_SCALAR_NODE, },
+      { NULL },
+    });
+
+  if (HEDLEY_LIKELY(fields.bytes)) {
+    intmax_t bytes;
+    if (HEDLEY_UNLIKELY(!config_toimax_(ctx, fields.bytes, &bytes))) {
+      goto EXIT;
+    }
+    if (HEDLEY_UNLIKELY(bytes < 0 || (uintmax_t) bytes > SIZE_MAX)) {
+      config_lognf_(ctx, fields.bytes, "invalid cache size");
+      goto EXIT;
+    }
+    upd_bcache_set_budget(iso, bytes);
+  }
+  if (HEDLEY_LIKELY(fields.write_behind)) {
+    intmax_t bytes;
+    if (HEDLEY_UNLIKELY(!config_toimax_(ctx, fields.write_behind, &bytes))) {
+      goto EXIT;
+    }
+    if (HEDLEY_UNLIKELY(bytes < 0 || (uintmax_t) bytes > SIZE_MAX)) {
+      config_lognf_(ctx, fields.write_behind, "invalid buffer size");
+      goto EXIT;
+    }
+    iso->bcache.write_behind = bytes;
+  }
+
+EXIT:
+  task_unref_(task);
+}
+
 
 static void pkg_install_cb_(upd_pkg_install_t* inst) {
   task_t_*   task = inst->udata;
@@ -1326,8 +1536,76 @@ static void file_lock_cb_(upd_file_lock_t* lock) {
         break;
       }
     }
-    /* ownership of the rules moves to the driver */
-    upd_driver_syncdir_set_rules(f, &rules);
+    upd_array_of(uint8_t*) ignore = {0};
+    if (HEDLEY_UNLIKELY(ftask->ignore)) {
+      yaml_node_item_t* itr = ftask->ignore->data.sequence.items.start;
+      yaml_node_item_t* end = ftask->ignore->data.sequence.items.top;
+      for (; itr < end; ++itr) {
+        yaml_node_t* val = yaml_document_get_node(&ctx->doc, *itr);
+        if (HEDLEY_UNLIKELY(val == NULL)) {
+          continue;
+        }
+        if (HEDLEY_UNLIKELY(val->type != YAML_SCALAR_NODE)) {
+          config_lognf_(ctx, val, "ignore pattern must be scalar");
+          continue;
+        }
+
+        const size_t len = val->data.scalar.length;
+
+        uint8_t* pat = NULL;
+        if (HEDLEY_UNLIKELY(!upd_malloc(&pat, len+1))) {
+          config_lognf_(ctx, val, "ignore pattern allocation failure");
+          break;
+        }
+        utf8ncpy(pat, val->data.scalar.value, len);
+        pat[len] = 0;
+
+        if (HEDLEY_UNLIKELY(!upd_array_insert(&ignore, pat, SIZE_MAX))) {
+          upd_free(&pat);
+          config_lognf_(ctx, val,
+            "ignore pattern insertion failure, skipping following patterns");
+          break;
+        }
+      }
+    }
+
+    uint8_t snapshot[UPD_PATH_MAX];
+    bool    snapshot_ok = false;
+    if (HEDLEY_UNLIKELY(ftask->snapshot)) {
+      yaml_node_t* val = ftask->snapshot;
+
+      uint8_t rpath[UPD_PATH_MAX];
+      if (HEDLEY_UNLIKELY(val->data.scalar.length >= UPD_PATH_MAX)) {
+        config_lognf_(ctx, val, "too long snapshot path");
+        goto SETUP;
+      }
+      utf8ncpy(rpath, val->data.scalar.value, val->data.scalar.length);
+      rpath[val->data.scalar.length] = 0;
+
+      const size_t len = cwk_path_join(
+        (char*) ctx->path, (char*) rpath, (char*) snapshot, UPD_PATH_MAX);
+      if (HEDLEY_UNLIKELY(len >= UPD_PATH_MAX)) {
+        config_lognf_(ctx, val, "too long snapshot path");
+        goto SETUP;
+      }
+      snapshot[len] = 0;
+      if (HEDLEY_UNLIKELY(!config_check_npath_(ctx, snapshot))) {
+        config_lognf_(ctx, val, "directory traversal detected X<");
+        goto SETUP;
+      }
+      snapshot_ok = true;
+    }
+
+SETUP:
+    /* ownership of the rules and patterns moves to the driver */
+    upd_driver_syncdir_setup(f, &(upd_driver_syncdir_opts_t) {
+        .rules       = rules,
+        .ignore      = ignore,
+        .debounce    = ftask->debounce,
+        .max_depth   = ftask->max_depth,
+        .max_entries = ftask->max_entries,
+        .snapshot    = snapshot_ok? snapshot: NULL,
+      });
   }
 
   const bool add = upd_req_with_dup(&(upd_req_t) {
@@ -1394,16 +1672,53 @@ static void server_pathfind_cb_(upd_pathfind_t* pf) {
     goto EXIT;
   }
 
-  uint8_t host[256];
-  if (HEDLEY_UNLIKELY(srv->hostlen >= 256)) {
-    config_lognf_(ctx, srv->node,
-      "too long hostname: %.*s", (int) srv->hostlen, srv->host);
-    goto EXIT;
-  }
-  utf8ncpy(host, srv->host, srv->hostlen);
-  host[srv->hostlen] = 0;
+  const upd_driver_srv_opts_t opts = {
+    .concurrency = srv->concurrency,
+    .pool        = srv->pool,
+    .threads     = srv->threads,
+    .fdpass      = srv->fdpass,
+  };
+
+  upd_file_t* fsrv = NULL;
+  if (HEDLEY_UNLIKELY(srv->socket)) {
+    yaml_node_t* val = srv->socket;
+
+    uint8_t rpath[UPD_PATH_MAX];
+    if (HEDLEY_UNLIKELY(val->data.scalar.length >= UPD_PATH_MAX)) {
+      config_lognf_(ctx, val, "too long socket path");
+      goto EXIT;
+    }
+    utf8ncpy(rpath, val->data.scalar.value, val->data.scalar.length);
+    rpath[val->data.scalar.length] = 0;
 
-  upd_file_t* fsrv = upd_driver_srv_tcp_new(fpro, host, srv->port);
+    uint8_t npath[UPD_PATH_MAX];
+    const size_t len = cwk_path_join(
+      (char*) ctx->path, (char*) rpath, (char*) npath, UPD_PATH_MAX);
+    if (HEDLEY_UNLIKELY(len >= UPD_PATH_MAX)) {
+      config_lognf_(ctx, val, "too long socket path");
+      goto EXIT;
+    }
+    npath[len] = 0;
+    if (HEDLEY_UNLIKELY(!config_check_npath_(ctx, npath))) {
+      config_lognf_(ctx, val, "directory traversal detected X<");
+      goto EXIT;
+    }
+    fsrv = upd_driver_srv_unix_new(fpro, npath, &opts);
+
+  } else {
+    uint8_t host[256];
+    if (HEDLEY_UNLIKELY(srv->hostlen >= 256)) {
+      config_lognf_(ctx, srv->node,
+        "too long hostname: %.*s", (int) srv->hostlen, srv->host);
+      goto EXIT;
+    }
+    utf8ncpy(host, srv->host, srv->hostlen);
+    host[srv->hostlen] = 0;
+
+    fsrv = srv->websocket?
+      upd_driver_srv_ws_new(fpro, host, srv->port, &opts):
+      upd_driver_srv_tcp_new(fpro, host, srv->port, &opts);
+  }
   if (HEDLEY_UNLIKELY(fsrv == NULL)) {
     config_lognf_(ctx, srv->node, "server start failure");
     goto EXIT;
@@ -0,0 +1,382 @@
+#include "common.h"
+
+
+typedef struct find_t_ {
+  upd_pathfind_t src;  /* requested by the caller */
+
+  upd_file_t* base;   /* referenced while finding, NULL for the root */
+  bool        cache;  /* false after the resolved prefix is dropped */
+
+  size_t  pos;   /* end of the resolved prefix */
+  size_t  next;  /* end of the component being resolved */
+  size_t  len;
+  uint8_t path[1];
+} find_t_;
+
+
+static
+size_t
+dcache_normalize_(
+  uint8_t*       dst,
+  const uint8_t* path,
+  size_t         len);
+
+static
+uint64_t
+dcache_hash_path_(
+  const void* item);
+
+static
+uint64_t
+dcache_hash_file_(
+  const void* item);
+
+static
+upd_dcache_entry_t*
+dcache_find_(
+  upd_iso_t*     iso,
+  const uint8_t* path,
+  size_t         len);
+
+static
+upd_dcache_entry_t*
+dcache_insert_(
+  upd_iso_t*          iso,
+  upd_dcache_entry_t* parent,
+  const uint8_t*      path,
+  size_t              len,
+  upd_file_t*         f);
+
+static
+void
+dcache_drop_children_(
+  upd_iso_t*          iso,
+  upd_dcache_entry_t* e);
+
+static
+void
+dcache_unlink_(
+  upd_iso_t*          iso,
+  upd_dcache_entry_t* e);
+
+static
+void
+dcache_delete_(
+  upd_dcache_entry_t* e);
+
+static
+bool
+dcache_step_(
+  find_t_* find);
+
+
+static
+void
+dcache_step_cb_(
+  upd_pathfind_t* pf);
+
+
+bool upd_dcache_pathfind_with_dup(const upd_pathfind_t* src) {
+  upd_iso_t* iso = src->iso;
+
+  /* only absolute paths from the root are cached */
+  uint8_t path[UPD_PATH_MAX+1];
+  size_t  len = 0;
+  if (HEDLEY_LIKELY(src->base == NULL)) {
+    len = dcache_normalize_(path, src->path, src->len);
+  }
+  if (HEDLEY_UNLIKELY(len <= 1)) {
+    return upd_pathfind_with_dup(src);
+  }
+
+  /* finds the longest cached prefix */
+  size_t              pos = len;
+  upd_dcache_entry_t* e   = dcache_find_(iso, path, pos);
+  while (e == NULL && pos) {
+    do {
+      --pos;
+    } while (path[pos] != '/');
+    e = pos? dcache_find_(iso, path, pos): NULL;
+  }
+
+  if (HEDLEY_LIKELY(pos == len)) {
+    ++iso->dcache.hits;
+
+    upd_pathfind_t* pf = upd_iso_stack(iso, sizeof(*pf));
+    if (HEDLEY_UNLIKELY(pf == NULL)) {
+      return false;
+    }
+    *pf = *src;
+    pf->base = e->file;
+    pf->len  = 0;
+    pf->cb(pf);
+    return true;
+  }
+  ++iso->dcache.misses;
+
+  find_t_* find = upd_iso_stack(iso, sizeof(*find)+len);
+  if (HEDLEY_UNLIKELY(find == NULL)) {
+    return false;
+  }
+  *find = (find_t_) {
+    .src   = *src,
+    .base  = e? e->file: NULL,
+    .cache = true,
+    .pos   = pos,
+    .len   = len,
+  };
+  utf8ncpy(find->path, path, len);
+
+  if (HEDLEY_LIKELY(find->base)) {
+    upd_file_ref(find->base);
+  }
+  if (HEDLEY_UNLIKELY(!dcache_step_(find))) {
+    if (HEDLEY_LIKELY(find->base)) {
+      upd_file_unref(find->base);
+    }
+    upd_iso_unstack(iso, find);
+    return false;
+  }
+  return true;
+}
+
+void upd_dcache_invalidate(upd_file_t* f) {
+  upd_iso_t* iso = f->iso;
+
+  bool dir = false;
+  for (const upd_req_cat_t* c = f->driver->cats; *c; ++c) {
+    dir = dir || *c == UPD_REQ_DIR;
+  }
+  if (HEDLEY_LIKELY(!dir)) {
+    return;
+  }
+
+  /*  Paths of the directory itself are still valid.
+   * Walks again after each drop, because unref may change the tables. */
+  const uint64_t h = upd_htable_hash_ptr(f);
+  for (;;) {
+    size_t              i = SIZE_MAX;
+    upd_dcache_entry_t* e;
+    while ((e = upd_htable_next(&iso->dcache.files, h, &i))) {
+      if (HEDLEY_UNLIKELY(e->file == f && e->children.n)) {
+        break;
+      }
+    }
+    if (HEDLEY_LIKELY(e == NULL)) {
+      return;
+    }
+    dcache_drop_children_(iso, e);
+  }
+}
+
+void upd_dcache_clear(upd_iso_t* iso) {
+  /*  Detaches the tables before unref, because deleting files may trigger
+   * another invalidation. */
+  upd_htable_t paths = iso->dcache.paths;
+  iso->dcache.paths = (upd_htable_t) { .hash = paths.hash, };
+  upd_htable_clear(&iso->dcache.files);
+
+  for (size_t i = 0; i < paths.cap; ++i) {
+    upd_dcache_entry_t* e = paths.slots[i];
+    if (HEDLEY_LIKELY(e)) {
+      upd_array_clear(&e->children);
+      upd_file_unref(e->file);
+      upd_free(&e);
+    }
+  }
+  upd_htable_clear(&paths);
+}
+
+
+static size_t dcache_normalize_(
+    uint8_t* dst, const uint8_t* path, size_t len) {
+  if (HEDLEY_UNLIKELY(len >= UPD_PATH_MAX)) {
+    return 0;
+  }
+  dst[0] = '/';
+  utf8ncpy(dst+1, path, len);
+  return upd_path_normalize(dst, len+1);
+}
+
+static uint64_t dcache_hash_path_(const void* item) {
+  const upd_dcache_entry_t* e = item;
+  return e->hash;
+}
+
+static uint64_t dcache_hash_file_(const void* item) {
+  const upd_dcache_entry_t* e = item;
+  return upd_htable_hash_ptr(e->file);
+}
+
+static upd_dcache_entry_t* dcache_find_(
+    upd_iso_t* iso, const uint8_t* path, size_t len) {
+  const uint64_t h = upd_htable_hash_str(path, len);
+
+  size_t              i = SIZE_MAX;
+  upd_dcache_entry_t* e;
+  while ((e = upd_htable_next(&iso->dcache.paths, h, &i))) {
+    const bool match =
+      e->hash == h && e->len == len && utf8ncmp(e->path, path, len) == 0;
+    if (HEDLEY_LIKELY(match)) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static upd_dcache_entry_t* dcache_insert_(
+    upd_iso_t*          iso,
+    upd_dcache_entry_t* parent,
+    const uint8_t*      path,
+    size_t              len,
+    upd_file_t*         f) {
+  /* entries must not keep files alive while tearing down */
+  if (HEDLEY_UNLIKELY(iso->teardown)) {
+    return NULL;
+  }
+
+  upd_dcache_entry_t* e = dcache_find_(iso, path, len);
+  if (HEDLEY_UNLIKELY(e)) {
+    return e;  /* another pathfind has resolved it while finding */
+  }
+
+  /* starts over simply, because entries are cheap to resolve again */
+  if (HEDLEY_UNLIKELY(iso->dcache.paths.n >= UPD_DCACHE_MAX)) {
+    upd_dcache_clear(iso);
+    return NULL;
+  }
+
+  if (HEDLEY_UNLIKELY(!upd_malloc(&e, sizeof(*e)+len+1))) {
+    return NULL;
+  }
+  *e = (upd_dcache_entry_t) {
+    .hash = upd_htable_hash_str(path, len),
+    .file = f,
+    .path = (uint8_t*) (e+1),
+    .len  = len,
+  };
+  utf8ncpy(e->path, path, len);
+  e->path[len] = 0;
+
+  /* tables are set up at the first insertion */
+  iso->dcache.paths.hash = dcache_hash_path_;
+  iso->dcache.files.hash = dcache_hash_file_;
+
+  if (HEDLEY_UNLIKELY(!upd_htable_insert(&iso->dcache.paths, e))) {
+    goto ABORT;
+  }
+  if (HEDLEY_UNLIKELY(!upd_htable_insert(&iso->dcache.files, e))) {
+    upd_htable_remove(&iso->dcache.paths, e);
+    goto ABORT;
+  }
+  if (HEDLEY_LIKELY(parent)) {
+    if (HEDLEY_UNLIKELY(!upd_array_insert(&parent->children, e, SIZE_MAX))) {
+      upd_htable_remove(&iso->dcache.paths, e);
+      upd_htable_remove(&iso->dcache.files, e);
+      goto ABORT;
+    }
+  }
+  upd_file_ref(f);
+  return e;
+
+ABORT:
+  upd_free(&e);
+  return NULL;
+}
+
+static void dcache_drop_children_(upd_iso_t* iso, upd_dcache_entry_t* e) {
+  upd_array_t children = e->children;
+  e->children = (upd_array_t) {0};
+
+  /* unlinks all before unref, because deleting files may trigger another
+   * invalidation */
+  for (size_t i = 0; i < children.n; ++i) {
+    dcache_unlink_(iso, children.p[i]);
+  }
+  for (size_t i = 0; i < children.n; ++i) {
+    dcache_delete_(children.p[i]);
+  }
+  upd_array_clear(&children);
+}
+
+static void dcache_unlink_(upd_iso_t* iso, upd_dcache_entry_t* e) {
+  upd_htable_remove(&iso->dcache.paths, e);
+  upd_htable_remove(&iso->dcache.files, e);
+  for (size_t i = 0; i < e->children.n; ++i) {
+    dcache_unlink_(iso, e->children.p[i]);
+  }
+}
+
+static void dcache_delete_(upd_dcache_entry_t* e) {
+  for (size_t i = 0; i < e->children.n; ++i) {
+    dcache_delete_(e->children.p[i]);
+  }
+  upd_array_clear(&e->children);
+  upd_file_unref(e->file);
+  upd_free(&e);
+}
+
+static bool dcache_step_(find_t_* find) {
+  const size_t beg = find->pos+1;
+
+  size_t next = beg;
+  while (next < find->len && find->path[next] != '/') {
+    ++next;
+  }
+  find->next = next;
+
+  return upd_pathfind_with_dup(&(upd_pathfind_t) {
+      .iso    = find->src.iso,
+      .base   = find->base,
+      .path   = find->path + beg,
+      .len    = next - beg,
+      .create = find->src.create,
+      .udata  = find,
+      .cb     = dcache_step_cb_,
+    });
+}
+
+
+static void dcache_step_cb_(upd_pathfind_t* pf) {
+  find_t_*   find = pf->udata;
+  upd_iso_t* iso  = find->src.iso;
+
+  const bool ok = pf->len == 0 && pf->base;
+  if (HEDLEY_LIKELY(ok && find->cache)) {
+    /* the prefix may have been dropped while finding */
+    upd_dcache_entry_t* parent = NULL;
+    if (HEDLEY_LIKELY(find->pos)) {
+      parent = dcache_find_(iso, find->path, find->pos);
+    }
+    find->cache = (!find->pos || parent) &&
+      dcache_insert_(iso, parent, find->path, find->next, pf->base);
+  }
+
+  if (HEDLEY_LIKELY(ok && find->next < find->len)) {
+    upd_file_t* prev = find->base;
+
+    find->base = pf->base;
+    find->pos  = find->next;
+    upd_file_ref(find->base);
+    if (HEDLEY_LIKELY(prev)) {
+      upd_file_unref(prev);
+    }
+
+    if (HEDLEY_LIKELY(dcache_step_(find))) {
+      upd_iso_unstack(iso, pf);
+      return;
+    }
+    pf->len = find->len - find->pos;  /* tells the rest is not found */
+  }
+
+  /* the caller receives the pathfind context as if it requested */
+  upd_file_t* base = find->base;
+  pf->udata = find->src.udata;
+  pf->cb    = find->src.cb;
+  upd_iso_unstack(iso, find);
+
+  pf->cb(pf);
+  if (HEDLEY_LIKELY(base)) {
+    upd_file_unref(base);
+  }
+}
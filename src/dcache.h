@@ -0,0 +1,41 @@
+#pragma once
+
+#include "common.h"
+
+
+#define UPD_DCACHE_MAX 1024  /* entries */
+
+
+/*  Path resolution cache from normalized absolute paths to files.
+ * Every directory on the way is cached as an ancestor entry, so an update of
+ * a directory drops only the entries resolved through it. */
+struct upd_dcache_entry_t {
+  /* entries resolved through this one */
+  upd_array_of(upd_dcache_entry_t*) children;
+
+  uint64_t    hash;  /* of the path */
+  upd_file_t* file;  /* referenced while cached */
+
+  uint8_t* path;
+  size_t   len;
+};
+
+
+/*  Same as upd_pathfind_with_dup, but resolves from the cache if possible.
+ * Paths not cached are resolved one component at a time from the longest
+ * cached prefix. The callback may be called before returning. */
+HEDLEY_NON_NULL(1)
+bool
+upd_dcache_pathfind_with_dup(
+  const upd_pathfind_t* pf);
+
+/* Drops entries resolved through the file if it is a directory. */
+HEDLEY_NON_NULL(1)
+void
+upd_dcache_invalidate(
+  upd_file_t* f);
+
+HEDLEY_NON_NULL(1)
+void
+upd_dcache_clear(
+  upd_iso_t* iso);
@@ -22,6 +22,11 @@ void
 setup_lock_for_add_cb_(
   upd_file_lock_t* lock);
 
+static
+void
+setup_add_cb_(
+  upd_req_t* req);
+
 
 static
 void
@@ -40,13 +45,15 @@ void upd_driver_setup(upd_iso_t* iso) {
     upd_driver_register(iso, &upd_driver_bin_r) &&
     upd_driver_register(iso, &upd_driver_bin_rw) &&
     upd_driver_register(iso, &upd_driver_bin_w) &&
+    upd_driver_register(iso, &upd_driver_bin_mmap) &&
+    upd_driver_register(iso, &upd_driver_sys_bcache) &&
     upd_driver_register(iso, &upd_driver_tensor);
   if (HEDLEY_UNLIKELY(!reg)) {
     upd_iso_msgf(iso, "system driver registration failure\n");
     return;
   }
 
-  const bool ok = upd_pathfind_with_dup(&(upd_pathfind_t) {
+  const bool ok = upd_dcache_pathfind_with_dup(&(upd_pathfind_t) {
       .iso  = iso,
       .path = (uint8_t*) "/sys",
       .len  = 4,
@@ -115,11 +122,50 @@ static void setup_lock_for_add_cb_(upd_file_lock_t* lock) {
     goto EXIT;
   }
 
+  upd_file_t* f = upd_file_new(&(upd_file_t) {
+      .iso    = iso,
+      .driver = &upd_driver_sys_bcache,
+    });
+  if (HEDLEY_UNLIKELY(f == NULL)) {
+    upd_iso_msgf(iso, "'/sys/bcache' creation failure, while driver setup\n");
+    goto EXIT;
+  }
+  const bool add = upd_req_with_dup(&(upd_req_t) {
+      .file  = sys,
+      .type  = UPD_REQ_DIR_ADD,
+      .dir   = { .entry = {
+        .name = (uint8_t*) "bcache",
+        .len  = 6,
+        .file = f,
+      }, },
+      .udata = lock,
+      .cb    = setup_add_cb_,
+    });
+  upd_file_unref(f);
+  if (HEDLEY_UNLIKELY(!add)) {
+    upd_iso_msgf(iso, "'/sys/bcache' add req refused, while driver setup\n");
+    goto EXIT;
+  }
+  return;
+
 EXIT:
   upd_file_unlock(lock);
   upd_iso_unstack(iso, lock);
 }
 
+static void setup_add_cb_(upd_req_t* req) {
+  upd_file_lock_t* lock = req->udata;
+  upd_iso_t*       iso  = req->file->iso;
+
+  if (HEDLEY_UNLIKELY(req->result != UPD_REQ_OK)) {
+    upd_iso_msgf(iso, "'/sys/bcache' add req failure, while driver setup\n");
+  }
+  upd_iso_unstack(iso, req);
+
+  upd_file_unlock(lock);
+  upd_iso_unstack(iso, lock);
+}
+
 
 static void load_work_cb_(uv_work_t* w) {
   upd_driver_load_external_t* load = w->data;
@@ -5,6 +5,12 @@
 
 typedef struct upd_driver_rule_t          upd_driver_rule_t;
 typedef struct upd_driver_load_external_t upd_driver_load_external_t;
+typedef struct upd_driver_srv_opts_t      upd_driver_srv_opts_t;
+typedef struct upd_driver_srv_ws_t        upd_driver_srv_ws_t;
+typedef struct upd_driver_syncdir_opts_t  upd_driver_syncdir_opts_t;
+
+
+#define UPD_DRIVER_SYNCDIR_DEBOUNCE 100  /* ms */
 
 
 struct upd_driver_rule_t {
@@ -14,6 +20,35 @@ struct upd_driver_rule_t {
   const upd_driver_t* driver;
 };
 
+struct upd_driver_srv_opts_t {
+  /*  max number of program executions in progress at the same time,
+   * 0 serializes them with the program lock */
+  size_t concurrency;
+
+  /* number of streams executed in advance */
+  size_t pool;
+
+  /*  number of threads accepting tcp connections on the same port, and the
+   * accepted ones are handed to the loop which owns all files */
+  size_t threads;
+
+  /* upd.srv.unix accepts connections passed by SCM_RIGHTS */
+  bool fdpass;
+};
+
+struct upd_driver_syncdir_opts_t {
+  upd_array_of(upd_driver_rule_t*) rules;
+  upd_array_of(uint8_t*)           ignore;  /* glob patterns */
+
+  uint64_t debounce;  /* ms to wait for native changes to settle */
+
+  size_t max_depth;    /* of subdirectories, the mount point is 0 */
+  size_t max_entries;  /* in each directory */
+
+  /* native path to persist entries across boots, or NULL */
+  const uint8_t* snapshot;
+};
+
 struct upd_driver_load_external_t {
   upd_iso_t* iso;
 
@@ -35,10 +70,14 @@ struct upd_driver_load_external_t {
 extern const upd_driver_t upd_driver_bin_r;
 extern const upd_driver_t upd_driver_bin_rw;
 extern const upd_driver_t upd_driver_bin_w;
+extern const upd_driver_t upd_driver_bin_mmap;
 extern const upd_driver_t upd_driver_dir;
 extern const upd_driver_t upd_driver_syncdir;
 extern const upd_driver_t upd_driver_srv;
 extern const upd_driver_t upd_driver_srv_tcp;
+extern const upd_driver_t upd_driver_srv_unix;
+extern const upd_driver_t upd_driver_srv_ws;
+extern const upd_driver_t upd_driver_sys_bcache;
 extern const upd_driver_t upd_driver_tensor;
 
 
@@ -53,20 +92,79 @@ upd_driver_load_external(
   upd_driver_load_external_t* load);
 
 
-HEDLEY_NON_NULL(1)
+HEDLEY_NON_NULL(1, 2, 4)
 upd_file_t*
 upd_driver_srv_tcp_new(
-  upd_file_t*    prog,
-  const uint8_t* host,
-  uint16_t       port);
+  upd_file_t*                  prog,
+  const uint8_t*               host,
+  uint16_t                     port,
+  const upd_driver_srv_opts_t* opts);
 
+/* Frames stream data as binary messages of WebSocket. */
+HEDLEY_NON_NULL(1, 2, 4)
+upd_file_t*
+upd_driver_srv_ws_new(
+  upd_file_t*                  prog,
+  const uint8_t*               host,
+  uint16_t                     port,
+  const upd_driver_srv_opts_t* opts);
+
+HEDLEY_NON_NULL(1, 2, 3)
+upd_file_t*
+upd_driver_srv_unix_new(
+  upd_file_t*                  prog,
+  const uint8_t*               path,
+  const upd_driver_srv_opts_t* opts);
+
+/*  Creates WebSocket protocol state of a client of upd.srv.ws, whose socket
+ * is owned by the server and written through send with udata. */
+HEDLEY_NON_NULL(1, 3)
+HEDLEY_WARN_UNUSED_RESULT
+upd_driver_srv_ws_t*
+upd_driver_srv_ws_cli_new(
+  upd_iso_t* iso,
+  void*      udata,
+  bool
+  (*send)(
+    void*           udata,
+    const uv_buf_t* bufs,
+    size_t          n));
+
+HEDLEY_NON_NULL(1)
+void
+upd_driver_srv_ws_cli_delete(
+  upd_driver_srv_ws_t* ws);
+
+/*  Consumes bytes received from the socket, and returns size of payload
+ * gathered to the head of buf, or SIZE_MAX when the socket must be closed.
+ * The handshake is completed when upd_driver_srv_ws_is_open turns true. */
+HEDLEY_NON_NULL(1, 2)
+size_t
+upd_driver_srv_ws_recv(
+  upd_driver_srv_ws_t* ws,
+  uint8_t*             buf,
+  size_t               n);
 
-/* Callee takes the ownership of the rules. */
 HEDLEY_NON_NULL(1)
+bool
+upd_driver_srv_ws_send(
+  upd_driver_srv_ws_t* ws,
+  uint8_t              opcode,
+  const uint8_t*       buf,
+  size_t               n);
+
+HEDLEY_NON_NULL(1)
+bool
+upd_driver_srv_ws_is_open(
+  const upd_driver_srv_ws_t* ws);
+
+
+/* Callee takes the ownership of the rules and ignore patterns. */
+HEDLEY_NON_NULL(1, 2)
 void
-upd_driver_syncdir_set_rules(
-  upd_file_t*                             file,
-  const upd_array_of(upd_driver_rule_t*)* rules);
+upd_driver_syncdir_setup(
+  upd_file_t*                      file,
+  const upd_driver_syncdir_opts_t* opts);
 
 
 HEDLEY_NON_NULL(1, 2)
@@ -1,5 +1,10 @@
 #include "common.h"
 
+#if defined(__unix__)
+# include <sys/mman.h>
+# define BIN_USE_MMAP_ 1
+#endif
+
 
 #define BUF_MAX_ (1024*1024*8)  /* = 8 MiB */
 
@@ -7,6 +12,16 @@
 
 #define FILE_CLOSE_PERIOD_ 10000
 
+#define READ_PARALLEL_MAX_ 16
+
+#define WRITE_MERGE_MAX_     64
+#define WRITE_BEHIND_PERIOD_ 100
+
+/* readahead window in blocks of the cache */
+#define READAHEAD_STREAK_ 2
+#define READAHEAD_MIN_    2
+#define READAHEAD_MAX_    32  /* = 2 MiB */
+
 
 typedef struct bin_t_  bin_t_;
 typedef struct task_t_ task_t_;
@@ -18,11 +33,44 @@ struct bin_t_ {
 
   size_t bytes;
 
-  task_t_* last_task;
+  upd_bcache_block_t* blocks;  /* cached blocks of this file */
+  uint64_t            gen;     /* incremented when the blocks are dropped */
+
+  /* read-only mapping of the whole file, available while opened */
+  uint8_t* map;
+  size_t   mapsz;
+
+  /*  Reads run in parallel up to READ_PARALLEL_MAX_,
+   * and the other tasks run alone as barriers. */
+  task_t_* head;
+  task_t_* tail;
+  size_t   running;
+  bool     barrier;
+
+  /* sequential access detection for readahead */
+  struct {
+    size_t   next;    /* expected offset of the next read */
+    size_t   streak;
+    uint64_t ahead;   /* the first block index not prefetched yet */
+    size_t   window;
+  } seq;
+
+  /* write-behind buffer, enabled by `cache: { write_behind: N }` */
+  struct {
+    uint8_t* buf;
+    size_t   offset;
+    size_t   size;
+
+    upd_iso_timer_t timer;
+
+    /* acknowledged data has been lost, reported to the next write */
+    unsigned lost : 1;
+  } wb;
 
   unsigned read  : 1;
   unsigned write : 1;
   unsigned open  : 1;
+  unsigned mmap  : 1;
 };
 
 struct task_t_ {
@@ -32,7 +80,13 @@ struct task_t_ {
   upd_req_t*  req;
   task_t_*    next;
 
-  uint8_t* buf;
+  uint8_t*            buf;
+  upd_bcache_block_t* block;  /* blocks to prefetch are chained by next */
+  uint64_t            gen;    /* of the file when the read was submitted */
+
+  /* for flushing write-behind buffer */
+  size_t offset;
+  size_t size;
 
   void
   (*exec)(
@@ -62,6 +116,11 @@ bool
 bin_init_rw_(
   upd_file_t* f);
 
+static
+bool
+bin_init_mmap_(
+  upd_file_t* f);
+
 static
 void
 bin_deinit_(
@@ -72,6 +131,43 @@ bool
 bin_handle_(
   upd_req_t* req);
 
+static
+bool
+bin_read_map_(
+  upd_req_t* req);
+
+static
+bool
+bin_cacheable_(
+  const upd_req_t* req);
+
+static
+bool
+bin_read_cache_(
+  upd_req_t* req);
+
+static
+void
+bin_readahead_(
+  upd_req_t* req);
+
+static
+bool
+bin_write_behind_(
+  upd_req_t* req);
+
+static
+bool
+bin_flush_(
+  upd_file_t* f);
+
+static
+void
+bin_written_(
+  upd_file_t* f,
+  size_t      end,
+  bool        truncate);
+
 const upd_driver_t upd_driver_bin_r = {
   .name = (uint8_t*) "upd.bin.r",
   .cats = (upd_req_cat_t[]) {
@@ -117,6 +213,24 @@ const upd_driver_t upd_driver_bin_w = {
   .handle = bin_handle_,
 };
 
+/*  Reads are served from a shared mapping without copying, which suits
+ * immutable assets. Files changed by someone else are still safe, but each
+ * read pays an fstat to check that the file has not been shrunk. */
+const upd_driver_t upd_driver_bin_mmap = {
+  .name = (uint8_t*) "upd.bin.mmap",
+  .cats = (upd_req_cat_t[]) {
+    UPD_REQ_STREAM,
+    0,
+  },
+  .uncache_period = FILE_CLOSE_PERIOD_,
+  .flags = {
+    .npoll = true,
+  },
+  .init   = bin_init_mmap_,
+  .deinit = bin_deinit_,
+  .handle = bin_handle_,
+};
+
 
 static
 bool
@@ -128,17 +242,49 @@ bool
 task_queue_open_(
   upd_file_t* f);
 
+static
+bool
+task_is_barrier_(
+  const task_t_* task);
+
+static
+void
+task_dispatch_(
+  upd_file_t* f);
+
 static
 void
 task_finalize_(
   task_t_* task);
 
 
+static
+void
+bin_map_(
+  upd_file_t* f,
+  size_t      size);
+
+static
+void
+bin_unmap_(
+  upd_file_t* f);
+
+static
+void
+bin_drop_blocks_(
+  upd_file_t* f);
+
+
 static
 void
 bin_watch_cb_(
   upd_file_watch_t* watch);
 
+static
+void
+bin_wb_timer_cb_(
+  upd_iso_timer_t* t);
+
 static
 void
 bin_deinit_close_cb_(
@@ -165,6 +311,11 @@ void
 task_open_cb_(
   uv_fs_t* fsreq);
 
+static
+void
+task_open_fstat_cb_(
+  uv_fs_t* fsreq);
+
 static
 void
 task_read_exec_cb_(
@@ -175,6 +326,16 @@ void
 task_read_cb_(
   uv_fs_t* fsreq);
 
+static
+void
+task_prefetch_exec_cb_(
+  task_t_* task);
+
+static
+void
+task_prefetch_cb_(
+  uv_fs_t* fsreq);
+
 static
 void
 task_write_exec_cb_(
@@ -185,6 +346,22 @@ void
 task_write_cb_(
   uv_fs_t* fsreq);
 
+static
+void
+task_write_complete_(
+  task_t_* task,
+  ssize_t  result);
+
+static
+void
+task_flush_exec_cb_(
+  task_t_* task);
+
+static
+void
+task_flush_cb_(
+  uv_fs_t* fsreq);
+
 static
 void
 task_truncate_exec_cb_(
@@ -230,6 +407,12 @@ static bool bin_init_(upd_file_t* f, bool r, bool w) {
   *ctx = (bin_t_) {
     .read  = r,
     .write = w,
+    .wb = {
+      .timer = {
+        .udata = f,
+        .cb    = bin_wb_timer_cb_,
+      },
+    },
   };
   f->ctx = ctx;
 
@@ -242,6 +425,13 @@ static bool bin_init_(upd_file_t* f, bool r, bool w) {
     return false;
   }
 
+  /* the parent directory may know the size already */
+  const upd_file_nstat_t* nstat = upd_file_get_nstat(f);
+  if (HEDLEY_LIKELY(nstat)) {
+    ctx->bytes = nstat->size;
+    return true;
+  }
+
   const bool q = task_queue_with_dup_(&(task_t_) {
       .file = f,
       .exec = task_stat_exec_cb_,
@@ -266,11 +456,27 @@ static bool bin_init_w_(upd_file_t* f) {
   return bin_init_(f, false, true);
 }
 
+static bool bin_init_mmap_(upd_file_t* f) {
+  if (HEDLEY_UNLIKELY(!bin_init_(f, true, false))) {
+    return false;
+  }
+  bin_t_* ctx = f->ctx;
+  ctx->mmap = true;
+  return true;
+}
+
 static void bin_deinit_(upd_file_t* f) {
   bin_t_*    ctx = f->ctx;
   upd_iso_t* iso = f->iso;
 
   upd_file_unwatch(&ctx->watch);
+  upd_bcache_drop(iso, &ctx->blocks);
+  bin_unmap_(f);
+
+  /* the buffer holds a ref of the file, so it must be flushed already */
+  assert(ctx->wb.size == 0);
+  upd_iso_timer_stop(iso, &ctx->wb.timer);
+  upd_free(&ctx->wb.buf);
 
   if (HEDLEY_LIKELY(!ctx->open)) {
     goto EXIT;
@@ -308,6 +514,21 @@ static bool bin_handle_(upd_req_t* req) {
       req->result = UPD_REQ_ABORTED;
       return false;
     }
+    if (HEDLEY_LIKELY(ctx->map && !ctx->head && !ctx->barrier)) {
+      if (HEDLEY_LIKELY(bin_read_map_(req))) {
+        return true;
+      }
+    }
+    if (HEDLEY_LIKELY(bin_cacheable_(req))) {
+      bin_readahead_(req);
+      if (HEDLEY_LIKELY(bin_read_cache_(req))) {
+        return true;
+      }
+    }
+    if (HEDLEY_UNLIKELY(!bin_flush_(f))) {
+      req->result = UPD_REQ_NOMEM;
+      return false;
+    }
     if (HEDLEY_UNLIKELY(!ctx->open && !task_queue_open_(f))) {
       req->result = UPD_REQ_NOMEM;
       return false;
@@ -324,8 +545,16 @@ static bool bin_handle_(upd_req_t* req) {
   } return true;
 
   case UPD_REQ_STREAM_WRITE: {
-    if (HEDLEY_UNLIKELY(!ctx->write)) {
-      req->result = UPD_REQ_ABORTED;
+    if (HEDLEY_UNLIKELY(!ctx->write || ctx->wb.lost)) {
+      ctx->wb.lost = false;
+      req->result  = UPD_REQ_ABORTED;
+      return false;
+    }
+    if (HEDLEY_LIKELY(bin_write_behind_(req))) {
+      return true;
+    }
+    if (HEDLEY_UNLIKELY(!bin_flush_(f))) {
+      req->result = UPD_REQ_NOMEM;
       return false;
     }
     if (HEDLEY_UNLIKELY(!ctx->open && !task_queue_open_(f))) {
@@ -344,8 +573,13 @@ static bool bin_handle_(upd_req_t* req) {
   } return true;
 
   case UPD_REQ_STREAM_TRUNCATE: {
-    if (HEDLEY_UNLIKELY(!ctx->write)) {
-      req->result = UPD_REQ_ABORTED;
+    if (HEDLEY_UNLIKELY(!ctx->write || ctx->wb.lost)) {
+      ctx->wb.lost = false;
+      req->result  = UPD_REQ_ABORTED;
+      return false;
+    }
+    if (HEDLEY_UNLIKELY(!bin_flush_(f))) {
+      req->result = UPD_REQ_NOMEM;
       return false;
     }
     if (HEDLEY_UNLIKELY(!ctx->open && !task_queue_open_(f))) {
@@ -373,6 +607,242 @@ static bool bin_handle_(upd_req_t* req) {
 }
 
 
+static bool bin_read_map_(upd_req_t* req) {
+  upd_file_t* f   = req->file;
+  bin_t_*     ctx = f->ctx;
+  upd_iso_t*  iso = f->iso;
+
+  const size_t off = req->stream.io.offset;
+
+  size_t sz = req->stream.io.size;
+  if (HEDLEY_LIKELY(sz+off > ctx->mapsz)) {
+    sz = ctx->mapsz > off? ctx->mapsz-off: 0;
+  }
+
+  /*  Pages past EOF raise SIGBUS, and the file may have been shrunk before
+   * the native event arrives. fstat of an opened fd doesn't wait for any I/O,
+   * so it's called synchronously. Reads fall back to uv_fs_read after the
+   * mapping is dropped. */
+  if (HEDLEY_LIKELY(sz)) {
+    uv_fs_t fsreq;
+    const int    err   = uv_fs_fstat(&iso->loop, &fsreq, ctx->fd, NULL);
+    const size_t bytes = fsreq.statbuf.st_size;
+    uv_fs_req_cleanup(&fsreq);
+    if (HEDLEY_UNLIKELY(0 > err || off+sz > bytes)) {
+      bin_unmap_(f);
+      return false;
+    }
+  }
+
+  /* the pointer is valid until the callback returns, as well as the others */
+  req->stream.io = (upd_req_stream_io_t) {
+    .offset = off,
+    .size   = sz,
+    .buf    = sz? ctx->map + off: NULL,
+  };
+  req->result = UPD_REQ_OK;
+  req->cb(req);
+  return true;
+}
+
+
+static bool bin_cacheable_(const upd_req_t* req) {
+  upd_file_t* f   = req->file;
+  bin_t_*     ctx = f->ctx;
+
+  /*  Files which can be written through this driver aren't cached,
+   * and large reads go to the kernel directly. */
+  return
+    f->iso->bcache.budget &&
+    !ctx->write &&
+    !ctx->mmap &&
+    req->stream.io.size < UPD_BCACHE_BLOCK;
+}
+
+static bool bin_read_cache_(upd_req_t* req) {
+  upd_file_t* f = req->file;
+
+  const size_t   off   = req->stream.io.offset;
+  const uint64_t index = off / UPD_BCACHE_BLOCK;
+  const size_t   begin = off % UPD_BCACHE_BLOCK;
+
+  const upd_bcache_block_t* b = upd_bcache_find(f->iso, f->id, index);
+  if (HEDLEY_LIKELY(b == NULL || begin >= b->size)) {
+    return false;
+  }
+
+  size_t sz = req->stream.io.size;
+  if (HEDLEY_UNLIKELY(begin+sz > b->size)) {
+    sz = b->size - begin;
+  }
+  req->stream.io = (upd_req_stream_io_t) {
+    .offset = off,
+    .size   = sz,
+    .buf    = b->data + begin,
+  };
+  req->result = UPD_REQ_OK;
+  req->cb(req);
+  return true;
+}
+
+static void bin_readahead_(upd_req_t* req) {
+  upd_file_t* f   = req->file;
+  bin_t_*     ctx = f->ctx;
+  upd_iso_t*  iso = f->iso;
+
+  const size_t off = req->stream.io.offset;
+  const size_t end = off + req->stream.io.size;
+
+  if (HEDLEY_LIKELY(off == ctx->seq.next)) {
+    ++ctx->seq.streak;
+  } else {
+    ctx->seq.streak = 0;
+    ctx->seq.ahead  = 0;
+    ctx->seq.window = READAHEAD_MIN_;
+  }
+  ctx->seq.next = end;
+
+  if (HEDLEY_LIKELY(ctx->seq.streak < READAHEAD_STREAK_ || !ctx->open)) {
+    return;
+  }
+
+  /* prefetches the next window when the half of previous one is consumed */
+  const uint64_t cur = end / UPD_BCACHE_BLOCK;
+  if (HEDLEY_LIKELY(ctx->seq.ahead > cur + ctx->seq.window/2)) {
+    return;
+  }
+
+  const uint64_t last = (ctx->bytes + UPD_BCACHE_BLOCK-1) / UPD_BCACHE_BLOCK;
+
+  uint64_t from = ctx->seq.ahead > cur+1? ctx->seq.ahead: cur+1;
+  uint64_t to   = cur+1 + ctx->seq.window;
+  if (HEDLEY_UNLIKELY(to > last)) {
+    to = last;
+  }
+  if (HEDLEY_UNLIKELY(from >= to)) {
+    return;
+  }
+
+  upd_bcache_block_t*  head = NULL;
+  upd_bcache_block_t** tail = &head;
+  for (uint64_t i = from; i < to; ++i) {
+    upd_bcache_block_t* b = upd_bcache_new(iso, f->id, i);
+    if (HEDLEY_UNLIKELY(b == NULL)) {
+      break;
+    }
+    b->prefetch = true;
+    *tail = b;
+    tail  = &b->next;
+  }
+  if (HEDLEY_UNLIKELY(head == NULL)) {
+    return;
+  }
+
+  const bool ok = task_queue_with_dup_(&(task_t_) {
+      .file  = f,
+      .block = head,
+      .exec  = task_prefetch_exec_cb_,
+    });
+  if (HEDLEY_UNLIKELY(!ok)) {
+    while (head) {
+      upd_bcache_block_t* b = head;
+      head = b->next;
+      upd_free(&b);
+    }
+    return;
+  }
+  ctx->seq.ahead = to;
+  if (HEDLEY_LIKELY(ctx->seq.window < READAHEAD_MAX_)) {
+    ctx->seq.window *= 2;
+  }
+}
+
+static bool bin_write_behind_(upd_req_t* req) {
+  upd_file_t* f   = req->file;
+  bin_t_*     ctx = f->ctx;
+  upd_iso_t*  iso = f->iso;
+
+  const size_t cap = iso->bcache.write_behind;
+  const size_t off = req->stream.io.offset;
+  const size_t sz  = req->stream.io.size;
+  if (HEDLEY_LIKELY(cap == 0 || sz == 0 || sz > cap)) {
+    return false;
+  }
+
+  /* only appending to the buffer is allowed */
+  if (HEDLEY_LIKELY(ctx->wb.size)) {
+    const bool append =
+      ctx->wb.offset + ctx->wb.size == off &&
+      ctx->wb.size + sz <= cap;
+    if (HEDLEY_UNLIKELY(!append && !bin_flush_(f))) {
+      return false;
+    }
+  }
+
+  if (HEDLEY_UNLIKELY(ctx->wb.buf == NULL)) {
+    if (HEDLEY_UNLIKELY(!upd_malloc(&ctx->wb.buf, cap))) {
+      return false;
+    }
+  }
+  if (HEDLEY_LIKELY(ctx->wb.size == 0)) {
+    ctx->wb.offset = off;
+    upd_file_ref(f);  /* for the buffered data */
+    upd_iso_timer_start(
+      iso, &ctx->wb.timer, upd_iso_now(iso) + WRITE_BEHIND_PERIOD_);
+  }
+  memcpy(ctx->wb.buf + ctx->wb.size, req->stream.io.buf, sz);
+  ctx->wb.size += sz;
+
+  if (HEDLEY_UNLIKELY(ctx->wb.size >= cap && !bin_flush_(f))) {
+    /* the data is kept in the buffer and the timer retries */
+    upd_iso_msgf(iso, "upd.bin: write-behind flush failure: %s\n", f->npath);
+  }
+
+  req->result = UPD_REQ_OK;
+  req->cb(req);
+  return true;
+}
+
+static bool bin_flush_(upd_file_t* f) {
+  bin_t_*    ctx = f->ctx;
+  upd_iso_t* iso = f->iso;
+
+  if (HEDLEY_LIKELY(ctx->wb.size == 0)) {
+    return true;
+  }
+  if (HEDLEY_UNLIKELY(!ctx->open && !task_queue_open_(f))) {
+    return false;
+  }
+
+  /* the buffer moves to the task, and the next write allocates new one */
+  const bool ok = task_queue_with_dup_(&(task_t_) {
+      .file   = f,
+      .buf    = ctx->wb.buf,
+      .offset = ctx->wb.offset,
+      .size   = ctx->wb.size,
+      .exec   = task_flush_exec_cb_,
+    });
+  if (HEDLEY_UNLIKELY(!ok)) {
+    return false;
+  }
+  ctx->wb.buf  = NULL;
+  ctx->wb.size = 0;
+  upd_iso_timer_stop(iso, &ctx->wb.timer);
+  return true;
+}
+
+
+static void bin_written_(upd_file_t* f, size_t end, bool truncate) {
+  bin_t_* ctx = f->ctx;
+
+  /* the native watcher ignores writes by ourselves */
+  if (HEDLEY_UNLIKELY(truncate || end > ctx->bytes)) {
+    ctx->bytes = end;
+  }
+  upd_file_trigger(f, UPD_FILE_UPDATE);
+}
+
+
 static bool task_queue_with_dup_(const task_t_* src) {
   upd_file_t* f   = src->file;
   bin_t_*     ctx = f->ctx;
@@ -385,14 +855,15 @@ static bool task_queue_with_dup_(const task_t_* src) {
 
   upd_file_ref(f);
   *task = *src;
-  if (HEDLEY_LIKELY(ctx->last_task)) {
-    ctx->last_task->next = task;
-    ctx->last_task       = task;
+  if (HEDLEY_LIKELY(ctx->tail)) {
+    ctx->tail->next = task;
   } else {
-    ctx->last_task = task;
-    task->exec(task);
+    ctx->head = task;
   }
-  return task;
+  ctx->tail = task;
+
+  task_dispatch_(f);
+  return true;
 }
 
 static bool task_queue_open_(upd_file_t* f) {
@@ -402,27 +873,121 @@ static bool task_queue_open_(upd_file_t* f) {
     });
 }
 
+static bool task_is_barrier_(const task_t_* task) {
+  return
+    task->exec != task_read_exec_cb_ &&
+    task->exec != task_prefetch_exec_cb_;
+}
+
+static void task_dispatch_(upd_file_t* f) {
+  bin_t_* ctx = f->ctx;
+
+  while (ctx->head && !ctx->barrier) {
+    task_t_* task = ctx->head;
+
+    const bool barrier = task_is_barrier_(task);
+    if (HEDLEY_UNLIKELY(barrier && ctx->running)) {
+      break;
+    }
+    if (HEDLEY_UNLIKELY(ctx->running >= READ_PARALLEL_MAX_)) {
+      break;
+    }
+
+    ctx->head = task->next;
+    if (HEDLEY_UNLIKELY(ctx->head == NULL)) {
+      ctx->tail = NULL;
+    }
+    task->next = NULL;
+
+    ++ctx->running;
+    ctx->barrier = barrier;
+    task->exec(task);
+  }
+}
+
 static void task_finalize_(task_t_* task) {
   upd_file_t* f   = task->file;
   bin_t_*     ctx = f->ctx;
   upd_iso_t*  iso = f->iso;
 
-  if (HEDLEY_UNLIKELY(ctx->last_task == task)) {
-    ctx->last_task = NULL;
-  } else if (HEDLEY_UNLIKELY(task->next)) {
-    task->next->exec(task->next);
+  assert(ctx->running);
+  --ctx->running;
+  if (HEDLEY_UNLIKELY(task_is_barrier_(task))) {
+    ctx->barrier = false;
   }
   upd_iso_unstack(iso, task);
+
+  /* keeps the file alive while dispatching */
+  task_dispatch_(f);
   upd_file_unref(f);
 }
 
 
+/* The size must be taken from the opened fd, or pages past EOF raise SIGBUS. */
+static void bin_map_(upd_file_t* f, size_t size) {
+  bin_t_*    ctx = f->ctx;
+  upd_iso_t* iso = f->iso;
+
+  if (HEDLEY_LIKELY(!ctx->mmap || !ctx->open || size == 0)) {
+    return;
+  }
+#if BIN_USE_MMAP_
+  void* ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, ctx->fd, 0);
+  if (HEDLEY_UNLIKELY(ptr == MAP_FAILED)) {
+    /* uv_fs_read is used instead */
+    upd_iso_msgf(iso, "upd.bin.mmap: mmap failure: %s\n", f->npath);
+    return;
+  }
+  ctx->map   = ptr;
+  ctx->mapsz = size;
+#else
+  (void) iso;
+#endif
+}
+
+static void bin_unmap_(upd_file_t* f) {
+  bin_t_* ctx = f->ctx;
+
+  if (HEDLEY_LIKELY(ctx->map == NULL)) {
+    return;
+  }
+#if BIN_USE_MMAP_
+  munmap(ctx->map, ctx->mapsz);
+#endif
+  ctx->map   = NULL;
+  ctx->mapsz = 0;
+}
+
+static void bin_drop_blocks_(upd_file_t* f) {
+  bin_t_* ctx = f->ctx;
+
+  upd_bcache_drop(f->iso, &ctx->blocks);
+  ++ctx->gen;
+}
+
+
 static void bin_watch_cb_(upd_file_watch_t* watch) {
   upd_file_t* f   = watch->file;
   bin_t_*     ctx = f->ctx;
 
   switch (watch->event) {
-  case UPD_FILE_UPDATE_N:
+  case UPD_FILE_UPDATE_N: {
+    /*  Buffered data is older than the native change, so it's discarded
+     * instead of overwriting the change. */
+    const bool discard = ctx->wb.size;
+    if (HEDLEY_UNLIKELY(discard)) {
+      upd_iso_msgf(f->iso,
+        "upd.bin: write-behind data discarded by a native change: %s\n",
+        f->npath);
+      ctx->wb.size = 0;
+      ctx->wb.lost = true;
+      upd_iso_timer_stop(f->iso, &ctx->wb.timer);
+    }
+
+    /*  The file may have been shrunk, so reads go to uv_fs_read until
+     * it's mapped again with the new size after reopening. */
+    bin_unmap_(f);
+    bin_drop_blocks_(f);
     task_queue_with_dup_(&(task_t_) {
         .file = f,
         .exec = task_stat_exec_cb_,
@@ -438,9 +1003,14 @@ static void bin_watch_cb_(upd_file_watch_t* watch) {
         });
     }
     upd_file_trigger(f, UPD_FILE_UPDATE);
-    break;
+
+    if (HEDLEY_UNLIKELY(discard)) {
+      upd_file_unref(f);  /* for the buffered data */
+    }
+  } break;
 
   case UPD_FILE_UNCACHE:
+    bin_flush_(f);
     if (HEDLEY_UNLIKELY(ctx->open)) {
       task_queue_with_dup_(&(task_t_) {
           .file = f,
@@ -451,6 +1021,17 @@ static void bin_watch_cb_(upd_file_watch_t* watch) {
   }
 }
 
+static void bin_wb_timer_cb_(upd_iso_timer_t* t) {
+  upd_file_t* f   = t->udata;
+  upd_iso_t*  iso = f->iso;
+
+  if (HEDLEY_UNLIKELY(!bin_flush_(f))) {
+    /* retries later */
+    upd_iso_msgf(iso, "upd.bin: write-behind flush failure: %s\n", f->npath);
+    upd_iso_timer_start(iso, t, upd_iso_now(iso) + WRITE_BEHIND_PERIOD_);
+  }
+}
+
 static void bin_deinit_close_cb_(uv_fs_t* fsreq) {
   upd_iso_t* iso = fsreq->data;
   upd_iso_unstack(iso, fsreq);
@@ -485,7 +1066,11 @@ static void task_stat_cb_(uv_fs_t* fsreq) {
     goto EXIT;
   }
 
-  ctx->bytes = bytes;
+  /*  Stat is a barrier, so blocks filled by the reads running when the file
+   * was updated are dropped here. */
+  bin_drop_blocks_(f);
+  ctx->seq.ahead = 0;
+  ctx->bytes     = bytes;
 
 EXIT:
   task_finalize_(task);
@@ -527,10 +1112,35 @@ static void task_open_cb_(uv_fs_t* fsreq) {
   ctx->fd   = result;
   ctx->open = true;
 
+  /* the size known before opening can be stale */
+  if (HEDLEY_UNLIKELY(ctx->mmap)) {
+    const int err = uv_fs_fstat(
+      &f->iso->loop, &task->fsreq, ctx->fd, task_open_fstat_cb_);
+    if (HEDLEY_LIKELY(0 <= err)) {
+      return;
+    }
+  }
+
 EXIT:
   task_finalize_(task);
 }
 
+static void task_open_fstat_cb_(uv_fs_t* fsreq) {
+  task_t_*    task = (void*) fsreq;
+  upd_file_t* f    = task->file;
+  bin_t_*     ctx  = f->ctx;
+
+  const ssize_t result = fsreq->result;
+  const size_t  bytes  = fsreq->statbuf.st_size;
+  uv_fs_req_cleanup(fsreq);
+
+  if (HEDLEY_LIKELY(result >= 0)) {
+    ctx->bytes = bytes;
+    bin_map_(f, bytes);
+  }
+  task_finalize_(task);
+}
+
 static void task_read_exec_cb_(task_t_* task) {
   upd_file_t* f    = task->file;
   upd_req_t*  req  = task->req;
@@ -542,6 +1152,11 @@ static void task_read_exec_cb_(task_t_* task) {
     goto ABORT;
   }
 
+  if (HEDLEY_LIKELY(ctx->map && bin_read_map_(req))) {
+    task_finalize_(task);
+    return;
+  }
+
   const size_t off = req->stream.io.offset;
 
   size_t sz = req->stream.io.size;
@@ -556,18 +1171,37 @@ static void task_read_exec_cb_(task_t_* task) {
     goto ABORT;
   }
 
-  task->buf = upd_iso_stack(iso, sz);
-  if (HEDLEY_UNLIKELY(task->buf == NULL)) {
-    req->result = UPD_REQ_NOMEM;
-    goto ABORT;
+  /* reads the whole block containing the offset to fill the cache */
+  size_t boff = off;
+  if (HEDLEY_LIKELY(bin_cacheable_(req))) {
+    const uint64_t index = off / UPD_BCACHE_BLOCK;
+
+    task->block = upd_bcache_new(iso, f->id, index);
+    if (HEDLEY_LIKELY(task->block)) {
+      task->buf = task->block->data;
+      boff = index*UPD_BCACHE_BLOCK;
+      sz   = UPD_BCACHE_BLOCK;
+    }
+  }
+  if (HEDLEY_LIKELY(task->buf == NULL)) {
+    task->buf = upd_iso_stack(iso, sz);
+    if (HEDLEY_UNLIKELY(task->buf == NULL)) {
+      req->result = UPD_REQ_NOMEM;
+      goto ABORT;
+    }
   }
 
   const uv_buf_t buf = uv_buf_init((char*) task->buf, sz);
 
+  task->gen = ctx->gen;
   const int err = uv_fs_read(
-    &iso->loop, &task->fsreq, ctx->fd, &buf, 1, off, task_read_cb_);
+    &iso->loop, &task->fsreq, ctx->fd, &buf, 1, boff, task_read_cb_);
   if (HEDLEY_UNLIKELY(0 > err)) {
-    upd_iso_unstack(iso, task->buf);
+    if (HEDLEY_LIKELY(task->block)) {
+      upd_free(&task->block);
+    } else {
+      upd_iso_unstack(iso, task->buf);
+    }
     req->result = UPD_REQ_ABORTED;
     goto ABORT;
   }
@@ -583,6 +1217,7 @@ static void task_read_cb_(uv_fs_t* fsreq) {
   task_t_*    task = (void*) fsreq;
   upd_file_t* f    = task->file;
   upd_req_t*  req  = task->req;
+  bin_t_*     ctx  = f->ctx;
   upd_iso_t*  iso  = f->iso;
 
   const ssize_t result = fsreq->result;
@@ -595,16 +1230,107 @@ static void task_read_cb_(uv_fs_t* fsreq) {
   }
 
   const size_t off = req->stream.io.offset;
-  req->stream.io = (upd_req_stream_io_t) {
-    .offset = off,
-    .size   = result,
-    .buf    = task->buf,
-  };
+  if (HEDLEY_LIKELY(task->block)) {
+    upd_bcache_block_t* b = task->block;
+    b->size = result;
+
+    const size_t begin = off % UPD_BCACHE_BLOCK;
+
+    size_t sz = req->stream.io.size;
+    if (HEDLEY_UNLIKELY(begin+sz > b->size)) {
+      sz = b->size > begin? b->size-begin: 0;
+    }
+    req->stream.io = (upd_req_stream_io_t) {
+      .offset = off,
+      .size   = sz,
+      .buf    = b->data + begin,
+    };
+  } else {
+    req->stream.io = (upd_req_stream_io_t) {
+      .offset = off,
+      .size   = result,
+      .buf    = task->buf,
+    };
+  }
   req->result = UPD_REQ_OK;
 
 EXIT:
   req->cb(req);
-  upd_iso_unstack(iso, task->buf);
+  if (HEDLEY_LIKELY(task->block)) {
+    /*  The block may have been filled before the blocks were dropped, and
+     * it must not be touched after this. */
+    if (HEDLEY_LIKELY(result >= 0 && task->gen == ctx->gen)) {
+      upd_bcache_insert(iso, &ctx->blocks, task->block);
+    } else {
+      upd_free(&task->block);
+    }
+  } else {
+    upd_iso_unstack(iso, task->buf);
+  }
+  task_finalize_(task);
+}
+
+static void task_prefetch_exec_cb_(task_t_* task) {
+  upd_file_t* f   = task->file;
+  bin_t_*     ctx = f->ctx;
+  upd_iso_t*  iso = f->iso;
+
+  if (HEDLEY_UNLIKELY(!ctx->open)) {
+    goto ABORT;
+  }
+
+  uv_buf_t bufs[READAHEAD_MAX_];
+  size_t   n = 0;
+  for (upd_bcache_block_t* b = task->block; b; b = b->next) {
+    bufs[n++] = uv_buf_init((char*) b->data, UPD_BCACHE_BLOCK);
+  }
+  const size_t off = task->block->index*UPD_BCACHE_BLOCK;
+
+  task->gen = ctx->gen;
+  const int err = uv_fs_read(
+    &iso->loop, &task->fsreq, ctx->fd, bufs, n, off, task_prefetch_cb_);
+  if (HEDLEY_UNLIKELY(0 > err)) {
+    goto ABORT;
+  }
+  return;
+
+ABORT:
+  while (task->block) {
+    upd_bcache_block_t* b = task->block;
+    task->block = b->next;
+    upd_free(&b);
+  }
+  task_finalize_(task);
+}
+
+static void task_prefetch_cb_(uv_fs_t* fsreq) {
+  task_t_*    task = (void*) fsreq;
+  upd_file_t* f    = task->file;
+  bin_t_*     ctx  = f->ctx;
+  upd_iso_t*  iso  = f->iso;
+
+  const ssize_t result = fsreq->result;
+  uv_fs_req_cleanup(fsreq);
+
+  /* blocks filled before the blocks were dropped are stale */
+  const bool stale = task->gen != ctx->gen;
+
+  size_t remain = result > 0? (size_t) result: 0;
+  while (task->block) {
+    upd_bcache_block_t* b = task->block;
+    task->block = b->next;
+
+    /*  Blocks left unfilled by errors or EOF are freed directly, because
+     * inserting them counts them as wasted prefetch. */
+    if (HEDLEY_UNLIKELY(stale || remain == 0)) {
+      upd_free(&b);
+      continue;
+    }
+    b->next = NULL;
+    b->size = remain > UPD_BCACHE_BLOCK? UPD_BCACHE_BLOCK: remain;
+    remain -= b->size;
+    upd_bcache_insert(iso, &ctx->blocks, b);
+  }
   task_finalize_(task);
 }
 
@@ -618,42 +1344,150 @@ static void task_write_exec_cb_(task_t_* task) {
     goto ABORT;
   }
 
-  const size_t sz  = req->stream.io.size;
+  uv_buf_t bufs[WRITE_MERGE_MAX_];
+  size_t   n = 0;
+
   const size_t off = req->stream.io.offset;
+  size_t       end = off + req->stream.io.size;
+  bufs[n++] = uv_buf_init((char*) req->stream.io.buf, req->stream.io.size);
+
+  /*  Merges the following writes to the adjacent region into one syscall,
+   * and the merged tasks are chained by next. */
+  task_t_* last = task;
+  while (ctx->head && n < WRITE_MERGE_MAX_) {
+    task_t_* t = ctx->head;
+    if (HEDLEY_LIKELY(t->exec != task_write_exec_cb_)) {
+      break;
+    }
+    const upd_req_stream_io_t* io = &t->req->stream.io;
+    if (HEDLEY_LIKELY(io->offset != end)) {
+      break;
+    }
 
-  const uv_buf_t buf = uv_buf_init((char*) req->stream.io.buf, sz);
+    ctx->head = t->next;
+    if (HEDLEY_UNLIKELY(ctx->head == NULL)) {
+      ctx->tail = NULL;
+    }
+    t->next    = NULL;
+    last->next = t;
+    last       = t;
+
+    bufs[n++] = uv_buf_init((char*) io->buf, io->size);
+    end      += io->size;
+  }
+
+  upd_nwatch_begin_write(f);
 
   const int err = uv_fs_write(
-    &iso->loop, &task->fsreq, ctx->fd, &buf, 1, off, task_write_cb_);
+    &iso->loop, &task->fsreq, ctx->fd, bufs, n, off, task_write_cb_);
   if (HEDLEY_UNLIKELY(0 > err)) {
+    upd_nwatch_end_write(f);
     goto ABORT;
   }
   return;
 
 ABORT:
-  req->stream.io.size = 0;
-  req->result = UPD_REQ_ABORTED;
-  req->cb(req);
-  task_finalize_(task);
+  task_write_complete_(task, -1);
 }
 
 static void task_write_cb_(uv_fs_t* fsreq) {
-  task_t_*   task = (void*) fsreq;
-  upd_req_t* req  = task->req;
+  task_t_* task = (void*) fsreq;
 
   const ssize_t result = fsreq->result;
   uv_fs_req_cleanup(fsreq);
 
-  if (HEDLEY_UNLIKELY(result < 0)) {
-    req->stream.io.size = 0;
-    req->result = UPD_REQ_ABORTED;
-    goto EXIT;
+  upd_nwatch_end_write(task->file);
+  task_write_complete_(task, result);
+}
+
+static void task_write_complete_(task_t_* task, ssize_t result) {
+  upd_file_t* f   = task->file;
+  upd_iso_t*  iso = f->iso;
+
+  size_t remain = result > 0? (size_t) result: 0;
+
+  const size_t end = task->req->stream.io.offset + remain;
+
+  task_t_* t = task;
+  while (t) {
+    task_t_*   next = t->next;
+    upd_req_t* req  = t->req;
+
+    if (HEDLEY_UNLIKELY(result < 0)) {
+      req->stream.io.size = 0;
+      req->result = UPD_REQ_ABORTED;
+    } else {
+      if (HEDLEY_UNLIKELY(req->stream.io.size > remain)) {
+        req->stream.io.size = remain;
+      }
+      remain -= req->stream.io.size;
+      req->result = UPD_REQ_OK;
+    }
+    req->cb(req);
+
+    /* the merged tasks are not counted as running */
+    if (HEDLEY_LIKELY(t != task)) {
+      upd_iso_unstack(iso, t);
+      upd_file_unref(f);
+    }
+    t = next;
   }
-  req->result = UPD_REQ_OK;
-  req->stream.io.size = result;
+  task->next = NULL;
 
-EXIT:
-  req->cb(req);
+  if (HEDLEY_LIKELY(result > 0)) {
+    bin_written_(f, end, false);
+  }
+  task_finalize_(task);
+}
+
+static void task_flush_exec_cb_(task_t_* task) {
+  upd_file_t* f   = task->file;
+  bin_t_*     ctx = f->ctx;
+  upd_iso_t*  iso = f->iso;
+
+  if (HEDLEY_UNLIKELY(!ctx->open)) {
+    goto ABORT;
+  }
+
+  const uv_buf_t buf = uv_buf_init((char*) task->buf, task->size);
+
+  upd_nwatch_begin_write(f);
+
+  const int err = uv_fs_write(
+    &iso->loop, &task->fsreq, ctx->fd, &buf, 1, task->offset, task_flush_cb_);
+  if (HEDLEY_UNLIKELY(0 > err)) {
+    upd_nwatch_end_write(f);
+    goto ABORT;
+  }
+  return;
+
+ABORT:
+  upd_iso_msgf(iso, "upd.bin: write-behind data lost: %s\n", f->npath);
+  ctx->wb.lost = true;
+  upd_free(&task->buf);
+  upd_file_unref(f);  /* for the buffered data */
+  task_finalize_(task);
+}
+
+static void task_flush_cb_(uv_fs_t* fsreq) {
+  task_t_*    task = (void*) fsreq;
+  upd_file_t* f    = task->file;
+  bin_t_*     ctx  = f->ctx;
+  upd_iso_t*  iso  = f->iso;
+
+  const ssize_t result = fsreq->result;
+  uv_fs_req_cleanup(fsreq);
+
+  upd_nwatch_end_write(f);
+  if (HEDLEY_UNLIKELY(result < 0 || (size_t) result != task->size)) {
+    upd_iso_msgf(iso, "upd.bin: write-behind data lost: %s\n", f->npath);
+    ctx->wb.lost = true;
+  }
+  if (HEDLEY_LIKELY(result > 0)) {
+    bin_written_(f, task->offset + result, false);
+  }
+  upd_free(&task->buf);
+  upd_file_unref(f);  /* for the buffered data */
   task_finalize_(task);
 }
 
@@ -669,9 +1503,12 @@ static void task_truncate_exec_cb_(task_t_* task) {
 
   const size_t size = req->stream.io.size;
 
+  upd_nwatch_begin_write(f);
+
   const int err = uv_fs_ftruncate(
     &iso->loop, &task->fsreq, ctx->fd, size, task_truncate_cb_);
   if (HEDLEY_UNLIKELY(0 > err)) {
+    upd_nwatch_end_write(f);
     goto ABORT;
   }
   return;
@@ -689,10 +1526,13 @@ static void task_truncate_cb_(uv_fs_t* fsreq) {
   const ssize_t result = fsreq->result;
   uv_fs_req_cleanup(fsreq);
 
+  upd_nwatch_end_write(task->file);
+
   if (HEDLEY_UNLIKELY(result < 0)) {
     req->result = UPD_REQ_ABORTED;
     goto EXIT;
   }
+  bin_written_(task->file, req->stream.io.size, true);
   req->result = UPD_REQ_OK;
 
 EXIT:
@@ -725,6 +1565,7 @@ static void task_close_cb_(uv_fs_t* fsreq) {
   upd_file_t* f    = task->file;
   bin_t_*     ctx  = f->ctx;
 
+  bin_unmap_(f);
   ctx->open = false;
   task_finalize_(task);
 }
@@ -1,9 +1,22 @@
 #include "common.h"
 
 
-typedef struct dir_t_ {
+typedef struct dir_t_   dir_t_;
+typedef struct entry_t_ entry_t_;
+
+struct dir_t_ {
   upd_array_of(upd_req_dir_entry_t*) children;
-} dir_t_;
+
+  upd_htable_t names;
+  upd_htable_t files;  /* the same file can be added with different names */
+};
+
+struct entry_t_ {
+  upd_req_dir_entry_t super;  /* must be the first member */
+
+  uint64_t hash;   /* of the name */
+  size_t   index;  /* in the children */
+};
 
 
 static
@@ -34,34 +47,53 @@ const upd_driver_t upd_driver_dir = {
 
 
 static
-upd_req_dir_entry_t*
+bool
+dir_add_(
+  dir_t_*   ctx,
+  entry_t_* e);
+
+static
+void
+dir_remove_(
+  dir_t_*   ctx,
+  entry_t_* e);
+
+static
+uint64_t
+dir_hash_name_(
+  const void* item);
+
+static
+uint64_t
+dir_hash_file_(
+  const void* item);
+
+static
+entry_t_*
 entry_dup_(
   const upd_req_dir_entry_t* src);
 
 static
 void
 entry_delete_(
-  upd_req_dir_entry_t* e);
+  entry_t_* e);
 
 static
-bool
+entry_t_*
 entry_find_(
   dir_t_*                    ctx,
-  size_t*                    i,
   const upd_req_dir_entry_t* e);
 
 static
-bool
+entry_t_*
 entry_find_by_file_(
   dir_t_*     ctx,
-  size_t*     i,
   upd_file_t* f);
 
 static
-bool
+entry_t_*
 entry_find_by_name_(
   dir_t_*        ctx,
-  size_t*        i,
   const uint8_t* name,
   size_t         len);
 
@@ -71,7 +103,10 @@ static bool dir_init_(upd_file_t* f) {
   if (HEDLEY_UNLIKELY(!upd_malloc(&ctx, sizeof(*ctx)))) {
     return false;
   }
-  *ctx = (dir_t_) {0};
+  *ctx = (dir_t_) {
+    .names = { .hash = dir_hash_name_, },
+    .files = { .hash = dir_hash_file_, },
+  };
   f->ctx = ctx;
   return true;
 }
@@ -82,6 +117,8 @@ static void dir_deinit_(upd_file_t* f) {
     entry_delete_(ctx->children.p[i]);
   }
   upd_array_clear(&ctx->children);
+  upd_htable_clear(&ctx->names);
+  upd_htable_clear(&ctx->files);
   upd_free(&ctx);
 }
 
@@ -109,9 +146,9 @@ static bool dir_handle_(upd_req_t* req) {
     break;
 
   case UPD_REQ_DIR_FIND: {
-    size_t i;
-    if (HEDLEY_LIKELY(entry_find_(ctx, &i, &req->dir.entry))) {
-      req->dir.entry = *(upd_req_dir_entry_t*) ctx->children.p[i];
+    const entry_t_* e = entry_find_(ctx, &req->dir.entry);
+    if (HEDLEY_LIKELY(e)) {
+      req->dir.entry = e->super;
     } else {
       req->dir.entry = (upd_req_dir_entry_t) {0};
     }
@@ -127,25 +164,24 @@ static bool dir_handle_(upd_req_t* req) {
       return false;
     }
 
-    size_t i;
-    if (HEDLEY_UNLIKELY(entry_find_by_name_(ctx, &i, re->name, re->len))) {
+    if (HEDLEY_UNLIKELY(entry_find_by_name_(ctx, re->name, re->len))) {
       req->result = UPD_REQ_ABORTED;
       return false;
     }
 
-    upd_req_dir_entry_t* e = entry_dup_(&req->dir.entry);
+    entry_t_* e = entry_dup_(&req->dir.entry);
 
     req->dir.entry = (upd_req_dir_entry_t) {0};
     if (HEDLEY_UNLIKELY(e == NULL)) {
       req->result = UPD_REQ_NOMEM;
       return false;
     }
-    if (HEDLEY_UNLIKELY(!upd_array_insert(&ctx->children, e, SIZE_MAX))) {
+    if (HEDLEY_UNLIKELY(!dir_add_(ctx, e))) {
       entry_delete_(e);
       req->result = UPD_REQ_NOMEM;
       return false;
     }
-    req->dir.entry = *e;
+    req->dir.entry = e->super;
   } break;
 
   case UPD_REQ_DIR_NEWDIR: {
@@ -158,8 +194,7 @@ static bool dir_handle_(upd_req_t* req) {
       return false;
     }
 
-    size_t i;
-    if (HEDLEY_UNLIKELY(entry_find_by_name_(ctx, &i, re.name, re.len))) {
+    if (HEDLEY_UNLIKELY(entry_find_by_name_(ctx, re.name, re.len))) {
       req->result = UPD_REQ_ABORTED;
       return false;
     }
@@ -172,30 +207,34 @@ static bool dir_handle_(upd_req_t* req) {
       req->result = UPD_REQ_NOMEM;
       return false;
     }
-    upd_req_dir_entry_t* e = entry_dup_(&re);
+    entry_t_* e = entry_dup_(&re);
     upd_file_unref(re.file);
     if (HEDLEY_UNLIKELY(e == NULL)) {
       req->result = UPD_REQ_NOMEM;
       return false;
     }
 
-    if (HEDLEY_UNLIKELY(!upd_array_insert(&ctx->children, e, SIZE_MAX))) {
+    if (HEDLEY_UNLIKELY(!dir_add_(ctx, e))) {
       entry_delete_(e);
       req->result = UPD_REQ_NOMEM;
       return false;
     }
-    req->dir.entry = *e;
+    req->dir.entry = e->super;
   } break;
 
   case UPD_REQ_DIR_RM: {
-    size_t i;
-    if (HEDLEY_UNLIKELY(!entry_find_(ctx, &i, &req->dir.entry))) {
+    entry_t_* e = entry_find_(ctx, &req->dir.entry);
+    if (HEDLEY_UNLIKELY(e == NULL)) {
       req->result = UPD_REQ_ABORTED;
       req->dir.entry = (upd_req_dir_entry_t) {0};
       return false;
     }
-    upd_req_dir_entry_t* e = upd_array_remove(&ctx->children, i);
-    req->dir.entry = *e;
+    dir_remove_(ctx, e);
+
+    /* cached paths may go through the removed entry */
+    upd_dcache_invalidate(f);
+
+    req->dir.entry = e->super;
     req->cb(req);
     entry_delete_(e);
   } return true;
@@ -210,49 +249,106 @@ static bool dir_handle_(upd_req_t* req) {
 }
 
 
-static upd_req_dir_entry_t* entry_dup_(const upd_req_dir_entry_t* src) {
-  upd_req_dir_entry_t* e = NULL;
+
+static bool dir_add_(dir_t_* ctx, entry_t_* e) {
+  if (HEDLEY_UNLIKELY(!upd_htable_insert(&ctx->names, e))) {
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(!upd_htable_insert(&ctx->files, e))) {
+    upd_htable_remove(&ctx->names, e);
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&ctx->children, e, SIZE_MAX))) {
+    upd_htable_remove(&ctx->files, e);
+    upd_htable_remove(&ctx->names, e);
+    return false;
+  }
+  e->index = ctx->children.n-1;
+  return true;
+}
+
+static void dir_remove_(dir_t_* ctx, entry_t_* e) {
+  upd_htable_remove(&ctx->names, e);
+  upd_htable_remove(&ctx->files, e);
+
+  /* swaps with the last one to remove in O(1) */
+  entry_t_* last = ctx->children.p[ctx->children.n-1];
+  assert(ctx->children.p[e->index] == e);
+
+  ctx->children.p[e->index] = last;
+  last->index = e->index;
+  upd_array_remove(&ctx->children, ctx->children.n-1);
+}
+
+
+static uint64_t dir_hash_name_(const void* item) {
+  const entry_t_* e = item;
+  return e->hash;
+}
+
+static uint64_t dir_hash_file_(const void* item) {
+  const entry_t_* e = item;
+  return upd_htable_hash_ptr(e->super.file);
+}
+
+
+static entry_t_* entry_dup_(const upd_req_dir_entry_t* src) {
+  entry_t_* e = NULL;
   if (HEDLEY_UNLIKELY(!upd_malloc(&e, sizeof(*e)+src->len+1))) {
     return NULL;
   }
-  *e = *src;
-  e->name = (uint8_t*) (e+1);
+  *e = (entry_t_) {
+    .super = *src,
+    .hash  = upd_htable_hash_str(src->name, src->len),
+  };
+  e->super.name = (uint8_t*) (e+1);
 
-  utf8ncpy(e->name, src->name, src->len);
-  e->name[src->len] = 0;
+  utf8ncpy(e->super.name, src->name, src->len);
+  e->super.name[src->len] = 0;
 
-  upd_file_ref(e->file);
+  upd_file_ref(e->super.file);
   return e;
 }
 
-static void entry_delete_(upd_req_dir_entry_t* e) {
-  upd_file_unref(e->file);
+static void entry_delete_(entry_t_* e) {
+  upd_file_unref(e->super.file);
   upd_free(&e);
 }
 
-static bool entry_find_(dir_t_* ctx, size_t* i, const upd_req_dir_entry_t* e) {
+static entry_t_* entry_find_(dir_t_* ctx, const upd_req_dir_entry_t* e) {
   return e->file?
-    entry_find_by_file_(ctx, i, e->file):
-    entry_find_by_name_(ctx, i, e->name, e->len);
+    entry_find_by_file_(ctx, e->file):
+    entry_find_by_name_(ctx, e->name, e->len);
 }
 
-static bool entry_find_by_file_(dir_t_* ctx, size_t* i, upd_file_t* f) {
-  for (*i = 0; *i < ctx->children.n; ++*i) {
-    const upd_req_dir_entry_t* e = ctx->children.p[*i];
-    if (HEDLEY_UNLIKELY(e->file == f)) {
-      return true;
+/* Returns the first one added if the file has some names. */
+static entry_t_* entry_find_by_file_(dir_t_* ctx, upd_file_t* f) {
+  const uint64_t h = upd_htable_hash_ptr(f);
+
+  size_t    i = SIZE_MAX;
+  entry_t_* e;
+  while ((e = upd_htable_next(&ctx->files, h, &i))) {
+    if (HEDLEY_LIKELY(e->super.file == f)) {
+      return e;
     }
   }
-  return false;
+  return NULL;
 }
 
-static bool entry_find_by_name_(
-    dir_t_* ctx, size_t* i, const uint8_t* name, size_t len) {
-  for (*i = 0; *i < ctx->children.n; ++*i) {
-    const upd_req_dir_entry_t* e = ctx->children.p[*i];
-    if (HEDLEY_UNLIKELY(e->len == len && utf8ncmp(e->name, name, len) == 0)) {
-      return true;
+static entry_t_* entry_find_by_name_(
+    dir_t_* ctx, const uint8_t* name, size_t len) {
+  const uint64_t h = upd_htable_hash_str(name, len);
+
+  size_t    i = SIZE_MAX;
+  entry_t_* e;
+  while ((e = upd_htable_next(&ctx->names, h, &i))) {
+    const bool match =
+      e->hash      == h   &&
+      e->super.len == len &&
+      utf8ncmp(e->super.name, name, len) == 0;
+    if (HEDLEY_LIKELY(match)) {
+      return e;
     }
   }
-  return false;
+  return NULL;
 }
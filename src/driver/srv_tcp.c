@@ -1,22 +1,99 @@
 #include "common.h"
 
+#if defined(__unix__)
+# include <errno.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <unistd.h>
+#endif
+
+#if defined(__unix__) && defined(SO_REUSEPORT)
+# define SRV_USE_THREADS_ 1
+#endif
+
 
 #define TCP_BACKLOG_ 255
 
+/* connections accepted by the other threads wait in the queue of this size */
+#define ACCEPT_QUEUE_ TCP_BACKLOG_
+
+/* clients over the concurrency are refused when this many are waiting */
+#define WAITING_MAX_ 1024
+
+/*  Stream output is not read while more than WQ_HIGH_ bytes are queued on
+ * the socket, and resumes when the queue drains under WQ_LOW_. */
+#define WQ_HIGH_ (1024*256)  /* = 256 KiB */
+#define WQ_LOW_  (1024*64)   /* =  64 KiB */
+
+/*  The socket is not read while more than RQ_HIGH_ bytes are being written
+ * to the stream, and resumes when they decrease under RQ_LOW_. */
+#define RQ_HIGH_ (1024*256)  /* = 256 KiB */
+#define RQ_LOW_  (1024*64)   /* =  64 KiB */
+
+
+
+typedef union sock_t_ {
+  uv_tcp_t    tcp;
+  uv_pipe_t   pipe;
+  uv_stream_t stream;
+} sock_t_;
+
+/*  Listens the same port as the server on its own loop, and hands accepted
+ * connections to the loop owning all files, which are never touched from the
+ * other threads. */
+typedef struct acceptor_t_ {
+  uv_thread_t thread;
+  uv_loop_t   loop;
+  uv_tcp_t    tcp;
+  uv_async_t  stop;
+
+  struct srv_t_* srv;
+} acceptor_t_;
 
 typedef struct srv_t_ {
-  uv_tcp_t tcp;
+  sock_t_ sock;
+
+  size_t handles;  /* of uv, the context is freed when all are closed */
+
+  /* driver of clients accepted by this server */
+  const upd_driver_t* cli;
 
   upd_file_watch_t watch;
 
   upd_file_t* prog;
   uint16_t    port;
 
+  uint8_t* npath;  /* of the unix socket, removed at deinit */
+
+  upd_driver_srv_opts_t opts;
+
+  /* executed streams waiting for clients */
+  struct {
+    upd_array_of(upd_file_t*) idle;
+    unsigned filling : 1;
+  } pool;
+
+  /* used only when concurrent executions are allowed */
+  size_t                    execs;    /* in progress */
+  upd_array_of(upd_file_t*) waiting;  /* clients over the concurrency */
+
+  /* connections accepted by the other threads, fds are guarded by mtx */
+  struct {
+    acceptor_t_* threads;
+    size_t       n;
+
+    uv_async_t async;
+    uv_mutex_t mtx;
+
+    uv_os_sock_t fds[ACCEPT_QUEUE_];
+    size_t       nfds;
+  } accept;
+
   unsigned running : 1;
 } srv_t_;
 
 typedef struct cli_t_ {
-  uv_tcp_t      tcp;
+  sock_t_       sock;
   uv_shutdown_t shutdown;
 
   upd_file_watch_t watch;
@@ -24,6 +101,23 @@ typedef struct cli_t_ {
 
   upd_file_lock_t k;
   upd_file_t*     srv;
+
+  unsigned concurrent : 1;  /* program is not locked while executing */
+  unsigned pooled     : 1;  /* stream is taken from the pool */
+
+  /*  size class of the next receive buffer, which starts from the smallest
+   * and grows while reads fill the buffer */
+  size_t rcls;
+
+  size_t writes;   /* number of uv_write in progress */
+  size_t inbytes;  /* bytes being written to the stream */
+
+  /* WebSocket protocol state only for upd.srv.ws */
+  upd_driver_srv_ws_t* ws;
+
+  unsigned closed   : 1;
+  unsigned wpending : 1;  /* stream has been updated while paused */
+  unsigned rpaused  : 1;
 } cli_t_;
 
 
@@ -50,6 +144,22 @@ const upd_driver_t upd_driver_srv_tcp = {
   .handle = srv_handle_,
 };
 
+const upd_driver_t upd_driver_srv_ws = {
+  .name   = (uint8_t*) "upd.srv.ws",
+  .cats   = (upd_req_cat_t[]) {0},
+  .init   = srv_init_,
+  .deinit = srv_deinit_,
+  .handle = srv_handle_,
+};
+
+const upd_driver_t upd_driver_srv_unix = {
+  .name   = (uint8_t*) "upd.srv.unix",
+  .cats   = (upd_req_cat_t[]) {0},
+  .init   = srv_init_,
+  .deinit = srv_deinit_,
+  .handle = srv_handle_,
+};
+
 
 static
 bool
@@ -74,12 +184,142 @@ static const upd_driver_t cli_ = {
   .handle = cli_handle_,
 };
 
+static const upd_driver_t cli_ws_ = {
+  .name   = (uint8_t*) "upd.srv.ws.cli_",
+  .cats   = (upd_req_cat_t[]) {0},
+  .init   = cli_init_,
+  .deinit = cli_deinit_,
+  .handle = cli_handle_,
+};
+
+static const upd_driver_t cli_pipe_ = {
+  .name   = (uint8_t*) "upd.srv.unix.cli_",
+  .cats   = (upd_req_cat_t[]) {0},
+  .init   = cli_init_,
+  .deinit = cli_deinit_,
+  .handle = cli_handle_,
+};
+
+/* receives handles passed by SCM_RIGHTS as new clients */
+static const upd_driver_t cli_ipc_ = {
+  .name   = (uint8_t*) "upd.srv.unix.cli_ipc_",
+  .cats   = (upd_req_cat_t[]) {0},
+  .init   = cli_init_,
+  .deinit = cli_deinit_,
+  .handle = cli_handle_,
+};
+
+
+static
+bool
+srv_reuse_port_(
+  uv_handle_t* handle);
+
+static
+bool
+srv_unix_stale_(
+  const uint8_t* path);
+
+static
+bool
+srv_start_threads_(
+  upd_file_t*            f,
+  const struct sockaddr* addr);
+
+static
+void
+srv_stop_threads_(
+  srv_t_* srv);
+
+static
+upd_file_t*
+srv_tcp_new_(
+  upd_file_t*                  prog,
+  const upd_driver_t*          driver,
+  const uint8_t*               host,
+  uint16_t                     port,
+  const upd_driver_srv_opts_t* opts);
+
+static
+upd_file_t*
+srv_new_(
+  upd_file_t*                  prog,
+  const upd_driver_t*          driver,
+  const upd_driver_srv_opts_t* opts);
 
 static
 bool
-cli_pipe_stream_to_tcp_(
+srv_listen_(
   upd_file_t* f);
 
+static
+bool
+srv_accept_(
+  upd_file_t*         f,
+  uv_stream_t*        from,
+  const upd_driver_t* driver);
+
+static
+bool
+srv_exec_(
+  upd_file_t* f,
+  upd_file_t* fcli);
+
+static
+void
+srv_release_exec_(
+  upd_file_t*      fcli,
+  upd_file_lock_t* kpro);
+
+static
+void
+srv_fill_pool_(
+  upd_file_t* f);
+
+
+static
+bool
+cli_bind_stream_(
+  upd_file_t*      f,
+  upd_file_t*      fst,
+  upd_file_lock_t* kpro);
+
+
+static
+bool
+cli_pipe_stream_to_sock_(
+  upd_file_t* f);
+
+static
+size_t
+cli_get_write_queue_size_(
+  cli_t_* cli);
+
+static
+bool
+cli_accept_passed_(
+  upd_file_t* f);
+
+static
+bool
+cli_drop_passed_(
+  upd_file_t*    f,
+  uv_handle_type type);
+
+static
+bool
+cli_send_(
+  upd_file_t*     f,
+  const uv_buf_t* bufs,
+  size_t          n);
+
+static
+bool
+cli_ws_send_cb_(
+  void*           udata,
+  const uv_buf_t* bufs,
+  size_t          n);
+
 
 static
 void
@@ -97,6 +337,64 @@ void
 srv_close_cb_(
   uv_handle_t* handle);
 
+static
+void
+srv_pool_lock_cb_(
+  upd_file_lock_t* k);
+
+static
+void
+srv_pool_exec_cb_(
+  upd_req_t* req);
+
+
+#if SRV_USE_THREADS_
+static
+bool
+srv_open_(
+  upd_file_t*  f,
+  uv_os_sock_t fd);
+
+static
+bool
+acceptor_init_(
+  acceptor_t_*           a,
+  srv_t_*                srv,
+  const struct sockaddr* addr);
+
+static
+void
+acceptor_main_(
+  void* udata);
+
+static
+void
+srv_accept_async_cb_(
+  uv_async_t* async);
+
+static
+void
+acceptor_conn_cb_(
+  uv_stream_t* stream,
+  int          status);
+
+static
+void
+acceptor_stop_cb_(
+  uv_async_t* async);
+
+static
+void
+acceptor_close_walk_cb_(
+  uv_handle_t* handle,
+  void*        udata);
+
+static
+void
+acceptor_close_cb_(
+  uv_handle_t* handle);
+#endif
+
 
 static
 void
@@ -132,14 +430,14 @@ cli_watch_stream_cb_(
 
 static
 void
-cli_tcp_read_cb_(
+cli_sock_read_cb_(
   uv_stream_t*    stream,
   ssize_t         n,
   const uv_buf_t* buf);
 
 static
 void
-cli_tcp_write_cb_(
+cli_sock_write_cb_(
   uv_write_t* req,
   int         status);
 
@@ -164,47 +462,81 @@ void
 cli_close_cb_(
   uv_handle_t* handle);
 
+static
+void
+cli_drop_close_cb_(
+  uv_handle_t* handle);
+
 
 upd_file_t* upd_driver_srv_tcp_new(
-    upd_file_t* prog, const uint8_t* host, uint16_t port) {
-  upd_iso_t* iso = prog->iso;
+    upd_file_t*                  prog,
+    const uint8_t*               host,
+    uint16_t                     port,
+    const upd_driver_srv_opts_t* opts) {
+  return srv_tcp_new_(prog, &upd_driver_srv_tcp, host, port, opts);
+}
 
-  struct sockaddr_in addr = {0};
-  if (HEDLEY_UNLIKELY(0 > uv_ip4_addr((char*) host, port, &addr))) {
-    upd_iso_msgf(iso, "invalid addr: %s:%"PRIu16"\n", host, port);
-    return NULL;
-  }
+upd_file_t* upd_driver_srv_ws_new(
+    upd_file_t*                  prog,
+    const uint8_t*               host,
+    uint16_t                     port,
+    const upd_driver_srv_opts_t* opts) {
+  return srv_tcp_new_(prog, &upd_driver_srv_ws, host, port, opts);
+}
 
-  upd_file_t* f = upd_file_new(&(upd_file_t) {
-      .iso    = iso,
-      .driver = &upd_driver_srv_tcp,
-    });
+upd_file_t* upd_driver_srv_unix_new(
+    upd_file_t*                  prog,
+    const uint8_t*               path,
+    const upd_driver_srv_opts_t* opts) {
+  upd_iso_t* iso = prog->iso;
+
+  upd_file_t* f = srv_new_(prog, &upd_driver_srv_unix, opts);
   if (HEDLEY_UNLIKELY(f == NULL)) {
-    upd_iso_msgf(iso, "server file allocation failure\n");
     return NULL;
   }
 
   srv_t_* srv = f->ctx;
-  srv->port = port;
-  srv->prog = prog;
-  upd_file_ref(srv->prog);
 
-  const int bind = uv_tcp_bind(&srv->tcp, (struct sockaddr*) &addr, 0);
-  if (HEDLEY_UNLIKELY(0 > bind)) {
-    upd_iso_msgf(iso, "tcp bind failure (%s:%"PRIu16")\n", host, port);
+  /*  A socket left by the previous run refuses binding, so it's removed
+   * if nobody is listening on it. These synchronous calls block the loop
+   * but run only once while the config is loaded, before serving. */
+  uv_fs_t fsreq;
+  const int stat = uv_fs_lstat(&iso->loop, &fsreq, (char*) path, NULL);
+  const bool sock =
+    stat >= 0 && (fsreq.statbuf.st_mode & S_IFMT) == S_IFSOCK;
+  uv_fs_req_cleanup(&fsreq);
+  if (HEDLEY_UNLIKELY(sock)) {
+    if (HEDLEY_UNLIKELY(!srv_unix_stale_(path))) {
+      upd_iso_msgf(iso, "unix socket is in use (%s)\n", path);
+      upd_file_unref(f);
+      return NULL;
+    }
+    uv_fs_unlink(&iso->loop, &fsreq, (char*) path, NULL);
+    uv_fs_req_cleanup(&fsreq);
+  }
+
+  if (HEDLEY_UNLIKELY(0 > uv_pipe_bind(&srv->sock.pipe, (char*) path))) {
+    upd_iso_msgf(iso, "unix socket bind failure (%s)\n", path);
     upd_file_unref(f);
     return NULL;
   }
 
-  const int listen = uv_listen(
-    (uv_stream_t*) &srv->tcp, TCP_BACKLOG_, srv_conn_cb_);
-  if (HEDLEY_UNLIKELY(0 > listen)) {
-    upd_iso_msgf(iso, "tcp listen failure (%s:%"PRIu16")\n", host, port);
+  const size_t len = utf8size_lazy(path);
+  if (HEDLEY_UNLIKELY(!upd_malloc(&srv->npath, len+1))) {
+    upd_iso_msgf(iso, "unix socket path allocation failure (%s)\n", path);
+    uv_fs_unlink(&iso->loop, &fsreq, (char*) path, NULL);
+    uv_fs_req_cleanup(&fsreq);
+    upd_file_unref(f);
+    return NULL;
+  }
+  utf8ncpy(srv->npath, path, len);
+  srv->npath[len] = 0;
+
+  if (HEDLEY_UNLIKELY(!srv_listen_(f))) {
+    upd_iso_msgf(iso, "unix socket listen failure (%s)\n", path);
     upd_file_unref(f);
     return NULL;
   }
-  upd_file_ref(f);
-  srv->running = true;
   return f;
 }
 
@@ -217,8 +549,9 @@ static bool srv_init_(upd_file_t* f) {
     return false;
   }
   *srv = (srv_t_) {
-    .tcp = { .data = f, },
-    .watch = {
+    .sock    = { .stream = { .data = f, }, },
+    .handles = 1,
+    .watch   = {
       .file  = f,
       .udata = f,
       .cb    = srv_watch_cb_,
@@ -228,7 +561,11 @@ static bool srv_init_(upd_file_t* f) {
     upd_free(&srv);
     return false;
   }
-  if (HEDLEY_UNLIKELY(0 > uv_tcp_init(&iso->loop, &srv->tcp))) {
+
+  const int init = f->driver == &upd_driver_srv_unix?
+    uv_pipe_init(&iso->loop, &srv->sock.pipe, 0):
+    uv_tcp_init_ex(&iso->loop, &srv->sock.tcp, AF_INET);
+  if (HEDLEY_UNLIKELY(0 > init)) {
     upd_file_unwatch(&srv->watch);
     upd_free(&srv);
     return false;
@@ -240,10 +577,24 @@ static bool srv_init_(upd_file_t* f) {
 static void srv_deinit_(upd_file_t* f) {
   srv_t_* srv = f->ctx;
 
+  assert(srv->waiting.n == 0);
   upd_file_unwatch(&srv->watch);
 
-  srv->tcp.data = srv;
-  uv_close((uv_handle_t*) &srv->tcp, srv_close_cb_);
+  srv_stop_threads_(srv);
+  if (HEDLEY_UNLIKELY(srv->handles > 1)) {
+    srv->accept.async.data = srv;
+    uv_close((uv_handle_t*) &srv->accept.async, srv_close_cb_);
+  }
+
+  if (HEDLEY_UNLIKELY(srv->npath)) {
+    uv_fs_t fsreq;
+    uv_fs_unlink(&f->iso->loop, &fsreq, (char*) srv->npath, NULL);
+    uv_fs_req_cleanup(&fsreq);
+    upd_free(&srv->npath);
+  }
+
+  srv->sock.stream.data = srv;
+  uv_close((uv_handle_t*) &srv->sock, srv_close_cb_);
   upd_file_unref(srv->prog);
 }
 
@@ -253,6 +604,366 @@ static bool srv_handle_(upd_req_t* req) {
 }
 
 
+/* Returns true only when connecting to the socket is refused. */
+static bool srv_unix_stale_(const uint8_t* path) {
+# if defined(__unix__)
+    struct sockaddr_un addr = { .sun_family = AF_UNIX, };
+    const size_t len = utf8size_lazy(path);
+    if (HEDLEY_UNLIKELY(len >= sizeof(addr.sun_path))) {
+      return false;
+    }
+    memcpy(addr.sun_path, path, len);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (HEDLEY_UNLIKELY(fd < 0)) {
+      return false;
+    }
+    const int ret = connect(fd, (struct sockaddr*) &addr, sizeof(addr));
+    const bool refused = ret < 0 && errno == ECONNREFUSED;
+    close(fd);
+    return refused;
+# else
+    (void) path;
+    return false;
+# endif
+}
+
+static bool srv_reuse_port_(uv_handle_t* handle) {
+# if defined(SO_REUSEPORT)
+    uv_os_fd_t fd;
+    if (HEDLEY_UNLIKELY(0 > uv_fileno(handle, &fd))) {
+      return false;
+    }
+    const int on = 1;
+    return 0 == setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+# else
+    (void) handle;
+    return false;
+# endif
+}
+
+static bool srv_start_threads_(upd_file_t* f, const struct sockaddr* addr) {
+# if SRV_USE_THREADS_
+    upd_iso_t* iso = f->iso;
+    srv_t_*    srv = f->ctx;
+
+    const size_t n  = srv->opts.threads - 1;
+    const size_t sz = sizeof(*srv->accept.threads) * n;
+    if (HEDLEY_UNLIKELY(!upd_malloc(&srv->accept.threads, sz))) {
+      return false;
+    }
+    if (HEDLEY_UNLIKELY(0 > uv_mutex_init(&srv->accept.mtx))) {
+      upd_free(&srv->accept.threads);
+      return false;
+    }
+    srv->accept.async.data = f;
+    const int async = uv_async_init(
+      &iso->loop, &srv->accept.async, srv_accept_async_cb_);
+    if (HEDLEY_UNLIKELY(0 > async)) {
+      uv_mutex_destroy(&srv->accept.mtx);
+      upd_free(&srv->accept.threads);
+      return false;
+    }
+    uv_unref((uv_handle_t*) &srv->accept.async);
+    ++srv->handles;
+
+    for (; srv->accept.n < n; ++srv->accept.n) {
+      acceptor_t_* a = &srv->accept.threads[srv->accept.n];
+      if (HEDLEY_UNLIKELY(!acceptor_init_(a, srv, addr))) {
+        return false;  /* started ones are stopped at deinit */
+      }
+    }
+    return true;
+# else
+    (void) f;
+    (void) addr;
+    return false;
+# endif
+}
+
+static void srv_stop_threads_(srv_t_* srv) {
+# if SRV_USE_THREADS_
+    if (HEDLEY_LIKELY(srv->accept.threads == NULL)) {
+      return;
+    }
+    for (size_t i = 0; i < srv->accept.n; ++i) {
+      uv_async_send(&srv->accept.threads[i].stop);
+    }
+
+    /*  Blocks the loop only until acceptors close their handles,
+     * because they never wait for this thread. */
+    for (size_t i = 0; i < srv->accept.n; ++i) {
+      acceptor_t_* a = &srv->accept.threads[i];
+      uv_thread_join(&a->thread);
+      uv_loop_close(&a->loop);
+    }
+    upd_free(&srv->accept.threads);
+    srv->accept.n = 0;
+
+    for (size_t i = 0; i < srv->accept.nfds; ++i) {
+      close(srv->accept.fds[i]);
+    }
+    srv->accept.nfds = 0;
+    uv_mutex_destroy(&srv->accept.mtx);
+# else
+    (void) srv;
+# endif
+}
+
+static upd_file_t* srv_tcp_new_(
+    upd_file_t*                  prog,
+    const upd_driver_t*          driver,
+    const uint8_t*               host,
+    uint16_t                     port,
+    const upd_driver_srv_opts_t* opts) {
+  upd_iso_t* iso = prog->iso;
+
+  struct sockaddr_in addr = {0};
+  if (HEDLEY_UNLIKELY(0 > uv_ip4_addr((char*) host, port, &addr))) {
+    upd_iso_msgf(iso, "invalid addr: %s:%"PRIu16"\n", host, port);
+    return NULL;
+  }
+
+  upd_file_t* f = srv_new_(prog, driver, opts);
+  if (HEDLEY_UNLIKELY(f == NULL)) {
+    return NULL;
+  }
+
+  srv_t_* srv = f->ctx;
+  srv->port = port;
+
+  /* threads listen the same port and the kernel balances connections */
+  const bool threads = opts->threads > 1;
+  if (HEDLEY_UNLIKELY(threads)) {
+    if (HEDLEY_UNLIKELY(!srv_reuse_port_((uv_handle_t*) &srv->sock))) {
+      upd_iso_msgf(iso,
+        "tcp reuseport failure (%s:%"PRIu16")\n", host, port);
+      upd_file_unref(f);
+      return NULL;
+    }
+  }
+
+  const int bind = uv_tcp_bind(&srv->sock.tcp, (struct sockaddr*) &addr, 0);
+  if (HEDLEY_UNLIKELY(0 > bind)) {
+    upd_iso_msgf(iso, "tcp bind failure (%s:%"PRIu16")\n", host, port);
+    upd_file_unref(f);
+    return NULL;
+  }
+
+  if (HEDLEY_UNLIKELY(threads)) {
+    if (HEDLEY_UNLIKELY(!srv_start_threads_(f, (struct sockaddr*) &addr))) {
+      upd_iso_msgf(iso,
+        "tcp accept thread failure (%s:%"PRIu16")\n", host, port);
+      upd_file_unref(f);
+      return NULL;
+    }
+  }
+  if (HEDLEY_UNLIKELY(!srv_listen_(f))) {
+    upd_iso_msgf(iso, "tcp listen failure (%s:%"PRIu16")\n", host, port);
+    upd_file_unref(f);
+    return NULL;
+  }
+  return f;
+}
+
+static upd_file_t* srv_new_(
+    upd_file_t*                  prog,
+    const upd_driver_t*          driver,
+    const upd_driver_srv_opts_t* opts) {
+  upd_iso_t* iso = prog->iso;
+
+  upd_file_t* f = upd_file_new(&(upd_file_t) {
+      .iso    = iso,
+      .driver = driver,
+    });
+  if (HEDLEY_UNLIKELY(f == NULL)) {
+    upd_iso_msgf(iso, "server file allocation failure\n");
+    return NULL;
+  }
+
+  srv_t_* srv = f->ctx;
+  srv->prog = prog;
+  srv->opts = *opts;
+  upd_file_ref(srv->prog);
+
+  srv->cli = &cli_;
+  if (HEDLEY_UNLIKELY(driver == &upd_driver_srv_ws)) {
+    srv->cli = &cli_ws_;
+  }
+  if (HEDLEY_UNLIKELY(driver == &upd_driver_srv_unix)) {
+    srv->cli = opts->fdpass? &cli_ipc_: &cli_pipe_;
+  }
+  return f;
+}
+
+static bool srv_listen_(upd_file_t* f) {
+  srv_t_* srv = f->ctx;
+
+  const int listen = uv_listen(&srv->sock.stream, TCP_BACKLOG_, srv_conn_cb_);
+  if (HEDLEY_UNLIKELY(0 > listen)) {
+    return false;
+  }
+  upd_file_ref(f);
+  srv->running = true;
+
+  srv_fill_pool_(f);
+  return true;
+}
+
+static bool srv_accept_(
+    upd_file_t* f, uv_stream_t* from, const upd_driver_t* driver) {
+  upd_iso_t* iso = f->iso;
+
+  upd_file_t* fcli = upd_file_new(&(upd_file_t) {
+      .iso    = iso,
+      .driver = driver,
+    });
+  if (HEDLEY_UNLIKELY(fcli == NULL)) {
+    upd_iso_msgf(iso, "srv error: client file creation failure\n");
+    return false;
+  }
+  cli_t_* cli = fcli->ctx;
+  cli->srv = f;
+  upd_file_ref(cli->srv);
+
+  if (HEDLEY_UNLIKELY(0 > uv_accept(from, &cli->sock.stream))) {
+    upd_file_unref(fcli);
+    upd_iso_msgf(iso, "srv error: accept failure\n");
+    return false;
+  }
+
+  if (HEDLEY_UNLIKELY(!srv_exec_(f, fcli))) {
+    upd_file_unref(fcli);
+    upd_iso_msgf(iso, "srv error: program lock failure\n");
+    return false;
+  }
+  return true;
+}
+
+static bool srv_exec_(upd_file_t* f, upd_file_t* fcli) {
+  upd_iso_t* iso = f->iso;
+  srv_t_*    srv = f->ctx;
+  cli_t_*    cli = fcli->ctx;
+
+  if (HEDLEY_LIKELY(srv->pool.idle.n)) {
+    upd_file_lock_t* k = upd_iso_stack(iso, sizeof(*k));
+    if (HEDLEY_UNLIKELY(k == NULL)) {
+      return false;
+    }
+    *k = (upd_file_lock_t) {
+      .file  = srv->prog,
+      .ok    = true,
+      .udata = fcli,
+    };
+    cli->pooled = true;
+
+    upd_file_t* fst  = upd_array_remove(&srv->pool.idle, 0);
+    const bool  bind = cli_bind_stream_(fcli, fst, k);
+    upd_file_unref(fst);
+
+    srv_fill_pool_(f);
+    if (HEDLEY_UNLIKELY(!bind)) {
+      /* the caller unrefs the client */
+      cli->pooled = false;
+      upd_iso_unstack(iso, k);
+      return false;
+    }
+    return true;
+  }
+
+  if (HEDLEY_LIKELY(srv->opts.concurrency == 0)) {
+    return upd_file_lock_with_dup(&(upd_file_lock_t) {
+        .file  = srv->prog,
+        .udata = fcli,
+        .cb    = cli_lock_prog_cb_,
+      });
+  }
+
+  if (HEDLEY_UNLIKELY(srv->execs >= srv->opts.concurrency)) {
+    if (HEDLEY_UNLIKELY(srv->waiting.n >= WAITING_MAX_)) {
+      upd_iso_msgf(iso, "srv error: too many clients are waiting\n");
+      return false;
+    }
+    return upd_array_insert(&srv->waiting, fcli, SIZE_MAX);
+  }
+
+  /*  The program has declared that concurrent execution is safe,
+   * so a lock context is made without locking actually. */
+  upd_file_lock_t* k = upd_iso_stack(iso, sizeof(*k));
+  if (HEDLEY_UNLIKELY(k == NULL)) {
+    return false;
+  }
+  *k = (upd_file_lock_t) {
+    .file  = srv->prog,
+    .ok    = true,
+    .udata = fcli,
+    .cb    = cli_lock_prog_cb_,
+  };
+  cli->concurrent = true;
+  ++srv->execs;
+
+  k->cb(k);
+  return true;
+}
+
+static void srv_release_exec_(upd_file_t* fcli, upd_file_lock_t* kpro) {
+  upd_iso_t* iso = fcli->iso;
+  cli_t_*    cli = fcli->ctx;
+
+  if (HEDLEY_UNLIKELY(cli->pooled)) {
+    upd_iso_unstack(iso, kpro);
+    cli->pooled = false;
+    return;
+  }
+  if (HEDLEY_LIKELY(!cli->concurrent)) {
+    upd_file_unlock(kpro);
+    upd_iso_unstack(iso, kpro);
+    return;
+  }
+  upd_iso_unstack(iso, kpro);
+  cli->concurrent = false;
+
+  upd_file_t* f   = cli->srv;
+  srv_t_*     srv = f->ctx;
+  assert(srv->execs);
+  --srv->execs;
+
+  while (srv->waiting.n && srv->execs < srv->opts.concurrency) {
+    upd_file_t* next = upd_array_remove(&srv->waiting, 0);
+    if (HEDLEY_UNLIKELY(!srv_exec_(f, next))) {
+      upd_iso_msgf(iso, "srv error: program execution failure\n");
+      upd_file_unref(next);
+    }
+  }
+}
+
+static void srv_fill_pool_(upd_file_t* f) {
+  upd_iso_t* iso = f->iso;
+  srv_t_*    srv = f->ctx;
+
+  /* streams are executed one by one in background */
+  if (HEDLEY_LIKELY(srv->pool.filling || srv->pool.idle.n >= srv->opts.pool)) {
+    return;
+  }
+  if (HEDLEY_UNLIKELY(!srv->running || iso->teardown)) {
+    return;
+  }
+
+  upd_file_ref(f);
+  const bool lock = upd_file_lock_with_dup(&(upd_file_lock_t) {
+      .file  = srv->prog,
+      .udata = f,
+      .cb    = srv_pool_lock_cb_,
+    });
+  if (HEDLEY_UNLIKELY(!lock)) {
+    upd_file_unref(f);
+    upd_iso_msgf(iso, "srv error: program lock failure, while pooling\n");
+    return;
+  }
+  srv->pool.filling = true;
+}
+
+
 static bool cli_init_(upd_file_t* f) {
   upd_iso_t* iso = f->iso;
 
@@ -261,7 +972,7 @@ static bool cli_init_(upd_file_t* f) {
     return false;
   }
   *cli = (cli_t_) {
-    .tcp      = { .data = f, },
+    .sock     = { .stream = { .data = f, }, },
     .shutdown = { .data = cli, },
     .watch    = {
       .file  = f,
@@ -269,67 +980,252 @@ static bool cli_init_(upd_file_t* f) {
       .cb    = cli_watch_cb_,
     },
   };
+  if (HEDLEY_UNLIKELY(f->driver == &cli_ws_)) {
+    cli->ws = upd_driver_srv_ws_cli_new(iso, f, cli_ws_send_cb_);
+    if (HEDLEY_UNLIKELY(cli->ws == NULL)) {
+      upd_free(&cli);
+      return false;
+    }
+  }
   if (HEDLEY_UNLIKELY(!upd_file_watch(&cli->watch))) {
-    upd_free(&cli);
-    return false;
+    goto ABORT;
   }
-  if (HEDLEY_UNLIKELY(0 > uv_tcp_init(&iso->loop, &cli->tcp))) {
+
+  const bool local = f->driver == &cli_pipe_ || f->driver == &cli_ipc_;
+
+  const int init = local?
+    uv_pipe_init(&iso->loop, &cli->sock.pipe, f->driver == &cli_ipc_):
+    uv_tcp_init(&iso->loop, &cli->sock.tcp);
+  if (HEDLEY_UNLIKELY(0 > init)) {
     upd_file_unwatch(&cli->watch);
-    upd_free(&cli);
+    goto ABORT;
+  }
+  f->ctx = cli;
+  return true;
+
+ABORT:
+  if (HEDLEY_UNLIKELY(cli->ws)) {
+    upd_driver_srv_ws_cli_delete(cli->ws);
+  }
+  upd_free(&cli);
+  return false;
+}
+
+static void cli_deinit_(upd_file_t* f) {
+  cli_t_* cli = f->ctx;
+
+  upd_file_unwatch(&cli->watch);
+  if (HEDLEY_UNLIKELY(cli->ws)) {
+    upd_driver_srv_ws_cli_delete(cli->ws);
+    cli->ws = NULL;
+  }
+
+  cli->sock.stream.data = cli;
+  const int shutdown = uv_shutdown(
+    &cli->shutdown, &cli->sock.stream, cli_shutdown_cb_);
+  if (HEDLEY_LIKELY(0 <= shutdown)) {
+    return;
+  }
+  cli_shutdown_cb_(&cli->shutdown, 0);
+}
+
+static bool cli_handle_(upd_req_t* req) {
+  (void) req;
+  return false;
+}
+
+static void cli_close_(upd_file_t* f) {
+  cli_t_* cli = f->ctx;
+
+  cli->closed = true;
+  upd_file_unwatch(&cli->watchst);
+  uv_read_stop(&cli->sock.stream);
+  upd_file_unref(f);
+}
+
+static bool cli_pipe_stream_to_sock_(upd_file_t* f) {
+  cli_t_* cli = f->ctx;
+
+  /* WebSocket clients receive nothing until upgraded */
+  if (HEDLEY_UNLIKELY(cli->ws && !upd_driver_srv_ws_is_open(cli->ws))) {
+    return true;
+  }
+
+  if (HEDLEY_UNLIKELY(cli_get_write_queue_size_(cli) > WQ_HIGH_)) {
+    cli->wpending = true;
+    return true;
+  }
+  cli->wpending = false;
+
+  upd_file_ref(f);
+  const bool read = upd_req_with_dup(&(upd_req_t) {
+      .file = cli->k.file,
+      .type = UPD_REQ_DSTREAM_READ,
+      .stream = { .io = {
+        .size = SIZE_MAX,
+      }, },
+      .udata = f,
+      .cb    = cli_stream_read_cb_,
+    });
+  if (HEDLEY_UNLIKELY(!read)) {
+    cli_close_(f);
+    upd_file_unref(f);
+    return false;
+  }
+  return true;
+}
+
+static bool cli_bind_stream_(
+    upd_file_t* f, upd_file_t* fst, upd_file_lock_t* kpro) {
+  upd_iso_t* iso = f->iso;
+  cli_t_*    cli = f->ctx;
+
+  cli->k = (upd_file_lock_t) {
+    .file  = fst,
+    .ex    = true,
+    .udata = kpro,
+    .cb    = cli_lock_stream_cb_,
+  };
+  if (HEDLEY_UNLIKELY(!upd_file_lock(&cli->k))) {
+    upd_iso_msgf(iso, "cli error: stream lock failure");
+    return false;
+  }
+  return true;
+}
+
+static bool cli_accept_passed_(upd_file_t* f) {
+  upd_iso_t* iso = f->iso;
+  cli_t_*    cli = f->ctx;
+  srv_t_*    srv = cli->srv->ctx;
+
+  /*  Connections passed from other processes are served as if they're
+   * accepted by this server. */
+  int pending;
+  while ((pending = uv_pipe_pending_count(&cli->sock.pipe)) > 0) {
+    const uv_handle_type type = uv_pipe_pending_type(&cli->sock.pipe);
+
+    const upd_driver_t* driver = NULL;
+    switch (type) {
+    case UV_TCP:
+      driver = &cli_;
+      break;
+    case UV_NAMED_PIPE:
+      driver = &cli_pipe_;
+      break;
+    default:
+      upd_iso_msgf(iso, "cli error: unsupported handle is passed\n");
+      return false;
+    }
+
+    const bool accept =
+      srv->running && srv_accept_(cli->srv, &cli->sock.stream, driver);
+    if (HEDLEY_UNLIKELY(!accept)) {
+      /* the handle must be taken anyway, or it stays pending forever */
+      const bool taken = pending > uv_pipe_pending_count(&cli->sock.pipe);
+      if (HEDLEY_UNLIKELY(!taken && !cli_drop_passed_(f, type))) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static bool cli_drop_passed_(upd_file_t* f, uv_handle_type type) {
+  upd_iso_t* iso = f->iso;
+  cli_t_*    cli = f->ctx;
+
+  sock_t_* sock = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&sock, sizeof(*sock)))) {
+    upd_iso_msgf(iso, "cli error: passed handle allocation failure\n");
+    return false;
+  }
+  const int init = type == UV_TCP?
+    uv_tcp_init(&iso->loop, &sock->tcp):
+    uv_pipe_init(&iso->loop, &sock->pipe, 0);
+  if (HEDLEY_UNLIKELY(0 > init)) {
+    upd_free(&sock);
+    upd_iso_msgf(iso, "cli error: passed handle init failure\n");
     return false;
   }
-  f->ctx = cli;
+  uv_accept(&cli->sock.stream, &sock->stream);
+  uv_close((uv_handle_t*) sock, cli_drop_close_cb_);
   return true;
 }
 
-static void cli_deinit_(upd_file_t* f) {
-  cli_t_* cli = f->ctx;
+static bool cli_send_(upd_file_t* f, const uv_buf_t* bufs, size_t n) {
+  upd_iso_t* iso = f->iso;
+  cli_t_*    cli = f->ctx;
 
-  upd_file_unwatch(&cli->watch);
+  size_t total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    total += bufs[i].len;
+  }
 
-  cli->tcp.data = cli;
-  const int shutdown = uv_shutdown(
-    &cli->shutdown, (uv_stream_t*) &cli->tcp, cli_shutdown_cb_);
-  if (HEDLEY_LIKELY(0 <= shutdown)) {
-    return;
+  /*  Tries to pass the buffers to the kernel directly before copying.
+   * uv_try_write refuses while other writes are queued, so the order is
+   * kept. */
+  size_t sent = 0;
+  const int trywrite = uv_try_write(&cli->sock.stream, bufs, n);
+  if (HEDLEY_LIKELY(trywrite >= 0)) {
+    sent = trywrite;
+  } else if (HEDLEY_UNLIKELY(trywrite != UV_EAGAIN && trywrite != UV_ENOSYS)) {
+    upd_iso_msgf(iso,
+      "cli error: socket write failure (%s)\n", uv_err_name(trywrite));
+    return false;
+  }
+  if (HEDLEY_LIKELY(sent >= total)) {
+    return true;
   }
-  cli_shutdown_cb_(&cli->shutdown, 0);
-}
 
-static bool cli_handle_(upd_req_t* req) {
-  (void) req;
-  return false;
-}
+  /* the rest is held on heap not to pin the iso stack until written */
+  const size_t rest = total - sent;
 
-static void cli_close_(upd_file_t* f) {
-  cli_t_* cli = f->ctx;
+  uv_write_t* w = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&w, sizeof(*w)+rest))) {
+    upd_iso_msgf(iso, "cli error: socket write req allocation failure\n");
+    return false;
+  }
+  *w = (uv_write_t) { .data = f, };
 
-  upd_file_unwatch(&cli->watchst);
-  uv_read_stop((uv_stream_t*) &cli->tcp);
-  upd_file_unref(f);
-}
+  uint8_t* dst = (uint8_t*) (w+1);
+  for (size_t i = 0; i < n; ++i) {
+    const size_t len = bufs[i].len;
+    if (sent >= len) {
+      sent -= len;
+      continue;
+    }
+    memcpy(dst, bufs[i].base+sent, len-sent);
+    dst  += len-sent;
+    sent  = 0;
+  }
 
-static bool cli_pipe_stream_to_tcp_(upd_file_t* f) {
-  cli_t_* cli = f->ctx;
+  const uv_buf_t buf = uv_buf_init((char*) (w+1), rest);
 
   upd_file_ref(f);
-  const bool read = upd_req_with_dup(&(upd_req_t) {
-      .file = cli->k.file,
-      .type = UPD_REQ_DSTREAM_READ,
-      .stream = { .io = {
-        .size = SIZE_MAX,
-      }, },
-      .udata = f,
-      .cb    = cli_stream_read_cb_,
-    });
-  if (HEDLEY_UNLIKELY(!read)) {
-    cli_close_(f);
+  const int write = uv_write(
+    w, &cli->sock.stream, &buf, 1, cli_sock_write_cb_);
+  if (HEDLEY_UNLIKELY(0 > write)) {
     upd_file_unref(f);
+    upd_free(&w);
+    upd_iso_msgf(iso,
+      "cli error: socket write failure (%s)\n", uv_err_name(write));
     return false;
   }
+  ++cli->writes;
   return true;
 }
 
+static bool cli_ws_send_cb_(void* udata, const uv_buf_t* bufs, size_t n) {
+  return cli_send_(udata, bufs, n);
+}
+
+static size_t cli_get_write_queue_size_(cli_t_* cli) {
+  /*  Every write in progress is counted at least as a small block,
+   * so many tiny writes also cause the backpressure. */
+  const size_t q = uv_stream_get_write_queue_size(&cli->sock.stream);
+  return q + cli->writes*UPD_ISO_RBUF_MIN;
+}
+
 
 static void srv_conn_cb_(uv_stream_t* stream, int status) {
   upd_file_t* f   = stream->data;
@@ -338,40 +1234,11 @@ static void srv_conn_cb_(uv_stream_t* stream, int status) {
 
   if (HEDLEY_UNLIKELY(status < 0)) {
     upd_iso_msgf(iso,
-      "tcp srv error: connection error (%s)\n", uv_err_name(status));
-    return;
-  }
-
-  upd_file_t* fcli = upd_file_new(&(upd_file_t) {
-      .iso    = iso,
-      .driver = &cli_,
-    });
-  if (HEDLEY_UNLIKELY(fcli == NULL)) {
-    upd_iso_msgf(iso, "tcp srv error: client file creation failure\n");
-    return;
-  }
-  cli_t_* cli = fcli->ctx;
-  cli->srv = f;
-  upd_file_ref(cli->srv);
-
-  const int accept = uv_accept(
-    (uv_stream_t*) &srv->tcp, (uv_stream_t*) &cli->tcp);
-  if (HEDLEY_UNLIKELY(0 > accept)) {
-    upd_file_unref(fcli);
-    upd_iso_msgf(iso, "tcp srv error: accept failure\n");
+      "srv error: connection error (%s)\n", uv_err_name(status));
     return;
   }
 
-  const bool lock = upd_file_lock_with_dup(&(upd_file_lock_t) {
-      .file  = srv->prog,
-      .udata = fcli,
-      .cb    = cli_lock_prog_cb_,
-    });
-  if (HEDLEY_UNLIKELY(!lock)) {
-    upd_file_unref(fcli);
-    upd_iso_msgf(iso, "tcp srv error: program lock failure\n");
-    return;
-  }
+  srv_accept_(f, &srv->sock.stream, srv->cli);
 }
 
 static void srv_watch_cb_(upd_file_watch_t* w) {
@@ -380,7 +1247,20 @@ static void srv_watch_cb_(upd_file_watch_t* w) {
 
   switch (w->event) {
   case UPD_FILE_SHUTDOWN:
+    /* forgets clients waiting for execution */
+    for (size_t i = 0; i < srv->waiting.n; ++i) {
+      upd_file_unref(srv->waiting.p[i]);
+    }
+    upd_array_clear(&srv->waiting);
+
+    for (size_t i = 0; i < srv->pool.idle.n; ++i) {
+      upd_file_unref(srv->pool.idle.p[i]);
+    }
+    upd_array_clear(&srv->pool.idle);
+
+    srv_stop_threads_(srv);
     if (HEDLEY_LIKELY(srv->running)) {
+      srv->running = false;
       upd_file_unref(f);
     }
     break;
@@ -389,7 +1269,75 @@ static void srv_watch_cb_(upd_file_watch_t* w) {
 
 static void srv_close_cb_(uv_handle_t* handle) {
   srv_t_* srv = handle->data;
-  upd_free(&srv);
+  if (HEDLEY_LIKELY(--srv->handles == 0)) {
+    upd_free(&srv);
+  }
+}
+
+static void srv_pool_lock_cb_(upd_file_lock_t* k) {
+  upd_file_t* f   = k->udata;
+  upd_iso_t*  iso = f->iso;
+
+  if (HEDLEY_UNLIKELY(!k->ok)) {
+    upd_iso_msgf(iso,
+      "srv error: program lock cancelled, while pooling\n");
+    goto ABORT;
+  }
+
+  const bool exec = upd_req_with_dup(&(upd_req_t) {
+      .file  = k->file,
+      .type  = UPD_REQ_PROG_EXEC,
+      .udata = k,
+      .cb    = srv_pool_exec_cb_,
+    });
+  if (HEDLEY_UNLIKELY(!exec)) {
+    upd_iso_msgf(iso, "srv error: program execution refused\n");
+    goto ABORT;
+  }
+  return;
+
+ABORT:
+  upd_file_unlock(k);
+  upd_iso_unstack(iso, k);
+
+  srv_t_* srv = f->ctx;
+  srv->pool.filling = false;
+  upd_file_unref(f);
+}
+
+static void srv_pool_exec_cb_(upd_req_t* req) {
+  upd_file_lock_t* k   = req->udata;
+  upd_file_t*      f   = k->udata;
+  upd_iso_t*       iso = f->iso;
+  srv_t_*          srv = f->ctx;
+
+  upd_file_t* fst = req->result == UPD_REQ_OK? req->prog.exec: NULL;
+  upd_iso_unstack(iso, req);
+
+  upd_file_unlock(k);
+  upd_iso_unstack(iso, k);
+
+  srv->pool.filling = false;
+  if (HEDLEY_UNLIKELY(fst == NULL)) {
+    /* doesn't retry not to repeat failures */
+    upd_iso_msgf(iso,
+      "srv error: program execution failure, while pooling\n");
+    goto EXIT;
+  }
+  if (HEDLEY_UNLIKELY(!srv->running)) {
+    goto EXIT;
+  }
+
+  upd_file_ref(fst);
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&srv->pool.idle, fst, SIZE_MAX))) {
+    upd_file_unref(fst);
+    upd_iso_msgf(iso, "srv error: pool insertion failure\n");
+    goto EXIT;
+  }
+  srv_fill_pool_(f);
+
+EXIT:
+  upd_file_unref(f);
 }
 
 
@@ -399,7 +1347,7 @@ static void cli_lock_prog_cb_(upd_file_lock_t* k) {
   upd_file_t* fpro = k->file;
 
   if (HEDLEY_UNLIKELY(!k->ok)) {
-    upd_iso_msgf(iso, "tcp srv error: program lock cancelled\n");
+    upd_iso_msgf(iso, "srv error: program lock cancelled\n");
     goto ABORT;
   }
 
@@ -410,14 +1358,13 @@ static void cli_lock_prog_cb_(upd_file_lock_t* k) {
       .cb    = cli_exec_cb_,
     });
   if (HEDLEY_UNLIKELY(!exec)) {
-    upd_iso_msgf(iso, "tcp cli error: program execution refused\n");
+    upd_iso_msgf(iso, "cli error: program execution refused\n");
     goto ABORT;
   }
   return;
 
 ABORT:
-  upd_file_unlock(k);
-  upd_iso_unstack(iso, k);
+  srv_release_exec_(f, k);
   upd_file_unref(f);
 }
 
@@ -425,30 +1372,19 @@ static void cli_exec_cb_(upd_req_t* req) {
   upd_file_lock_t* kpro = req->udata;
   upd_file_t*      f    = kpro->udata;
   upd_iso_t*       iso  = f->iso;
-  cli_t_*          cli  = f->ctx;
 
   upd_file_t* fst = req->result == UPD_REQ_OK? req->prog.exec: NULL;
   upd_iso_unstack(iso, req);
 
   if (HEDLEY_UNLIKELY(fst == NULL)) {
-    upd_iso_msgf(iso, "tcp cli error: program execution failure\n");
+    upd_iso_msgf(iso, "cli error: program execution failure\n");
     goto ABORT;
   }
-
-  cli->k = (upd_file_lock_t) {
-    .file  = fst,
-    .ex    = true,
-    .udata = kpro,
-    .cb    = cli_lock_stream_cb_,
-  };
-  if (HEDLEY_UNLIKELY(!upd_file_lock(&cli->k))) {
-    upd_iso_msgf(iso, "tcp cli error: stream lock failure");
-  }
+  cli_bind_stream_(f, fst, kpro);
   return;
 
 ABORT:
-  upd_file_unlock(kpro);
-  upd_iso_unstack(iso, kpro);
+  srv_release_exec_(f, kpro);
   upd_file_unref(f);
 }
 
@@ -459,7 +1395,7 @@ static void cli_lock_stream_cb_(upd_file_lock_t* k) {
   cli_t_*          cli  = f->ctx;
 
   if (HEDLEY_UNLIKELY(!k->ok)) {
-    upd_iso_msgf(iso, "tcp cli error: stream lock cancelled\n");
+    upd_iso_msgf(iso, "cli error: stream lock cancelled\n");
     goto EXIT;
   }
 
@@ -470,36 +1406,40 @@ static void cli_lock_stream_cb_(upd_file_lock_t* k) {
   };
   if (HEDLEY_UNLIKELY(!upd_file_watch(&cli->watchst))) {
     upd_file_unref(f);
-    upd_iso_msgf(iso, "tcp cli error: stream watch failure\n");
+    upd_iso_msgf(iso, "cli error: stream watch failure\n");
     goto EXIT;
   }
 
   const int read_start = uv_read_start(
-    (uv_stream_t*) &cli->tcp, cli_alloc_cb_, cli_tcp_read_cb_);
+    &cli->sock.stream, cli_alloc_cb_, cli_sock_read_cb_);
   if (HEDLEY_UNLIKELY(0 > read_start)) {
     upd_file_unwatch(&cli->watchst);
     upd_file_unref(f);
-    upd_iso_msgf(iso, "tcp cli error: read_start failure");
+    upd_iso_msgf(iso, "cli error: read_start failure");
     goto EXIT;
   }
 
-  cli_pipe_stream_to_tcp_(f);
+  cli_pipe_stream_to_sock_(f);
 
 EXIT:
-  upd_file_unlock(kpro);
-  upd_iso_unstack(iso, kpro);
+  srv_release_exec_(f, kpro);
 }
 
 static void cli_alloc_cb_(uv_handle_t* handle, size_t n, uv_buf_t* buf) {
-  (void) handle;
+  (void) n;
+
+  upd_file_t* f   = handle->data;
+  upd_iso_t*  iso = f->iso;
+  cli_t_*     cli = f->ctx;
 
+  /* libuv asks buffers only when the socket gets readable */
   *buf = (uv_buf_t) {0};
 
-  uint8_t* ptr = NULL;
-  if (HEDLEY_UNLIKELY(!upd_malloc(&ptr, n))) {
+  uint8_t* ptr = upd_iso_rbuf_alloc(iso, cli->rcls);
+  if (HEDLEY_UNLIKELY(ptr == NULL)) {
     return;
   }
-  *buf = uv_buf_init((char*) ptr, n);
+  *buf = uv_buf_init((char*) ptr, UPD_ISO_RBUF_MIN << cli->rcls);
 }
 
 static void cli_watch_cb_(upd_file_watch_t* w) {
@@ -517,13 +1457,14 @@ static void cli_watch_stream_cb_(upd_file_watch_t* w) {
 
   switch (w->event) {
   case UPD_FILE_UPDATE:
-    cli_pipe_stream_to_tcp_(f);
+    cli_pipe_stream_to_sock_(f);
     break;
   }
 }
 
-static void cli_tcp_read_cb_(uv_stream_t* stream, ssize_t n, const uv_buf_t* buf) {
+static void cli_sock_read_cb_(uv_stream_t* stream, ssize_t n, const uv_buf_t* buf) {
   upd_file_t* f   = stream->data;
+  upd_iso_t*  iso = f->iso;
   cli_t_*     cli = f->ctx;
 
   uint8_t* ptr = (void*) buf->base;
@@ -531,6 +1472,48 @@ static void cli_tcp_read_cb_(uv_stream_t* stream, ssize_t n, const uv_buf_t* buf
   if (HEDLEY_UNLIKELY(n < 0)) {
     goto ABORT;
   }
+  if (HEDLEY_UNLIKELY(f->driver == &cli_ipc_ && !cli_accept_passed_(f))) {
+    goto ABORT;
+  }
+  if (HEDLEY_UNLIKELY(n == 0)) {
+    upd_iso_rbuf_free(iso, ptr);
+    return;
+  }
+
+  if (HEDLEY_UNLIKELY((size_t) n == buf->len)) {
+    if (cli->rcls+1 < UPD_ISO_RBUF_CLASSES) {
+      ++cli->rcls;
+    }
+  } else if (HEDLEY_UNLIKELY((size_t) n < buf->len/4 && cli->rcls)) {
+    --cli->rcls;
+  }
+
+  /* payloads of WebSocket frames are gathered to the head of buffer */
+  size_t len = n;
+  if (HEDLEY_UNLIKELY(cli->ws)) {
+    const bool was_open = upd_driver_srv_ws_is_open(cli->ws);
+    len = upd_driver_srv_ws_recv(cli->ws, ptr, n);
+
+    /* the stream output is piped after the upgrade */
+    const bool open = upd_driver_srv_ws_is_open(cli->ws);
+    if (HEDLEY_UNLIKELY(!was_open && open)) {
+      cli_pipe_stream_to_sock_(f);
+    }
+    if (HEDLEY_UNLIKELY(len == SIZE_MAX)) {
+      goto ABORT;
+    }
+    if (HEDLEY_UNLIKELY(len == 0)) {
+      upd_iso_rbuf_free(iso, ptr);
+      return;
+    }
+  }
+
+  /* counts the whole buffer, because it's held until the write finishes */
+  cli->inbytes += buf->len;
+  if (HEDLEY_UNLIKELY(cli->inbytes > RQ_HIGH_ && !cli->rpaused)) {
+    uv_read_stop(&cli->sock.stream);
+    cli->rpaused = true;
+  }
 
   upd_file_ref(f);
   const bool write = upd_req_with_dup(&(upd_req_t) {
@@ -538,37 +1521,48 @@ static void cli_tcp_read_cb_(uv_stream_t* stream, ssize_t n, const uv_buf_t* buf
       .type = UPD_REQ_DSTREAM_WRITE,
       .stream = { .io = {
         .buf  = ptr,
-        .size = n,
+        .size = len,
       }, },
       .udata = f,
       .cb    = cli_stream_write_cb_,
     });
   if (HEDLEY_UNLIKELY(!write)) {
+    cli->inbytes -= buf->len;
     upd_file_unref(f);
     goto ABORT;
   }
   return;
 
 ABORT:
-  upd_free(&ptr);
+  upd_iso_rbuf_free(iso, ptr);
   cli_close_(f);
 }
 
-static void cli_tcp_write_cb_(uv_write_t* req, int status) {
+static void cli_sock_write_cb_(uv_write_t* req, int status) {
   upd_file_t* f   = req->data;
   upd_iso_t*  iso = f->iso;
+  cli_t_*     cli = f->ctx;
 
   if (HEDLEY_UNLIKELY(0 > status)) {
     upd_iso_msgf(iso,
-      "tcp cli error: tcp write failure (%s)\n", uv_err_name(status));
+      "cli error: socket write failure (%s)\n", uv_err_name(status));
+  }
+  upd_free(&req);
+
+  assert(cli->writes);
+  --cli->writes;
+
+  const bool resume =
+    cli->wpending && !cli->closed &&
+    cli_get_write_queue_size_(cli) < WQ_LOW_;
+  if (HEDLEY_UNLIKELY(resume)) {
+    cli_pipe_stream_to_sock_(f);
   }
-  upd_iso_unstack(iso, req);
   upd_file_unref(f);
 }
 
 static void cli_stream_read_cb_(upd_req_t* req) {
   upd_file_t* f   = req->udata;
-  cli_t_*     cli = f->ctx;
   upd_iso_t*  iso = f->iso;
 
   if (HEDLEY_UNLIKELY(req->result != UPD_REQ_OK)) {
@@ -580,27 +1574,18 @@ static void cli_stream_read_cb_(upd_req_t* req) {
     goto EXIT;
   }
 
-  uv_write_t* w = upd_iso_stack(iso, sizeof(*w)+io->size);
-  if (HEDLEY_UNLIKELY(w == NULL)) {
-    upd_iso_unstack(iso, w);
-    cli_close_(f);
-    upd_iso_msgf(iso, "tcp cli error: tcp write req allocation failure\n");
-    goto EXIT;
+  /* the buffer lent by the stream is valid only until this callback returns */
+  bool sent = false;
+  cli_t_* cli = f->ctx;
+  if (HEDLEY_UNLIKELY(cli->ws)) {
+    sent = upd_driver_srv_ws_send(
+      cli->ws, 0x2 /* binary */, io->buf, io->size);
+  } else {
+    const uv_buf_t buf = uv_buf_init((char*) io->buf, io->size);
+    sent = cli_send_(f, &buf, 1);
   }
-  *w = (uv_write_t) { .data = f, };
-  memcpy(w+1, io->buf, io->size);
-
-  const uv_buf_t buf = uv_buf_init((char*) (w+1), io->size);
-
-  upd_file_ref(f);
-  const int write = uv_write(
-    w, (uv_stream_t*) &cli->tcp, &buf, 1, cli_tcp_write_cb_);
-  if (HEDLEY_UNLIKELY(0 > write)) {
-    upd_file_unref(f);
-    upd_iso_unstack(iso, w);
+  if (HEDLEY_UNLIKELY(!sent)) {
     cli_close_(f);
-    upd_iso_msgf(iso,
-      "tcp cli error: tcp write failure (%s)\n", uv_err_name(write));
     goto EXIT;
   }
 
@@ -612,12 +1597,31 @@ EXIT:
 static void cli_stream_write_cb_(upd_req_t* req) {
   upd_file_t* f   = req->udata;
   upd_iso_t*  iso = f->iso;
+  cli_t_*     cli = f->ctx;
 
-  if (HEDLEY_UNLIKELY(req->result != UPD_REQ_OK)) {
+  uint8_t*   buf = req->stream.io.buf;
+  const bool ok  = req->result == UPD_REQ_OK;
+  upd_iso_unstack(iso, req);
+
+  const size_t sz = upd_iso_rbuf_size(buf);
+  assert(cli->inbytes >= sz);
+  cli->inbytes -= sz;
+
+  if (HEDLEY_UNLIKELY(!ok)) {
     cli_close_(f);
   }
-  upd_free(&req->stream.io.buf);
-  upd_iso_unstack(iso, req);
+  upd_iso_rbuf_free(iso, buf);
+
+  const bool resume = cli->rpaused && !cli->closed && cli->inbytes < RQ_LOW_;
+  if (HEDLEY_UNLIKELY(resume)) {
+    cli->rpaused = false;
+    const int read_start = uv_read_start(
+      &cli->sock.stream, cli_alloc_cb_, cli_sock_read_cb_);
+    if (HEDLEY_UNLIKELY(0 > read_start)) {
+      cli_close_(f);
+      upd_iso_msgf(iso, "cli error: read_start failure\n");
+    }
+  }
   upd_file_unref(f);
 }
 
@@ -625,7 +1629,7 @@ static void cli_shutdown_cb_(uv_shutdown_t* req, int status) {
   (void) status;
 
   cli_t_* cli = req->data;
-  uv_close((uv_handle_t*) &cli->tcp, cli_close_cb_);
+  uv_close((uv_handle_t*) &cli->sock, cli_close_cb_);
 
   upd_file_unref(cli->srv);
   if (HEDLEY_LIKELY(cli->k.file)) {
@@ -637,3 +1641,164 @@ static void cli_close_cb_(uv_handle_t* handle) {
   cli_t_* cli = handle->data;
   upd_free(&cli);
 }
+
+static void cli_drop_close_cb_(uv_handle_t* handle) {
+  upd_free(&handle);
+}
+
+
+#if SRV_USE_THREADS_
+static bool srv_open_(upd_file_t* f, uv_os_sock_t fd) {
+  upd_iso_t* iso = f->iso;
+  srv_t_*    srv = f->ctx;
+
+  upd_file_t* fcli = upd_file_new(&(upd_file_t) {
+      .iso    = iso,
+      .driver = srv->cli,
+    });
+  if (HEDLEY_UNLIKELY(fcli == NULL)) {
+    upd_iso_msgf(iso, "srv error: client file creation failure\n");
+    goto ABORT;
+  }
+  cli_t_* cli = fcli->ctx;
+  cli->srv = f;
+  upd_file_ref(cli->srv);
+
+  if (HEDLEY_UNLIKELY(0 > uv_tcp_open(&cli->sock.tcp, fd))) {
+    upd_file_unref(fcli);
+    upd_iso_msgf(iso, "srv error: socket open failure\n");
+    goto ABORT;
+  }
+
+  /* the socket is owned by the client from here */
+  if (HEDLEY_UNLIKELY(!srv_exec_(f, fcli))) {
+    upd_file_unref(fcli);
+    upd_iso_msgf(iso, "srv error: program lock failure\n");
+    return false;
+  }
+  return true;
+
+ABORT:
+  close(fd);
+  return false;
+}
+
+static bool acceptor_init_(
+    acceptor_t_* a, srv_t_* srv, const struct sockaddr* addr) {
+  *a = (acceptor_t_) {
+    .tcp  = { .data = a, },
+    .stop = { .data = a, },
+    .srv  = srv,
+  };
+  if (HEDLEY_UNLIKELY(0 > uv_loop_init(&a->loop))) {
+    return false;
+  }
+
+  uv_stream_t* stream = (uv_stream_t*) &a->tcp;
+  const bool ok =
+    0 <= uv_tcp_init_ex(&a->loop, &a->tcp, AF_INET) &&
+    srv_reuse_port_((uv_handle_t*) &a->tcp) &&
+    0 <= uv_tcp_bind(&a->tcp, addr, 0) &&
+    0 <= uv_listen(stream, TCP_BACKLOG_, acceptor_conn_cb_) &&
+    0 <= uv_async_init(&a->loop, &a->stop, acceptor_stop_cb_) &&
+    0 <= uv_thread_create(&a->thread, acceptor_main_, a);
+  if (HEDLEY_UNLIKELY(!ok)) {
+    /* the thread hasn't started, so the loop is still ours */
+    uv_walk(&a->loop, acceptor_close_walk_cb_, NULL);
+    uv_run(&a->loop, UV_RUN_DEFAULT);
+    uv_loop_close(&a->loop);
+    return false;
+  }
+  return true;
+}
+
+static void acceptor_main_(void* udata) {
+  acceptor_t_* a = udata;
+  uv_run(&a->loop, UV_RUN_DEFAULT);
+}
+
+
+static void srv_accept_async_cb_(uv_async_t* async) {
+  upd_file_t* f   = async->data;
+  srv_t_*     srv = f->ctx;
+
+  uv_os_sock_t fds[ACCEPT_QUEUE_];
+
+  uv_mutex_lock(&srv->accept.mtx);
+  const size_t n = srv->accept.nfds;
+  memcpy(fds, srv->accept.fds, sizeof(fds[0])*n);
+  srv->accept.nfds = 0;
+  uv_mutex_unlock(&srv->accept.mtx);
+
+  upd_file_ref(f);
+  for (size_t i = 0; i < n; ++i) {
+    if (HEDLEY_LIKELY(srv->running)) {
+      srv_open_(f, fds[i]);
+    } else {
+      close(fds[i]);
+    }
+  }
+  upd_file_unref(f);
+}
+
+static void acceptor_conn_cb_(uv_stream_t* stream, int status) {
+  acceptor_t_* a   = stream->data;
+  srv_t_*      srv = a->srv;
+
+  if (HEDLEY_UNLIKELY(status < 0)) {
+    return;
+  }
+
+  /* upd_malloc is not thread safe */
+  uv_tcp_t* tcp = malloc(sizeof(*tcp));
+  if (HEDLEY_UNLIKELY(tcp == NULL)) {
+    return;
+  }
+  if (HEDLEY_UNLIKELY(0 > uv_tcp_init(&a->loop, tcp))) {
+    free(tcp);
+    return;
+  }
+
+  /*  The handle cannot move to another loop, so the native socket is
+   * duplicated and the handle is closed here. */
+  uv_os_fd_t fd = -1;
+  const bool accept =
+    0 <= uv_accept(stream, (uv_stream_t*) tcp) &&
+    0 <= uv_fileno((uv_handle_t*) tcp, &fd);
+  if (HEDLEY_LIKELY(accept)) {
+    fd = dup(fd);
+  }
+  uv_close((uv_handle_t*) tcp, acceptor_close_cb_);
+  if (HEDLEY_UNLIKELY(!accept || fd < 0)) {
+    return;
+  }
+
+  uv_mutex_lock(&srv->accept.mtx);
+  const bool queue = srv->accept.nfds < ACCEPT_QUEUE_;
+  if (HEDLEY_LIKELY(queue)) {
+    srv->accept.fds[srv->accept.nfds++] = fd;
+  }
+  uv_mutex_unlock(&srv->accept.mtx);
+
+  if (HEDLEY_UNLIKELY(!queue)) {
+    close(fd);  /* refuses while the owner is too busy */
+    return;
+  }
+  uv_async_send(&srv->accept.async);
+}
+
+static void acceptor_stop_cb_(uv_async_t* async) {
+  uv_walk(async->loop, acceptor_close_walk_cb_, NULL);
+}
+
+static void acceptor_close_walk_cb_(uv_handle_t* handle, void* udata) {
+  (void) udata;
+  if (HEDLEY_LIKELY(!uv_is_closing(handle))) {
+    uv_close(handle, NULL);
+  }
+}
+
+static void acceptor_close_cb_(uv_handle_t* handle) {
+  free(handle);
+}
+#endif
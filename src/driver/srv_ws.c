@@ -0,0 +1,522 @@
+#include "common.h"
+
+
+/* max size of HTTP request to upgrade to WebSocket */
+#define HANDSHAKE_MAX_ (1024*8)  /* = 8 KiB */
+
+#define GUID_ "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define VERSION_ "13"
+
+#define RESP_BAD_REQUEST_  \
+  "HTTP/1.1 400 Bad Request\r\n"  \
+  "Connection: close\r\n"  \
+  "Content-Length: 0\r\n\r\n"
+
+#define RESP_UPGRADE_REQUIRED_  \
+  "HTTP/1.1 426 Upgrade Required\r\n"  \
+  "Sec-WebSocket-Version: " VERSION_ "\r\n"  \
+  "Connection: close\r\n"  \
+  "Content-Length: 0\r\n\r\n"
+
+
+struct upd_driver_srv_ws_t {
+  upd_iso_t* iso;
+  void*      udata;
+
+  uint8_t* req;  /* HTTP request being received */
+  size_t   reqlen;
+
+  uint8_t  hdr[14];  /* frame header being received */
+  size_t   hdrlen;
+  uint8_t  opcode;
+  uint64_t rest;     /* payload bytes of the current frame */
+  size_t   offset;   /* in the payload, for unmasking */
+
+  uint8_t ctl[125];  /* payload of the current control frame */
+  size_t  ctllen;
+
+  /*  UTF-8 validation of text messages continues across frames,
+   * need is the number of continuation bytes in [lo, hi] to come. */
+  struct {
+    uint8_t need;
+    uint8_t lo;
+    uint8_t hi;
+  } utf8;
+
+  unsigned handshake  : 1;
+  unsigned closing    : 1;
+  unsigned payload    : 1;  /* receiving payload of the current frame */
+  unsigned fragmented : 1;  /* the data message continues to next frame */
+  unsigned text       : 1;  /* the data message is text */
+
+  bool
+  (*send)(
+    void*           udata,
+    const uv_buf_t* bufs,
+    size_t          n);
+};
+
+
+static
+size_t
+ws_handshake_(
+  upd_driver_srv_ws_t* ws,
+  const uint8_t*       buf,
+  size_t               n);
+
+static
+bool
+ws_upgrade_(
+  upd_driver_srv_ws_t* ws);
+
+static
+bool
+ws_respond_(
+  upd_driver_srv_ws_t* ws,
+  const char*          resp);
+
+static
+bool
+ws_has_token_(
+  const uint8_t* v,
+  const uint8_t* ve,
+  const char*    token);
+
+static
+size_t
+ws_decode_(
+  upd_driver_srv_ws_t* ws,
+  uint8_t*             buf,
+  size_t               off,
+  size_t               n);
+
+static
+bool
+ws_validate_utf8_(
+  upd_driver_srv_ws_t* ws,
+  uint8_t              c);
+
+static
+size_t
+ws_fail_(
+  upd_driver_srv_ws_t* ws,
+  uint16_t             code);
+
+static
+bool
+ws_handle_control_(
+  upd_driver_srv_ws_t* ws);
+
+static
+size_t
+ws_encode_header_(
+  uint8_t* dst,
+  uint8_t  opcode,
+  uint64_t len);
+
+
+upd_driver_srv_ws_t* upd_driver_srv_ws_cli_new(
+    upd_iso_t* iso,
+    void*      udata,
+    bool (*send)(void* udata, const uv_buf_t* bufs, size_t n)) {
+  upd_driver_srv_ws_t* ws = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&ws, sizeof(*ws)))) {
+    return NULL;
+  }
+  *ws = (upd_driver_srv_ws_t) {
+    .iso       = iso,
+    .udata     = udata,
+    .handshake = true,
+    .send      = send,
+  };
+  return ws;
+}
+
+void upd_driver_srv_ws_cli_delete(upd_driver_srv_ws_t* ws) {
+  upd_free(&ws->req);
+  upd_free(&ws);
+}
+
+size_t upd_driver_srv_ws_recv(
+    upd_driver_srv_ws_t* ws, uint8_t* buf, size_t n) {
+  size_t off = 0;
+  if (HEDLEY_UNLIKELY(ws->handshake)) {
+    off = ws_handshake_(ws, buf, n);
+    if (HEDLEY_UNLIKELY(off == SIZE_MAX)) {
+      return SIZE_MAX;
+    }
+  }
+  if (HEDLEY_UNLIKELY(!upd_driver_srv_ws_is_open(ws))) {
+    return 0;
+  }
+  return ws_decode_(ws, buf, off, n);
+}
+
+bool upd_driver_srv_ws_send(
+    upd_driver_srv_ws_t* ws, uint8_t opcode, const uint8_t* buf, size_t n) {
+  uint8_t hdr[10];
+  const uv_buf_t bufs[] = {
+    uv_buf_init((char*) hdr, ws_encode_header_(hdr, opcode, n)),
+    uv_buf_init((char*) buf, n),
+  };
+  return ws->send(ws->udata, bufs, n? 2: 1);
+}
+
+bool upd_driver_srv_ws_is_open(const upd_driver_srv_ws_t* ws) {
+  return !ws->handshake && !ws->closing;
+}
+
+
+static size_t ws_handshake_(
+    upd_driver_srv_ws_t* ws, const uint8_t* buf, size_t n) {
+  upd_iso_t* iso = ws->iso;
+
+  const size_t prev = ws->reqlen;
+
+  size_t len = n;
+  if (HEDLEY_UNLIKELY(prev+len > HANDSHAKE_MAX_)) {
+    len = HANDSHAKE_MAX_ - prev;
+  }
+  if (HEDLEY_UNLIKELY(ws->req == NULL)) {
+    if (HEDLEY_UNLIKELY(!upd_malloc(&ws->req, HANDSHAKE_MAX_))) {
+      upd_iso_msgf(iso, "ws cli error: request buffer allocation failure\n");
+      return SIZE_MAX;
+    }
+  }
+  memcpy(ws->req+prev, buf, len);
+  ws->reqlen += len;
+
+  /* finds the end of header, which may be split across reads */
+  const uint8_t* req = ws->req;
+  size_t         end = 0;
+  for (size_t i = prev < 3? 3: prev; i < ws->reqlen; ++i) {
+    if (req[i-3] == '\r' && req[i-2] == '\n' &&
+        req[i-1] == '\r' && req[i]   == '\n') {
+      end = i+1;
+      break;
+    }
+  }
+  if (HEDLEY_LIKELY(end == 0)) {
+    if (HEDLEY_UNLIKELY(ws->reqlen >= HANDSHAKE_MAX_)) {
+      upd_iso_msgf(iso, "ws cli error: too long request\n");
+      return SIZE_MAX;
+    }
+    return n;
+  }
+  ws->reqlen = end;
+
+  if (HEDLEY_UNLIKELY(!ws_upgrade_(ws))) {
+    return SIZE_MAX;
+  }
+  upd_free(&ws->req);
+  ws->reqlen    = 0;
+  ws->handshake = false;
+
+  /* bytes following the request are already frames */
+  return end - prev;
+}
+
+static bool ws_upgrade_(upd_driver_srv_ws_t* ws) {
+  upd_iso_t* iso = ws->iso;
+
+  const uint8_t* req = ws->req;
+  const size_t   len = ws->reqlen;
+
+  if (HEDLEY_UNLIKELY(len < 4 || utf8ncmp(req, "GET ", 4) != 0)) {
+    upd_iso_msgf(iso, "ws cli error: upgrade request must be GET\n");
+    ws_respond_(ws, RESP_BAD_REQUEST_);
+    return false;
+  }
+
+  const uint8_t* key     = NULL;
+  size_t         keylen  = 0;
+  bool           upgrade = false;
+  bool           conn    = false;
+  bool           version = false;
+
+  /* skips the request line */
+  const uint8_t* line = memchr(req, '\n', len);
+  const uint8_t* end  = req + len;
+  while (line && ++line < end) {
+    const uint8_t* eol = memchr(line, '\n', end-line);
+    if (HEDLEY_UNLIKELY(eol == NULL)) {
+      break;
+    }
+    const uint8_t* colon = memchr(line, ':', eol-line);
+    if (HEDLEY_LIKELY(colon)) {
+      const size_t namelen = colon - line;
+
+      const uint8_t* v  = colon+1;
+      const uint8_t* ve = eol;
+      while (v < ve && isspace(*v)) {
+        ++v;
+      }
+      while (v < ve && isspace(ve[-1])) {
+        --ve;
+      }
+
+#     define match_(name) \
+        (sizeof(name) == namelen+1 && utf8ncasecmp(name, line, namelen) == 0)
+      if (match_("sec-websocket-key")) {
+        key    = v;
+        keylen = ve - v;
+      } else if (match_("sec-websocket-version")) {
+        version = ve-v == sizeof(VERSION_)-1 &&
+          utf8ncmp(v, VERSION_, sizeof(VERSION_)-1) == 0;
+      } else if (match_("upgrade")) {
+        upgrade = ve-v == 9 && utf8ncasecmp(v, "websocket", 9) == 0;
+      } else if (match_("connection")) {
+        /* the header may be repeated */
+        conn = conn || ws_has_token_(v, ve, "upgrade");
+      }
+#     undef match_
+    }
+    line = eol;
+  }
+  if (HEDLEY_UNLIKELY(!upgrade || !conn || key == NULL || keylen == 0)) {
+    upd_iso_msgf(iso, "ws cli error: not a WebSocket upgrade request\n");
+    ws_respond_(ws, RESP_BAD_REQUEST_);
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(!version)) {
+    upd_iso_msgf(iso, "ws cli error: unsupported WebSocket version\n");
+    ws_respond_(ws, RESP_UPGRADE_REQUIRED_);
+    return false;
+  }
+
+  uint8_t hash[SHA1_BLOCK_SIZE];
+  SHA1_CTX sha1;
+  sha1_init(&sha1);
+  sha1_update(&sha1, key, keylen);
+  sha1_update(&sha1, (const uint8_t*) GUID_, sizeof(GUID_)-1);
+  sha1_final(&sha1, hash);
+
+  uint8_t accept[(SHA1_BLOCK_SIZE+2)/3*4+1];
+  const size_t acceptlen = base64_encode(hash, accept, SHA1_BLOCK_SIZE, 0);
+
+  static const char head[] =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Accept: ";
+  const uv_buf_t bufs[] = {
+    uv_buf_init((char*) head, sizeof(head)-1),
+    uv_buf_init((char*) accept, acceptlen),
+    uv_buf_init("\r\n\r\n", 4),
+  };
+  return ws->send(ws->udata, bufs, sizeof(bufs)/sizeof(bufs[0]));
+}
+
+static bool ws_respond_(upd_driver_srv_ws_t* ws, const char* resp) {
+  const uv_buf_t buf = uv_buf_init((char*) resp, utf8size_lazy(resp));
+  return ws->send(ws->udata, &buf, 1);
+}
+
+static bool ws_has_token_(
+    const uint8_t* v, const uint8_t* ve, const char* token) {
+  const size_t len = utf8size_lazy(token);
+
+  /* the value is a comma-separated list, such as "keep-alive, Upgrade" */
+  while (v < ve) {
+    const uint8_t* e = memchr(v, ',', ve-v);
+    if (HEDLEY_UNLIKELY(e == NULL)) {
+      e = ve;
+    }
+    const uint8_t* te = e;
+    while (v < te && isspace(*v)) {
+      ++v;
+    }
+    while (v < te && isspace(te[-1])) {
+      --te;
+    }
+    if (HEDLEY_LIKELY((size_t) (te-v) == len)) {
+      if (HEDLEY_LIKELY(utf8ncasecmp(v, token, len) == 0)) {
+        return true;
+      }
+    }
+    v = e+1;
+  }
+  return false;
+}
+
+static size_t ws_decode_(
+    upd_driver_srv_ws_t* ws, uint8_t* buf, size_t off, size_t n) {
+  upd_iso_t* iso = ws->iso;
+
+  size_t out = 0;
+  for (size_t i = off; i < n;) {
+    if (HEDLEY_LIKELY(ws->payload)) {
+      /*  Unmasked payload of data frames is moved forward in place,
+       * because headers between frames are dropped. */
+      size_t m = n - i;
+      if (HEDLEY_LIKELY(m > ws->rest)) {
+        m = ws->rest;
+      }
+      const bool ctl = ws->opcode & 0x8;
+      const uint8_t* mask = ws->hdr + ws->hdrlen - 4;
+      const bool text = !ctl && ws->text;
+      for (size_t j = 0; j < m; ++j) {
+        const uint8_t c = buf[i+j] ^ mask[(ws->offset+j) % 4];
+        if (HEDLEY_UNLIKELY(ctl)) {
+          ws->ctl[ws->ctllen++] = c;
+        } else {
+          if (HEDLEY_UNLIKELY(text && !ws_validate_utf8_(ws, c))) {
+            goto INVALID;
+          }
+          buf[out++] = c;
+        }
+      }
+      i          += m;
+      ws->offset += m;
+      ws->rest   -= m;
+
+    } else {
+      uint8_t* hdr = ws->hdr;
+      hdr[ws->hdrlen++] = buf[i++];
+      if (HEDLEY_LIKELY(ws->hdrlen < 2)) {
+        continue;
+      }
+
+      /* frames from clients must be masked, and extensions are not used */
+      if (HEDLEY_UNLIKELY(!(hdr[1] & 0x80) || (hdr[0] & 0x70))) {
+        upd_iso_msgf(iso, "ws cli error: invalid frame\n");
+        goto ERROR;
+      }
+
+      const uint8_t len7 = hdr[1] & 0x7F;
+      const size_t  ext  = len7 == 126? 2: len7 == 127? 8: 0;
+      if (HEDLEY_LIKELY(ws->hdrlen < 2+ext+4)) {
+        continue;
+      }
+
+      /* the most significant bit of 64-bit length must be 0 */
+      if (HEDLEY_UNLIKELY(ext == 8 && (hdr[2] & 0x80))) {
+        upd_iso_msgf(iso, "ws cli error: invalid payload length\n");
+        goto ERROR;
+      }
+      uint64_t len = len7;
+      if (HEDLEY_UNLIKELY(ext)) {
+        len = 0;
+        for (size_t j = 0; j < ext; ++j) {
+          len = len << 8 | hdr[2+j];
+        }
+      }
+
+      const bool    fin    = hdr[0] & 0x80;
+      const uint8_t opcode = hdr[0] & 0x0F;
+      if (HEDLEY_UNLIKELY(opcode & 0x8)) {
+        if (HEDLEY_UNLIKELY(!fin || len > 125)) {
+          upd_iso_msgf(iso, "ws cli error: invalid control frame\n");
+          goto ERROR;
+        }
+      } else if (HEDLEY_UNLIKELY(opcode > 0x2)) {
+        upd_iso_msgf(iso, "ws cli error: unknown opcode\n");
+        goto ERROR;
+      } else {
+        /*  Only continuation frames can follow a fragmented frame,
+         * while control frames can be injected between them. */
+        const bool cont = opcode == 0x0;
+        if (HEDLEY_UNLIKELY(cont != ws->fragmented)) {
+          upd_iso_msgf(iso, "ws cli error: unexpected fragmentation\n");
+          goto ERROR;
+        }
+        if (HEDLEY_LIKELY(opcode)) {
+          ws->text = opcode == 0x1;
+        }
+        ws->fragmented = !fin;
+      }
+      ws->opcode  = opcode;
+      ws->rest    = len;
+      ws->offset  = 0;
+      ws->ctllen  = 0;
+      ws->payload = true;
+    }
+
+    if (HEDLEY_UNLIKELY(ws->payload && ws->rest == 0)) {
+      ws->payload = false;
+      ws->hdrlen  = 0;
+      if (HEDLEY_UNLIKELY(ws->opcode & 0x8)) {
+        if (HEDLEY_UNLIKELY(!ws_handle_control_(ws))) {
+          return SIZE_MAX;
+        }
+      } else if (HEDLEY_UNLIKELY(!ws->fragmented && ws->utf8.need)) {
+        /* the text message ends in the middle of a character */
+        goto INVALID;
+      }
+    }
+  }
+  return out;
+
+ERROR:
+  return ws_fail_(ws, 1002 /* protocol error */);
+
+INVALID:
+  upd_iso_msgf(iso, "ws cli error: invalid UTF-8 in text message\n");
+  return ws_fail_(ws, 1007 /* invalid frame payload data */);
+}
+
+static bool ws_validate_utf8_(upd_driver_srv_ws_t* ws, uint8_t c) {
+  if (HEDLEY_LIKELY(ws->utf8.need == 0)) {
+    if (HEDLEY_LIKELY(c < 0x80)) {
+      return true;
+    }
+    if (HEDLEY_UNLIKELY(c < 0xC2 || 0xF4 < c)) {
+      return false;
+    }
+    /* rejects overlong forms, surrogates and code points over U+10FFFF */
+    ws->utf8.need = c < 0xE0? 1: c < 0xF0? 2: 3;
+    ws->utf8.lo   = c == 0xE0? 0xA0: c == 0xF0? 0x90: 0x80;
+    ws->utf8.hi   = c == 0xED? 0x9F: c == 0xF4? 0x8F: 0xBF;
+    return true;
+  }
+  if (HEDLEY_UNLIKELY(c < ws->utf8.lo || ws->utf8.hi < c)) {
+    return false;
+  }
+  ws->utf8.lo = 0x80;
+  ws->utf8.hi = 0xBF;
+  --ws->utf8.need;
+  return true;
+}
+
+static size_t ws_fail_(upd_driver_srv_ws_t* ws, uint16_t code) {
+  const uint8_t payload[] = { code >> 8, code & 0xFF, };
+  upd_driver_srv_ws_send(ws, 0x8, payload, sizeof(payload));
+  ws->closing = true;
+  return SIZE_MAX;
+}
+
+static bool ws_handle_control_(upd_driver_srv_ws_t* ws) {
+  switch (ws->opcode) {
+  case 0x8:  /* close */
+    upd_driver_srv_ws_send(ws, 0x8, ws->ctl, ws->ctllen < 2? 0: 2);
+    ws->closing = true;
+    return false;
+
+  case 0x9:  /* ping */
+    return upd_driver_srv_ws_send(ws, 0xA, ws->ctl, ws->ctllen);
+
+  default:  /* pong */
+    return true;
+  }
+}
+
+static size_t ws_encode_header_(uint8_t* dst, uint8_t opcode, uint64_t len) {
+  /* frames from server are not masked nor fragmented */
+  dst[0] = 0x80 | opcode;
+  if (HEDLEY_LIKELY(len < 126)) {
+    dst[1] = len;
+    return 2;
+  }
+  if (HEDLEY_LIKELY(len <= UINT16_MAX)) {
+    dst[1] = 126;
+    dst[2] = len >> 8;
+    dst[3] = len;
+    return 4;
+  }
+  dst[1] = 127;
+  for (size_t i = 0; i < 8; ++i) {
+    dst[2+i] = len >> (56-i*8);
+  }
+  return 10;
+}
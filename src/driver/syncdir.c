@@ -3,10 +3,19 @@
 
 #define DEFAULT_PERMISSION_ 0600
 
+#define SNAPSHOT_MAGIC_      "UPDSNAP1"
+#define SNAPSHOT_MAGIC_SIZE_ 8
+#define SNAPSHOT_SAVE_WAIT_  5000  /* ms */
+
 
 typedef struct ctx_t_    ctx_t_;
 typedef struct task_t_   task_t_;
 typedef struct drvmap_t_ drvmap_t_;
+typedef struct child_t_  child_t_;
+typedef struct stat_t_   stat_t_;
+typedef struct snap_t_   snap_t_;
+typedef struct snapio_t_ snapio_t_;
+typedef struct nstat_t_  nstat_t_;
 
 struct ctx_t_ {
   upd_file_t*      file;
@@ -16,16 +25,121 @@ struct ctx_t_ {
 
   upd_array_of(upd_req_dir_entity_t*) children;
 
+  upd_htable_t index;  /* of the children by name */
+
   task_t_*   last_task;
   drvmap_t_* drvmap;
+  size_t     depth;
 
   bool                     busy;
+  bool                     scanned;
+  bool                     capped;  /* max_entries has been reported */
+  size_t                   unseen;  /* by the running scan */
   upd_array_of(upd_req_t*) reqs;
+
+  /* native changes are applied after they settle */
+  upd_iso_timer_t debounce;
+
+  uint64_t mtime;  /* of the native directory at the last full scan */
+
+  size_t stats;     /* targeted stats in flight */
+  bool   modified;  /* by the running sync */
+  bool   full;      /* the next sync must rescan whole directory */
+  bool   dirty;     /* changed while syncing */
+
+  /* metadata of the children are captured on a worker in bulk */
+  struct {
+    bool running;
+    bool dirty;
+
+    /* LIST waits for the running capture */
+    upd_array_of(upd_req_t*) lists;
+  } nstat;
 };
 
+/* shared by all directories in the same mount */
 struct drvmap_t_ {
   size_t refcnt;
   upd_array_of(upd_driver_rule_t*) rules;
+  upd_array_of(uint8_t*)           ignore;
+
+  uint64_t debounce;
+
+  size_t max_depth;
+  size_t max_entries;
+
+  size_t rootlen;  /* npathlen of the mount point */
+
+  /* directories recorded in the snapshot file, sorted by path */
+  struct {
+    uint8_t*               npath;  /* NULL when disabled */
+    upd_array_of(snap_t_*) dirs;
+    bool                   loading;
+
+    /* changes are saved in a batch after a while */
+    ctx_t_*         root;  /* NULL after the mount point is gone */
+    upd_iso_timer_t timer;
+    bool            dirty;
+    bool            saving;
+    bool            closing;
+  } snap;
+};
+
+/*  Children are materialized into files lazily,
+ * so entry.file is NULL until someone finds or lists it. */
+struct child_t_ {
+  upd_req_dir_entry_t entry;  /* must be the first member */
+
+  uint64_t hash;
+  size_t   index;  /* in ctx->children */
+  bool     seen;
+  bool     dir;
+
+  upd_file_nstat_t nstat;  /* invalid until captured, only for files */
+};
+
+struct stat_t_ {
+  uv_fs_t          fsreq;
+  upd_file_lock_t* lock;
+
+  uint8_t* name;
+  size_t   len;
+};
+
+/*  Entries of a directory persisted across boots,
+ * which are trusted only while mtime of the native one is the same. */
+struct snap_t_ {
+  uint64_t mtime;
+
+  uint8_t* path;  /* relative to the mount point */
+  size_t   pathlen;
+
+  uint8_t* data;  /* sequence of (dir flag, name, '\0') */
+  size_t   size;
+};
+
+/*  Names are copied for the worker thread,
+ * because the children can be removed while it's running. */
+struct nstat_t_ {
+  upd_file_t* file;
+  uv_loop_t*  loop;
+
+  size_t            n;
+  uint8_t**         names;
+  upd_file_nstat_t* items;
+};
+
+/*  Snapshot files are read and written on worker threads,
+ * so buf is allocated by malloc because upd_malloc is not thread safe. */
+struct snapio_t_ {
+  upd_file_t* file;
+
+  uint8_t* buf;
+  size_t   size;
+  bool     ok;
+
+  uint8_t npath[UPD_PATH_MAX];
+  uint8_t tmp  [UPD_PATH_MAX];
 };
 
 
@@ -62,8 +176,34 @@ const upd_driver_t upd_driver_syncdir = {
 static
 void
 syncdir_inherit_drvmap_(
-  ctx_t_*    ctx,
-  drvmap_t_* drvmap);
+  ctx_t_*       ctx,
+  const ctx_t_* parent);
+
+static
+bool
+syncdir_glob_(
+  const uint8_t* pat,
+  size_t         patlen,
+  const uint8_t* str,
+  size_t         strlen);
+
+static
+bool
+syncdir_accept_(
+  ctx_t_*        ctx,
+  const uint8_t* name,
+  size_t         len,
+  bool           dir);
+
+/* Returns a path relative to the mount point, or of the child if len > 0. */
+static
+bool
+syncdir_relpath_(
+  ctx_t_*        ctx,
+  uint8_t*       dst,
+  size_t*        dstlen,
+  const uint8_t* name,
+  size_t         len);
 
 static
 size_t
@@ -81,23 +221,174 @@ syncdir_stack_child_npath_(
   const uint8_t* name,
   size_t         len);
 
+static
+uint64_t
+syncdir_mtime_(
+  const uv_timespec_t* t);
+
+static
+uint64_t
+syncdir_hash_(
+  const void* item);
+
+static
+child_t_*
+syncdir_index_lookup_(
+  ctx_t_*        ctx,
+  const uint8_t* name,
+  size_t         len,
+  uint64_t       hash);
+
+static
+child_t_*
+syncdir_add_child_(
+  ctx_t_*        ctx,
+  const uint8_t* name,
+  size_t         len,
+  uint64_t       hash,
+  bool           dir);
+
+static
+void
+syncdir_drop_child_(
+  ctx_t_*   ctx,
+  child_t_* c);
+
+static
+void
+syncdir_remove_child_(
+  ctx_t_*   ctx,
+  child_t_* c);
+
+static
+bool
+syncdir_materialize_(
+  ctx_t_*   ctx,
+  child_t_* c);
+
 static
 bool
 syncdir_find_(
   ctx_t_*              ctx,
   upd_req_dir_entry_t* e);
 
+static
+bool
+syncdir_defer_list_(
+  ctx_t_*    ctx,
+  upd_req_t* req);
+
+static
+bool
+syncdir_respond_(
+  ctx_t_*    ctx,
+  upd_req_t* req);
+
 static
 bool
 syncdir_sync_n2u_(
   ctx_t_*    ctx,
   upd_req_t* req);
 
+static
+void
+syncdir_sync_schedule_(
+  ctx_t_* ctx);
+
+static
+bool
+syncdir_sync_targeted_(
+  upd_file_lock_t*        lock,
+  upd_array_of(uint8_t*)* names);
+
+static
+void
+syncdir_sync_done_(
+  upd_file_lock_t* lock);
+
 static
 void
 syncdir_sync_finalize_(
   ctx_t_* ctx);
 
+static
+bool
+syncdir_scandir_(
+  upd_file_lock_t* lock);
+
+static
+void
+syncdir_nstat_(
+  ctx_t_* ctx);
+
+static
+int
+syncdir_snap_cmp_(
+  const snap_t_* s,
+  const uint8_t* path,
+  size_t         len);
+
+static
+bool
+syncdir_snap_find_(
+  drvmap_t_*     drvmap,
+  size_t*        i,
+  const uint8_t* path,
+  size_t         len);
+
+static
+snap_t_*
+syncdir_snap_new_(
+  const uint8_t* path,
+  size_t         pathlen,
+  const uint8_t* data,
+  size_t         size,
+  uint64_t       mtime);
+
+static
+void
+syncdir_snap_clear_(
+  drvmap_t_* drvmap);
+
+static
+bool
+syncdir_snap_parse_(
+  drvmap_t_*     drvmap,
+  const uint8_t* buf,
+  size_t         size);
+
+static
+bool
+syncdir_snap_apply_(
+  ctx_t_* ctx);
+
+static
+void
+syncdir_snap_record_(
+  ctx_t_* ctx);
+
+static
+void
+syncdir_snap_forget_(
+  ctx_t_*        ctx,
+  const uint8_t* name,
+  size_t         len);
+
+static
+bool
+syncdir_snap_load_(
+  ctx_t_* ctx);
+
+static
+void
+syncdir_snap_save_(
+  ctx_t_* ctx);
+
+static
+void
+syncdir_snap_touch_(
+  drvmap_t_* drvmap);
+
 
 static
 void
@@ -129,6 +420,59 @@ void
 syncdir_sync_n2u_scandir_cb_(
   uv_fs_t* fsreq);
 
+static
+void
+syncdir_sync_n2u_stat_cb_(
+  uv_fs_t* fsreq);
+
+static
+void
+syncdir_sync_n2u_mtime_cb_(
+  uv_fs_t* fsreq);
+
+static
+void
+syncdir_debounce_cb_(
+  upd_iso_timer_t* t);
+
+static
+void
+syncdir_nstat_main_(
+  void* udata);
+
+static
+void
+syncdir_nstat_cb_(
+  upd_iso_t* iso,
+  void*      udata);
+
+static
+void
+syncdir_snap_load_main_(
+  void* udata);
+
+static
+void
+syncdir_snap_load_cb_(
+  upd_iso_t* iso,
+  void*      udata);
+
+static
+void
+syncdir_snap_timer_cb_(
+  upd_iso_timer_t* t);
+
+static
+void
+syncdir_snap_save_main_(
+  void* udata);
+
+static
+void
+syncdir_snap_save_cb_(
+  upd_iso_t* iso,
+  void*      udata);
+
 
 static bool syncdir_init_(upd_file_t* file) {
   if (HEDLEY_UNLIKELY(file->npath == NULL)) {
@@ -144,7 +488,12 @@ static bool syncdir_init_(upd_file_t* file) {
       .udata = ctx,
       .cb    = syncdir_watch_cb_,
     },
-    .file = file,
+    .debounce = {
+      .udata = ctx,
+      .cb    = syncdir_debounce_cb_,
+    },
+    .index = { .hash = syncdir_hash_, },
+    .file  = file,
   };
   if (HEDLEY_UNLIKELY(!upd_file_watch(&ctx->watch))) {
     upd_free(&ctx);
@@ -156,12 +505,21 @@ static bool syncdir_init_(upd_file_t* file) {
 
 static void syncdir_deinit_(upd_file_t* file) {
   ctx_t_* ctx = file->ctx;
+
+  upd_iso_timer_stop(file->iso, &ctx->debounce);
+  if (HEDLEY_UNLIKELY(ctx->drvmap && ctx->drvmap->snap.root == ctx)) {
+    upd_iso_timer_stop(file->iso, &ctx->drvmap->snap.timer);
+    ctx->drvmap->snap.root = NULL;
+  }
   for (size_t i = 0; i < ctx->children.n; ++i) {
     upd_req_dir_entry_t* e = ctx->children.p[i];
-    upd_file_unref(e->file);
+    if (HEDLEY_LIKELY(e->file)) {
+      upd_file_unref(e->file);
+    }
     upd_free(&e);
   }
   upd_array_clear(&ctx->children);
+  upd_htable_clear(&ctx->index);
 
   if (HEDLEY_LIKELY(ctx->drvmap)) {
     if (HEDLEY_UNLIKELY(--ctx->drvmap->refcnt == 0)) {
@@ -169,6 +527,12 @@ static void syncdir_deinit_(upd_file_t* file) {
         upd_free(&ctx->drvmap->rules.p[i]);
       }
       upd_array_clear(&ctx->drvmap->rules);
+      for (size_t i = 0; i < ctx->drvmap->ignore.n; ++i) {
+        upd_free(&ctx->drvmap->ignore.p[i]);
+      }
+      upd_array_clear(&ctx->drvmap->ignore);
+      syncdir_snap_clear_(ctx->drvmap);
+      upd_free(&ctx->drvmap->snap.npath);
       upd_free(&ctx->drvmap);
     }
   }
@@ -192,16 +556,24 @@ static bool syncdir_handle_(upd_req_t* req) {
     break;
 
   case UPD_REQ_DIR_LIST:
-    req->dir.entries = (upd_req_dir_entries_t) {
-      .p = (upd_req_dir_entry_t**) ctx->children.p,
-      .n = ctx->children.n,
-    };
+  case UPD_REQ_DIR_FIND:
+    /* the directory is scanned at the first touch */
+    if (HEDLEY_UNLIKELY(!ctx->scanned && ctx->drvmap)) {
+      if (HEDLEY_UNLIKELY(!syncdir_sync_n2u_(ctx, req))) {
+        req->result = UPD_REQ_NOMEM;
+        return false;
+      }
+      return true;
+    }
+    if (HEDLEY_UNLIKELY(syncdir_defer_list_(ctx, req))) {
+      return true;
+    }
+    if (HEDLEY_UNLIKELY(!syncdir_respond_(ctx, req))) {
+      req->result = UPD_REQ_NOMEM;
+      return false;
+    }
     break;
 
-  case UPD_REQ_DIR_FIND: {
-    syncdir_find_(ctx, &req->dir.entry);
-  } break;
-
   case UPD_REQ_DIR_NEW:
   case UPD_REQ_DIR_NEWDIR: {
     const upd_req_dir_entry_t* e = &req->dir.entry;
@@ -249,8 +621,8 @@ static bool syncdir_handle_(upd_req_t* req) {
 }
 
 
-void upd_driver_syncdir_set_rules(
-    upd_file_t* file, const upd_array_of(upd_driver_rule_t*)* rules) {
+void upd_driver_syncdir_setup(
+    upd_file_t* file, const upd_driver_syncdir_opts_t* opts) {
   assert(file->driver == &upd_driver_syncdir);
 
   ctx_t_* ctx = file->ctx;
@@ -260,23 +632,166 @@ void upd_driver_syncdir_set_rules(
     return;
   }
   *ctx->drvmap = (drvmap_t_) {
-    .refcnt = 1,
-    .rules  = *rules,
+    .refcnt      = 1,
+    .rules       = opts->rules,
+    .ignore      = opts->ignore,
+    .debounce    = opts->debounce,
+    .max_depth   = opts->max_depth,
+    .max_entries = opts->max_entries,
+    .rootlen     = file->npathlen,
+    .snap = {
+      .root  = ctx,
+      .timer = {
+        .udata = ctx->drvmap,
+        .cb    = syncdir_snap_timer_cb_,
+      },
+    },
   };
+
+  if (HEDLEY_UNLIKELY(opts->snapshot)) {
+    const size_t len = utf8size_lazy(opts->snapshot);
+
+    uint8_t** npath = &ctx->drvmap->snap.npath;
+    if (HEDLEY_UNLIKELY(len >= UPD_PATH_MAX || !upd_malloc(npath, len+1))) {
+      upd_iso_msgf(file->iso,
+        "upd.syncdir: snapshot is disabled because of allocation failure\n");
+    } else {
+      utf8ncpy(*npath, opts->snapshot, len);
+      (*npath)[len] = 0;
+
+      /* the first scan waits for the snapshot */
+      if (HEDLEY_LIKELY(syncdir_snap_load_(ctx))) {
+        return;
+      }
+    }
+  }
   syncdir_sync_n2u_(ctx, NULL);
 }
 
-static void syncdir_inherit_drvmap_(ctx_t_* ctx, drvmap_t_* drvmap) {
+static void syncdir_inherit_drvmap_(ctx_t_* ctx, const ctx_t_* parent) {
+  drvmap_t_* drvmap = parent->drvmap;
   if (HEDLEY_UNLIKELY(drvmap == NULL)) {
     return;
   }
+  /* scanning is deferred until the first LIST or FIND */
   ++drvmap->refcnt;
   ctx->drvmap = drvmap;
-  if (HEDLEY_UNLIKELY(!syncdir_sync_n2u_(ctx, NULL))) {
-    --drvmap->refcnt;
-    ctx->drvmap = NULL;
-    return;
+  ctx->depth  = parent->depth+1;
+}
+
+static bool syncdir_glob_(
+    const uint8_t* pat, size_t patlen, const uint8_t* str, size_t strlen) {
+  /*  Only the last '*' and the last '**' are remembered to backtrack,
+   * because a later star can take anything an earlier one could. */
+  size_t p = 0, s = 0;
+
+  size_t star_p = SIZE_MAX, star_s = 0;
+  size_t any_p  = SIZE_MAX, any_s  = 0;
+
+  while (s < strlen) {
+    if (p < patlen && pat[p] == '*') {
+      /* '**' matches across the separators */
+      if (p+1 < patlen && pat[p+1] == '*') {
+        p += 2;
+        any_p  = p;
+        any_s  = s;
+        star_p = SIZE_MAX;
+      } else {
+        p += 1;
+        star_p = p;
+        star_s = s;
+      }
+      continue;
+    }
+    if (HEDLEY_LIKELY(p < patlen)) {
+      const bool match = pat[p] == '?'? str[s] != '/': pat[p] == str[s];
+      if (HEDLEY_LIKELY(match)) {
+        ++p; ++s;
+        continue;
+      }
+    }
+
+    if (star_p != SIZE_MAX && str[star_s] != '/') {
+      p = star_p;
+      s = ++star_s;
+      continue;
+    }
+    if (any_p != SIZE_MAX) {
+      star_p = SIZE_MAX;
+      p = any_p;
+      s = ++any_s;
+      continue;
+    }
+    return false;
+  }
+  while (p < patlen && pat[p] == '*') {
+    ++p;
+  }
+  return p == patlen;
+}
+
+static bool syncdir_accept_(
+    ctx_t_* ctx, const uint8_t* name, size_t len, bool dir) {
+  const drvmap_t_* drvmap = ctx->drvmap;
+
+  if (HEDLEY_UNLIKELY(dir && ctx->depth >= drvmap->max_depth)) {
+    return false;
+  }
+  if (HEDLEY_LIKELY(drvmap->ignore.n == 0)) {
+    return true;
+  }
+
+  /*  Patterns with separators are matched with the path from the mount point,
+   * and the others are matched with the name. */
+  uint8_t path[UPD_PATH_MAX];
+  size_t  pathlen;
+  if (HEDLEY_UNLIKELY(!syncdir_relpath_(ctx, path, &pathlen, name, len))) {
+    pathlen = 0;
+  }
+
+  for (size_t i = 0; i < drvmap->ignore.n; ++i) {
+    const uint8_t* pat    = drvmap->ignore.p[i];
+    const size_t   patlen = utf8size_lazy(pat);
+
+    const bool match = utf8chr(pat, '/')?
+      syncdir_glob_(pat, patlen, path, pathlen):
+      syncdir_glob_(pat, patlen, name, len);
+    if (HEDLEY_UNLIKELY(match)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool syncdir_relpath_(
+    ctx_t_*        ctx,
+    uint8_t*       dst,
+    size_t*        dstlen,
+    const uint8_t* name,
+    size_t         len) {
+  const upd_file_t* f      = ctx->file;
+  const drvmap_t_*  drvmap = ctx->drvmap;
+
+  const uint8_t* rel    = f->npath + drvmap->rootlen;
+  size_t         rellen = f->npathlen - drvmap->rootlen;
+  while (rellen && (*rel == '/' || *rel == '\\')) {
+    ++rel; --rellen;
+  }
+  if (HEDLEY_UNLIKELY(rellen+1+len >= UPD_PATH_MAX)) {
+    return false;
+  }
+
+  utf8ncpy(dst, rel, rellen);
+  *dstlen = rellen;
+  if (HEDLEY_LIKELY(len)) {
+    if (rellen) {
+      dst[(*dstlen)++] = '/';
+    }
+    utf8ncpy(dst+*dstlen, name, len);
+    *dstlen += len;
   }
+  dst[*dstlen] = 0;
+  return true;
 }
 
 static size_t syncdir_stack_child_path_(
@@ -323,33 +838,233 @@ static size_t syncdir_stack_child_npath_(
   return dstlen;
 }
 
-static bool syncdir_find_(ctx_t_* ctx, upd_req_dir_entry_t* e) {
-  for (size_t i = 0; i < ctx->children.n; ++i) {
-    const upd_req_dir_entry_t* g = ctx->children.p[i];
+static uint64_t syncdir_mtime_(const uv_timespec_t* t) {
+  return (uint64_t) t->tv_sec*UINT64_C(1000000000) + (uint64_t) t->tv_nsec;
+}
+
+static uint64_t syncdir_hash_(const void* item) {
+  const child_t_* c = item;
+  return c->hash;
+}
+
+static child_t_* syncdir_index_lookup_(
+    ctx_t_* ctx, const uint8_t* name, size_t len, uint64_t hash) {
+  size_t    i = SIZE_MAX;
+  child_t_* c;
+  while ((c = upd_htable_next(&ctx->index, hash, &i))) {
     const bool match =
-      g->len == e->len && utf8ncmp(e->name, g->name, g->len) == 0;
-    if (HEDLEY_UNLIKELY(match)) {
-      *e = *g;
-      return true;
+      c->hash      == hash &&
+      c->entry.len == len  &&
+      utf8ncmp(c->entry.name, name, len) == 0;
+    if (HEDLEY_LIKELY(match)) {
+      return c;
     }
   }
-  *e = (upd_req_dir_entry_t) {0};
-  return false;
+  return NULL;
 }
 
-static bool syncdir_sync_n2u_(ctx_t_* ctx, upd_req_t* req) {
-  upd_file_t* f = ctx->file;
-
-  if (HEDLEY_UNLIKELY(req)) {
-    if (HEDLEY_UNLIKELY(!upd_array_insert(&ctx->reqs, req, SIZE_MAX))) {
-      return false;
-    }
+static child_t_* syncdir_add_child_(
+    ctx_t_* ctx, const uint8_t* name, size_t len, uint64_t hash, bool dir) {
+  if (HEDLEY_UNLIKELY(!syncdir_accept_(ctx, name, len, dir))) {
+    return NULL;
+  }
+  /* unseen children will be dropped after the scan */
+  const size_t n = ctx->children.n - ctx->unseen;
+  if (HEDLEY_UNLIKELY(n >= ctx->drvmap->max_entries)) {
+    if (HEDLEY_UNLIKELY(!ctx->capped)) {
+      upd_iso_msgf(ctx->file->iso,
+        "upd.syncdir: too many entries, following ones are skipped (%s)\n",
+        ctx->file->npath);
+      ctx->capped = true;
+    }
+    return NULL;
+  }
+
+  child_t_* c = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&c, sizeof(*c)+len+1))) {
+    return NULL;
+  }
+  *c = (child_t_) {
+    .entry = {
+      .name = (uint8_t*) (c+1),
+      .len  = len,
+    },
+    .hash = hash,
+    .seen = true,
+    .dir  = dir,
+  };
+  utf8ncpy(c->entry.name, name, len);
+  c->entry.name[len] = 0;
+
+  if (HEDLEY_UNLIKELY(!upd_htable_insert(&ctx->index, c))) {
+    upd_free(&c);
+    return NULL;
+  }
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&ctx->children, c, SIZE_MAX))) {
+    upd_htable_remove(&ctx->index, c);
+    upd_free(&c);
+    return NULL;
+  }
+  c->index = ctx->children.n-1;
+  return c;
+}
+
+/* The caller must remove the child from ctx->children. */
+static void syncdir_drop_child_(ctx_t_* ctx, child_t_* c) {
+  if (HEDLEY_UNLIKELY(c->dir && ctx->drvmap && ctx->drvmap->snap.npath)) {
+    syncdir_snap_forget_(ctx, c->entry.name, c->entry.len);
+  }
+  upd_htable_remove(&ctx->index, c);
+  if (HEDLEY_LIKELY(c->entry.file)) {
+    upd_file_unref(c->entry.file);
+  }
+  upd_free(&c);
+}
+
+static void syncdir_remove_child_(ctx_t_* ctx, child_t_* c) {
+  /* swaps with the last one to remove in O(1) */
+  child_t_* last = ctx->children.p[ctx->children.n-1];
+  assert(ctx->children.p[c->index] == c);
+
+  ctx->children.p[c->index] = last;
+  last->index = c->index;
+  upd_array_remove(&ctx->children, ctx->children.n-1);
+
+  syncdir_drop_child_(ctx, c);
+}
+
+static bool syncdir_materialize_(ctx_t_* ctx, child_t_* c) {
+  upd_file_t* f   = ctx->file;
+  upd_iso_t*  iso = f->iso;
+
+  if (HEDLEY_LIKELY(c->entry.file)) {
+    return true;
+  }
+
+  const uint8_t* name = c->entry.name;
+  const size_t   len  = c->entry.len;
+
+  uint8_t* path;
+  const size_t pathlen = syncdir_stack_child_path_(ctx, &path, name, len);
+  if (HEDLEY_UNLIKELY(pathlen == 0)) {
+    return false;
+  }
+
+  uint8_t* npath;
+  const size_t npathlen = syncdir_stack_child_npath_(ctx, &npath, name, len);
+  if (HEDLEY_UNLIKELY(npathlen == 0)) {
+    upd_iso_unstack(iso, path);
+    return false;
+  }
+
+  const upd_driver_t* d;
+  if (c->dir) {
+    d = &upd_driver_syncdir;
+  } else {
+    d = upd_driver_select(&ctx->drvmap->rules, (uint8_t*) npath);
+    if (HEDLEY_UNLIKELY(d == NULL)) {
+      d = &upd_driver_bin_r;
+    }
+  }
+
+  /*  The metadata may be stale while changes are not applied yet,
+   * or nothing tells the changes. */
+  const bool fresh =
+    c->nstat.valid &&
+    upd_nwatch_is_active(ctx->file) &&
+    !ctx->debounce.prev &&
+    !upd_nwatch_has_changes(ctx->file);
+
+  const upd_file_t src = {
+    .iso      = iso,
+    .driver   = d,
+    .path     = path,
+    .pathlen  = pathlen,
+    .npath    = npath,
+    .npathlen = npathlen,
+  };
+  upd_file_t* fc = upd_file_new_with_nstat(&src, fresh? &c->nstat: NULL);
+  upd_iso_unstack(iso, npath);
+  upd_iso_unstack(iso, path);
+  if (HEDLEY_UNLIKELY(fc == NULL)) {
+    return false;
+  }
+  if (c->dir) {
+    syncdir_inherit_drvmap_(fc->ctx, ctx);
+  }
+  c->entry.file = fc;
+  return true;
+}
+
+static bool syncdir_find_(ctx_t_* ctx, upd_req_dir_entry_t* e) {
+  const uint64_t h = upd_htable_hash_str(e->name, e->len);
+
+  child_t_* c = syncdir_index_lookup_(ctx, e->name, e->len, h);
+  if (HEDLEY_UNLIKELY(c == NULL || !syncdir_materialize_(ctx, c))) {
+    goto ABORT;
+  }
+  *e = c->entry;
+  return true;
+
+ABORT:
+  *e = (upd_req_dir_entry_t) {0};
+  return false;
+}
+
+static bool syncdir_defer_list_(ctx_t_* ctx, upd_req_t* req) {
+  /* children materialized by LIST can skip their own stat after the capture */
+  if (HEDLEY_LIKELY(req->type != UPD_REQ_DIR_LIST || !ctx->nstat.running)) {
+    return false;
+  }
+  return upd_array_insert(&ctx->nstat.lists, req, SIZE_MAX);
+}
+
+static bool syncdir_respond_(ctx_t_* ctx, upd_req_t* req) {
+  switch (req->type) {
+  case UPD_REQ_DIR_LIST:
+    for (size_t i = 0; i < ctx->children.n; ++i) {
+      if (HEDLEY_UNLIKELY(!syncdir_materialize_(ctx, ctx->children.p[i]))) {
+        return false;
+      }
+    }
+    req->dir.entries = (upd_req_dir_entries_t) {
+      .p = (upd_req_dir_entry_t**) ctx->children.p,
+      .n = ctx->children.n,
+    };
+    return true;
+
+  case UPD_REQ_DIR_FIND:
+    syncdir_find_(ctx, &req->dir.entry);
+    return true;
+
+  default:
+    assert(false);
+    return false;
+  }
+}
+
+static bool syncdir_sync_n2u_(ctx_t_* ctx, upd_req_t* req) {
+  upd_file_t* f = ctx->file;
+
+  if (HEDLEY_UNLIKELY(req)) {
+    if (HEDLEY_UNLIKELY(!upd_array_insert(&ctx->reqs, req, SIZE_MAX))) {
+      return false;
+    }
+    /* requests can't wait for the native watcher */
+    ctx->full = true;
+  }
+  if (HEDLEY_UNLIKELY(!ctx->scanned)) {
+    ctx->full = true;
   }
   if (HEDLEY_UNLIKELY(ctx->busy)) {
+    ctx->dirty = true;
     return true;
   }
 
-  ctx->busy = true;
+  ctx->busy     = true;
+  ctx->dirty    = false;
+  ctx->modified = false;
+  upd_iso_timer_stop(f->iso, &ctx->debounce);
 
   const bool lock = upd_file_lock_with_dup(&(upd_file_lock_t) {
       .file  = f,
@@ -362,17 +1077,595 @@ static bool syncdir_sync_n2u_(ctx_t_* ctx, upd_req_t* req) {
   return true;
 }
 
+static void syncdir_sync_schedule_(ctx_t_* ctx) {
+  upd_iso_t* iso = ctx->file->iso;
+
+  if (HEDLEY_UNLIKELY(ctx->busy)) {
+    ctx->dirty = true;
+    return;
+  }
+  if (HEDLEY_LIKELY(ctx->debounce.prev)) {
+    return;  /* already scheduled */
+  }
+
+  const uint64_t wait = ctx->drvmap? ctx->drvmap->debounce: 0;
+  if (HEDLEY_UNLIKELY(wait == 0)) {
+    if (HEDLEY_UNLIKELY(!syncdir_sync_n2u_(ctx, NULL))) {
+      upd_iso_msgf(iso,
+        "failed to queue task for synchronizing native to upd\n");
+    }
+    return;
+  }
+  upd_iso_timer_start(iso, &ctx->debounce, upd_iso_now(iso) + wait);
+}
+
+static bool syncdir_sync_targeted_(
+    upd_file_lock_t* lock, upd_array_of(uint8_t*)* names) {
+  ctx_t_*     ctx = lock->udata;
+  upd_file_t* f   = ctx->file;
+  upd_iso_t*  iso = f->iso;
+
+  for (size_t i = 0; i < names->n; ++i) {
+    uint8_t*     name = names->p[i];
+    const size_t len  = utf8size_lazy(name);
+
+    uint8_t* npath;
+    const size_t npathlen = syncdir_stack_child_npath_(ctx, &npath, name, len);
+    if (HEDLEY_UNLIKELY(npathlen == 0)) {
+      upd_free(&name);
+      continue;
+    }
+
+    stat_t_* st = upd_iso_stack(iso, sizeof(*st));
+    if (HEDLEY_UNLIKELY(st == NULL)) {
+      upd_iso_unstack(iso, npath);
+      upd_free(&name);
+      continue;
+    }
+    *st = (stat_t_) {
+      .lock = lock,
+      .name = name,
+      .len  = len,
+    };
+
+    const int err = uv_fs_stat(
+      &iso->loop, &st->fsreq, (char*) npath, syncdir_sync_n2u_stat_cb_);
+    upd_iso_unstack(iso, npath);
+    if (HEDLEY_UNLIKELY(0 > err)) {
+      upd_iso_unstack(iso, st);
+      upd_free(&name);
+      continue;
+    }
+    ++ctx->stats;
+  }
+  upd_array_clear(names);
+  return ctx->stats > 0;
+}
+
+static void syncdir_sync_done_(upd_file_lock_t* lock) {
+  ctx_t_*    ctx = lock->udata;
+  upd_iso_t* iso = ctx->file->iso;
+
+  if (HEDLEY_UNLIKELY(ctx->drvmap->snap.npath)) {
+    syncdir_snap_record_(ctx);
+  }
+  if (HEDLEY_UNLIKELY(ctx->modified)) {
+    upd_file_trigger(ctx->file, UPD_FILE_UPDATE);
+  }
+  syncdir_nstat_(ctx);
+  syncdir_sync_finalize_(ctx);
+
+  upd_file_unlock(lock);
+  upd_iso_unstack(iso, lock);
+}
+
 static void syncdir_sync_finalize_(ctx_t_* ctx) {
   assert(ctx->busy);
 
+  /* requests arrived while syncing need one more full scan */
+  if (HEDLEY_UNLIKELY(ctx->dirty && ctx->full)) {
+    ctx->busy = false;
+    if (HEDLEY_LIKELY(syncdir_sync_n2u_(ctx, NULL))) {
+      return;
+    }
+    ctx->busy = true;
+  }
+
   for (size_t i = 0; i < ctx->reqs.n; ++i) {
     upd_req_t* req = ctx->reqs.p[i];
-    req->result =
-      syncdir_find_(ctx, &req->dir.entry)? UPD_REQ_OK: UPD_REQ_ABORTED;
+    switch (req->type) {
+    case UPD_REQ_DIR_LIST:
+    case UPD_REQ_DIR_FIND:
+      if (HEDLEY_UNLIKELY(syncdir_defer_list_(ctx, req))) {
+        continue;
+      }
+      /* deferred until the first scan */
+      req->result =
+        syncdir_respond_(ctx, req)? UPD_REQ_OK: UPD_REQ_NOMEM;
+      break;
+    default:
+      /* the new entry made by NEW or NEWDIR */
+      req->result =
+        syncdir_find_(ctx, &req->dir.entry)? UPD_REQ_OK: UPD_REQ_ABORTED;
+      break;
+    }
     req->cb(req);
   }
   upd_array_clear(&ctx->reqs);
   ctx->busy = false;
+
+  if (HEDLEY_UNLIKELY(ctx->dirty)) {
+    ctx->dirty = false;
+    syncdir_sync_schedule_(ctx);
+  }
+}
+
+static bool syncdir_scandir_(upd_file_lock_t* lock) {
+  ctx_t_*     ctx = lock->udata;
+  upd_file_t* f   = ctx->file;
+  upd_iso_t*  iso = f->iso;
+
+  uv_fs_t* fsreq = upd_iso_stack(iso, sizeof(*fsreq));
+  if (HEDLEY_UNLIKELY(fsreq == NULL)) {
+    return false;
+  }
+  *fsreq = (uv_fs_t) { .data = lock, };
+
+  const bool scandir = 0 <= uv_fs_scandir(
+    &iso->loop, fsreq, (char*) f->npath, 0, syncdir_sync_n2u_scandir_cb_);
+  if (HEDLEY_UNLIKELY(!scandir)) {
+    upd_iso_unstack(iso, fsreq);
+    return false;
+  }
+  return true;
+}
+
+static void syncdir_nstat_(ctx_t_* ctx) {
+  upd_file_t* f   = ctx->file;
+  upd_iso_t*  iso = f->iso;
+
+  if (HEDLEY_UNLIKELY(ctx->nstat.running)) {
+    ctx->nstat.dirty = true;
+    return;
+  }
+  if (HEDLEY_UNLIKELY(!upd_nwatch_is_active(f))) {
+    return;  /* the metadata would never be trusted */
+  }
+
+  size_t n = 0, namesz = 0;
+  for (size_t i = 0; i < ctx->children.n; ++i) {
+    const child_t_* c = ctx->children.p[i];
+    if (HEDLEY_UNLIKELY(!c->dir && !c->nstat.valid)) {
+      ++n;
+      namesz += c->entry.len+1;
+    }
+  }
+  if (HEDLEY_LIKELY(n == 0)) {
+    return;
+  }
+
+  nstat_t_* ns = NULL;
+  const size_t itemsz = sizeof(*ns->names) + sizeof(*ns->items);
+  if (HEDLEY_UNLIKELY(!upd_malloc(&ns, sizeof(*ns) + n*itemsz + namesz))) {
+    goto ABORT;
+  }
+  *ns = (nstat_t_) {
+    .file  = f,
+    .loop  = &iso->loop,
+    .n     = n,
+    .names = (uint8_t**) (ns+1),
+    .items = (upd_file_nstat_t*) ((uint8_t**) (ns+1) + n),
+  };
+
+  uint8_t* p = (uint8_t*) (ns->items + n);
+  for (size_t i = 0, j = 0; i < ctx->children.n; ++i) {
+    const child_t_* c = ctx->children.p[i];
+    if (HEDLEY_UNLIKELY(!c->dir && !c->nstat.valid)) {
+      ns->names[j] = p;
+      ns->items[j] = (upd_file_nstat_t) {0};
+      ++j;
+
+      utf8ncpy(p, c->entry.name, c->entry.len);
+      p   += c->entry.len;
+      *(p++) = 0;
+    }
+  }
+
+  ctx->nstat.running = true;
+  upd_file_ref(f);
+
+  const bool work =
+    upd_iso_start_work(iso, syncdir_nstat_main_, syncdir_nstat_cb_, ns);
+  if (HEDLEY_UNLIKELY(!work)) {
+    ctx->nstat.running = false;
+    upd_file_unref(f);
+    goto ABORT;
+  }
+  return;
+
+ABORT:
+  upd_free(&ns);
+  upd_iso_msgf(iso, "upd.syncdir: failed to capture metadata of children\n");
+}
+
+static int syncdir_snap_cmp_(
+    const snap_t_* s, const uint8_t* path, size_t len) {
+  const size_t n = s->pathlen < len? s->pathlen: len;
+
+  const int cmp = memcmp(s->path, path, n);
+  if (HEDLEY_LIKELY(cmp)) {
+    return cmp;
+  }
+  return s->pathlen < len? -1: s->pathlen > len? 1: 0;
+}
+
+static bool syncdir_snap_find_(
+    drvmap_t_* drvmap, size_t* i, const uint8_t* path, size_t len) {
+  snap_t_** s = (void*) drvmap->snap.dirs.p;
+
+  size_t l = 0, r = drvmap->snap.dirs.n;
+  while (l < r) {
+    *i = (l+r)/2;
+
+    const int cmp = syncdir_snap_cmp_(s[*i], path, len);
+    if (HEDLEY_UNLIKELY(cmp == 0)) {
+      return true;
+    }
+    if (cmp > 0) {
+      r = *i;
+    } else {
+      l = *i+1;
+    }
+  }
+  *i = l;
+  return false;
+}
+
+static snap_t_* syncdir_snap_new_(
+    const uint8_t* path,
+    size_t         pathlen,
+    const uint8_t* data,
+    size_t         size,
+    uint64_t       mtime) {
+  snap_t_* s = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&s, sizeof(*s)+pathlen+1+size))) {
+    return NULL;
+  }
+  *s = (snap_t_) {
+    .mtime   = mtime,
+    .path    = (uint8_t*) (s+1),
+    .pathlen = pathlen,
+    .data    = (uint8_t*) (s+1) + pathlen+1,
+    .size    = size,
+  };
+  utf8ncpy(s->path, path, pathlen);
+  s->path[pathlen] = 0;
+  if (HEDLEY_LIKELY(data)) {
+    memcpy(s->data, data, size);
+  }
+  return s;
+}
+
+static void syncdir_snap_clear_(drvmap_t_* drvmap) {
+  for (size_t i = 0; i < drvmap->snap.dirs.n; ++i) {
+    upd_free(&drvmap->snap.dirs.p[i]);
+  }
+  upd_array_clear(&drvmap->snap.dirs);
+}
+
+static bool syncdir_snap_parse_(
+    drvmap_t_* drvmap, const uint8_t* buf, size_t size) {
+  if (HEDLEY_UNLIKELY(size < SNAPSHOT_MAGIC_SIZE_)) {
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(memcmp(buf, SNAPSHOT_MAGIC_, SNAPSHOT_MAGIC_SIZE_))) {
+    return false;
+  }
+
+  const uint8_t* p   = buf + SNAPSHOT_MAGIC_SIZE_;
+  const uint8_t* end = buf + size;
+  while (p < end) {
+    /* mtime, length of path and size of data */
+    uint64_t hdr[3];
+    if (HEDLEY_UNLIKELY((size_t) (end-p) < sizeof(hdr))) {
+      goto ABORT;
+    }
+    memcpy(hdr, p, sizeof(hdr));
+    p += sizeof(hdr);
+
+    const uint64_t pathlen = hdr[1];
+    const uint64_t datasz  = hdr[2];
+    if (HEDLEY_UNLIKELY(pathlen >= UPD_PATH_MAX)) {
+      goto ABORT;
+    }
+    if (HEDLEY_UNLIKELY(pathlen+datasz > (uint64_t) (end-p))) {
+      goto ABORT;
+    }
+    const uint8_t* path = p;
+    const uint8_t* data = p + pathlen;
+    p += pathlen+datasz;
+
+    /* every entry is terminated by '\0' */
+    if (HEDLEY_UNLIKELY(datasz && data[datasz-1])) {
+      goto ABORT;
+    }
+
+    /* records are sorted, so they are always appended */
+    const size_t n = drvmap->snap.dirs.n;
+    if (HEDLEY_LIKELY(n)) {
+      const snap_t_* last = drvmap->snap.dirs.p[n-1];
+      if (HEDLEY_UNLIKELY(syncdir_snap_cmp_(last, path, pathlen) >= 0)) {
+        goto ABORT;
+      }
+    }
+
+    snap_t_* s = syncdir_snap_new_(path, pathlen, data, datasz, hdr[0]);
+    if (HEDLEY_UNLIKELY(s == NULL)) {
+      goto ABORT;
+    }
+    if (HEDLEY_UNLIKELY(!upd_array_insert(&drvmap->snap.dirs, s, SIZE_MAX))) {
+      upd_free(&s);
+      goto ABORT;
+    }
+  }
+  return true;
+
+ABORT:
+  syncdir_snap_clear_(drvmap);
+  return false;
+}
+
+static bool syncdir_snap_apply_(ctx_t_* ctx) {
+  drvmap_t_* drvmap = ctx->drvmap;
+
+  uint8_t path[UPD_PATH_MAX];
+  size_t  pathlen;
+  if (HEDLEY_UNLIKELY(!syncdir_relpath_(ctx, path, &pathlen, NULL, 0))) {
+    return false;
+  }
+
+  size_t i;
+  if (HEDLEY_UNLIKELY(!syncdir_snap_find_(drvmap, &i, path, pathlen))) {
+    return false;
+  }
+  const snap_t_* s = drvmap->snap.dirs.p[i];
+  if (HEDLEY_UNLIKELY(s->mtime == 0 || s->mtime != ctx->mtime)) {
+    return false;
+  }
+
+  const uint8_t* p   = s->data;
+  const uint8_t* end = s->data + s->size;
+  while (p+1 < end) {
+    const bool dir = *(p++);
+
+    const uint8_t* name = p;
+    const size_t   len  = utf8size_lazy(name);
+    p += len+1;
+
+    if (HEDLEY_LIKELY(len)) {
+      syncdir_add_child_(ctx, name, len, upd_htable_hash_str(name, len), dir);
+    }
+  }
+  return true;
+}
+
+static void syncdir_snap_record_(ctx_t_* ctx) {
+  drvmap_t_* drvmap = ctx->drvmap;
+
+  uint8_t path[UPD_PATH_MAX];
+  size_t  pathlen;
+  if (HEDLEY_UNLIKELY(!syncdir_relpath_(ctx, path, &pathlen, NULL, 0))) {
+    return;
+  }
+
+  size_t i;
+  const bool found = syncdir_snap_find_(drvmap, &i, path, pathlen);
+  if (HEDLEY_LIKELY(found && !ctx->modified)) {
+    snap_t_* s = drvmap->snap.dirs.p[i];
+    if (HEDLEY_LIKELY(s->mtime == ctx->mtime)) {
+      return;
+    }
+  }
+
+  size_t size = 0;
+  for (size_t j = 0; j < ctx->children.n; ++j) {
+    const child_t_* c = ctx->children.p[j];
+    size += 1 + c->entry.len + 1;
+  }
+
+  snap_t_* s = syncdir_snap_new_(path, pathlen, NULL, size, ctx->mtime);
+  if (HEDLEY_UNLIKELY(s == NULL)) {
+    return;
+  }
+  uint8_t* p = s->data;
+  for (size_t j = 0; j < ctx->children.n; ++j) {
+    const child_t_* c = ctx->children.p[j];
+    *(p++) = c->dir;
+    utf8ncpy(p, c->entry.name, c->entry.len);
+    p   += c->entry.len;
+    *(p++) = 0;
+  }
+
+  if (HEDLEY_LIKELY(found)) {
+    upd_free(&drvmap->snap.dirs.p[i]);
+    drvmap->snap.dirs.p[i] = s;
+  } else if (HEDLEY_UNLIKELY(!upd_array_insert(&drvmap->snap.dirs, s, i))) {
+    upd_free(&s);
+    return;
+  }
+  syncdir_snap_touch_(drvmap);
+}
+
+static void syncdir_snap_forget_(
+    ctx_t_* ctx, const uint8_t* name, size_t len) {
+  drvmap_t_* drvmap = ctx->drvmap;
+
+  uint8_t path[UPD_PATH_MAX];
+  size_t  pathlen;
+  if (HEDLEY_UNLIKELY(!syncdir_relpath_(ctx, path, &pathlen, name, len))) {
+    return;
+  }
+
+  snap_t_** dirs = (void*) drvmap->snap.dirs.p;
+  const size_t n = drvmap->snap.dirs.n;
+
+  size_t beg;
+  const bool found = syncdir_snap_find_(drvmap, &beg, path, pathlen);
+
+  /* descendants are sorted next to each other */
+  size_t sub = n, subend = n;
+  if (HEDLEY_LIKELY(pathlen+1 < UPD_PATH_MAX)) {
+    path[pathlen++] = '/';
+    syncdir_snap_find_(drvmap, &sub, path, pathlen);
+
+    for (subend = sub; subend < n; ++subend) {
+      const snap_t_* s = dirs[subend];
+      if (s->pathlen < pathlen || memcmp(s->path, path, pathlen)) {
+        break;
+      }
+    }
+  }
+
+  if (HEDLEY_LIKELY(found)) {
+    upd_free(&dirs[beg]);
+    dirs[beg] = NULL;
+  }
+  for (size_t i = sub; i < subend; ++i) {
+    upd_free(&dirs[i]);
+    dirs[i] = NULL;
+  }
+
+  /* compacts the rest in one pass */
+  size_t j = beg;
+  for (size_t i = beg; i < n; ++i) {
+    if (HEDLEY_LIKELY(dirs[i])) {
+      dirs[j++] = dirs[i];
+    }
+  }
+  if (HEDLEY_LIKELY(j == n)) {
+    return;
+  }
+  while (drvmap->snap.dirs.n > j) {
+    upd_array_remove(&drvmap->snap.dirs, drvmap->snap.dirs.n-1);
+  }
+  syncdir_snap_touch_(drvmap);
+}
+
+static bool syncdir_snap_load_(ctx_t_* ctx) {
+  upd_file_t* f   = ctx->file;
+  upd_iso_t*  iso = f->iso;
+
+  snapio_t_* io = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&io, sizeof(*io)))) {
+    return false;
+  }
+  *io = (snapio_t_) { .file = f, };
+  utf8cpy(io->npath, ctx->drvmap->snap.npath);
+
+  /* syncs and requests wait for the snapshot */
+  ctx->busy                 = true;
+  ctx->drvmap->snap.loading = true;
+  upd_file_ref(f);
+
+  const bool work = upd_iso_start_work(
+    iso, syncdir_snap_load_main_, syncdir_snap_load_cb_, io);
+  if (HEDLEY_UNLIKELY(!work)) {
+    ctx->busy                 = false;
+    ctx->drvmap->snap.loading = false;
+    upd_file_unref(f);
+    upd_free(&io);
+    return false;
+  }
+  return true;
+}
+
+static void syncdir_snap_save_(ctx_t_* ctx) {
+  drvmap_t_* drvmap = ctx->drvmap;
+  upd_iso_t* iso    = ctx->file->iso;
+
+  size_t size = SNAPSHOT_MAGIC_SIZE_;
+  for (size_t i = 0; i < drvmap->snap.dirs.n; ++i) {
+    const snap_t_* s = drvmap->snap.dirs.p[i];
+    size += sizeof(uint64_t)*3 + s->pathlen + s->size;
+  }
+
+  snapio_t_* io = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&io, sizeof(*io)))) {
+    goto ABORT;
+  }
+  *io = (snapio_t_) {
+    .file = ctx->file,
+    .buf  = malloc(size),
+    .size = size,
+  };
+  if (HEDLEY_UNLIKELY(io->buf == NULL)) {
+    goto ABORT;
+  }
+
+  /* writes a temporary file and renames it atomically */
+  const int tmplen = snprintf((char*) io->tmp, UPD_PATH_MAX,
+    "%s.tmp", (char*) drvmap->snap.npath);
+  if (HEDLEY_UNLIKELY(tmplen < 0 || tmplen >= UPD_PATH_MAX)) {
+    goto ABORT;
+  }
+  utf8cpy(io->npath, drvmap->snap.npath);
+
+  uint8_t* p = io->buf;
+  memcpy(p, SNAPSHOT_MAGIC_, SNAPSHOT_MAGIC_SIZE_);
+  p += SNAPSHOT_MAGIC_SIZE_;
+  for (size_t i = 0; i < drvmap->snap.dirs.n; ++i) {
+    const snap_t_* s = drvmap->snap.dirs.p[i];
+
+    const uint64_t hdr[3] = { s->mtime, s->pathlen, s->size, };
+    memcpy(p, hdr, sizeof(hdr));
+    p += sizeof(hdr);
+
+    memcpy(p, s->path, s->pathlen);
+    p += s->pathlen;
+    memcpy(p, s->data, s->size);
+    p += s->size;
+  }
+
+  /* only one worker writes the temporary file at a time */
+  drvmap->snap.dirty  = false;
+  drvmap->snap.saving = true;
+  upd_file_ref(ctx->file);
+
+  const bool work = upd_iso_start_work(
+    iso, syncdir_snap_save_main_, syncdir_snap_save_cb_, io);
+  if (HEDLEY_UNLIKELY(!work)) {
+    drvmap->snap.saving = false;
+    upd_file_unref(ctx->file);
+    goto ABORT;
+  }
+  return;
+
+ABORT:
+  if (HEDLEY_LIKELY(io)) {
+    free(io->buf);
+    upd_free(&io);
+  }
+  upd_iso_msgf(iso, "upd.syncdir: snapshot saving failure (%s)\n",
+    (char*) drvmap->snap.npath);
+}
+
+static void syncdir_snap_touch_(drvmap_t_* drvmap) {
+  drvmap->snap.dirty = true;
+
+  ctx_t_* root = drvmap->snap.root;
+  if (HEDLEY_UNLIKELY(root == NULL || drvmap->snap.loading)) {
+    return;
+  }
+  upd_iso_t* iso = root->file->iso;
+
+  if (HEDLEY_UNLIKELY(drvmap->snap.closing)) {
+    return;
+  }
+  if (HEDLEY_LIKELY(drvmap->snap.timer.prev || drvmap->snap.saving)) {
+    return;  /* the changes will be saved together */
+  }
+  upd_iso_timer_start(
+    iso, &drvmap->snap.timer, upd_iso_now(iso) + SNAPSHOT_SAVE_WAIT_);
 }
 
 
@@ -380,10 +1673,27 @@ static void syncdir_watch_cb_(upd_file_watch_t* w) {
   ctx_t_* ctx = w->udata;
 
   if (HEDLEY_UNLIKELY(w->event == UPD_FILE_UPDATE_N)) {
-    if (HEDLEY_UNLIKELY(!syncdir_sync_n2u_(ctx, NULL))) {
-      upd_iso_msgf(ctx->file->iso,
-        "failed to queue task for synchronizing native to upd\n");
-      return;
+    if (HEDLEY_UNLIKELY(!ctx->scanned)) {
+      return;  /* nothing to be synchronized */
+    }
+    syncdir_sync_schedule_(ctx);
+  }
+
+  /* the mount point persists all directories in the mount */
+  if (HEDLEY_UNLIKELY(w->event == UPD_FILE_SHUTDOWN)) {
+    drvmap_t_* drvmap = ctx->drvmap;
+    if (HEDLEY_UNLIKELY(ctx->depth == 0 && drvmap && drvmap->snap.npath)) {
+      upd_iso_t* iso = ctx->file->iso;
+      upd_iso_timer_stop(iso, &drvmap->snap.timer);
+      drvmap->snap.closing = true;
+
+      if (HEDLEY_LIKELY(!drvmap->snap.loading)) {
+        if (HEDLEY_UNLIKELY(drvmap->snap.saving)) {
+          drvmap->snap.dirty = true;  /* saved again after the running one */
+        } else {
+          syncdir_snap_save_(ctx);
+        }
+      }
     }
   }
 }
@@ -469,16 +1779,38 @@ static void syncdir_sync_n2u_lock_cb_(upd_file_lock_t* lock) {
     goto ABORT;
   }
 
-  uv_fs_t* fsreq = upd_iso_stack(iso, sizeof(*fsreq));
-  if (HEDLEY_UNLIKELY(fsreq == NULL)) {
-    goto ABORT;
+  upd_array_of(uint8_t*) names = {0};
+  if (HEDLEY_LIKELY(upd_nwatch_take_changes(f, &names))) {
+    if (HEDLEY_LIKELY(!ctx->full)) {
+      if (HEDLEY_UNLIKELY(!syncdir_sync_targeted_(lock, &names))) {
+        goto ABORT;
+      }
+      return;
+    }
+    for (size_t i = 0; i < names.n; ++i) {
+      upd_free(&names.p[i]);
+    }
+    upd_array_clear(&names);
   }
-  *fsreq = (uv_fs_t) { .data = lock, };
+  ctx->full = false;
 
-  const bool scandir = 0 <= uv_fs_scandir(
-    &iso->loop, fsreq, (char*) f->npath, 0, syncdir_sync_n2u_scandir_cb_);
-  if (HEDLEY_UNLIKELY(!scandir)) {
-    upd_iso_unstack(iso, fsreq);
+  if (HEDLEY_UNLIKELY(ctx->drvmap->snap.npath)) {
+    /* mtime tells whether the snapshot can be trusted */
+    stat_t_* st = upd_iso_stack(iso, sizeof(*st));
+    if (HEDLEY_UNLIKELY(st == NULL)) {
+      goto ABORT;
+    }
+    *st = (stat_t_) { .lock = lock, };
+
+    const int err = uv_fs_stat(
+      &iso->loop, &st->fsreq, (char*) f->npath, syncdir_sync_n2u_mtime_cb_);
+    if (HEDLEY_UNLIKELY(0 > err)) {
+      upd_iso_unstack(iso, st);
+      goto ABORT;
+    }
+    return;
+  }
+  if (HEDLEY_UNLIKELY(!syncdir_scandir_(lock))) {
     goto ABORT;
   }
   return;
@@ -493,25 +1825,17 @@ ABORT:
 static void syncdir_sync_n2u_scandir_cb_(uv_fs_t* fsreq) {
   upd_file_lock_t* lock = fsreq->data;
   ctx_t_*          ctx  = lock->udata;
-  upd_file_t*      f    = ctx->file;
-  upd_iso_t*       iso  = f->iso;
-
-  bool* rm       = NULL;
-  bool  modified = false;
 
   if (HEDLEY_UNLIKELY(fsreq->result < 0)) {
     goto EXIT;
   }
 
   const size_t prev_un = ctx->children.n;
-
-  rm = upd_iso_stack(iso, sizeof(*rm)*prev_un);
-  if (HEDLEY_UNLIKELY(rm == NULL)) {
-    goto EXIT;
-  }
   for (size_t i = 0; i < prev_un; ++i) {
-    rm[i] = true;
+    child_t_* c = ctx->children.p[i];
+    c->seen = false;
   }
+  ctx->unseen = prev_un;
 
   for (size_t n = 0; n < (size_t) fsreq->result; ++n) {
     uv_dirent_t ne;
@@ -524,108 +1848,307 @@ static void syncdir_sync_n2u_scandir_cb_(uv_fs_t* fsreq) {
       continue;  /* We can't handle others because they depends on OS. */
     }
 
-    bool found = false;
-    for (size_t u = 0; u < ctx->children.n; ++u) {
-      upd_req_dir_entry_t* ue = ctx->children.p[u];
-      if (HEDLEY_UNLIKELY(utf8cmp(ne.name, ue->name) == 0)) {
-        found = true;
-        if (HEDLEY_LIKELY(u < prev_un)) {
-          rm[u] = false;
-        }
-        break;
-      }
+    const uint8_t* name = (uint8_t*) ne.name;
+    const size_t   len  = utf8size_lazy(name);
+    const uint64_t hash = upd_htable_hash_str(name, len);
+
+    child_t_* c = syncdir_index_lookup_(ctx, name, len, hash);
+    if (HEDLEY_LIKELY(c && c->dir == dir)) {
+      /* contents may have been changed without any event */
+      c->seen        = true;
+      c->nstat.valid = false;
+      --ctx->unseen;
+      continue;
+    }
+    if (HEDLEY_UNLIKELY(c)) {
+      /* the type has been changed, so the driver must be selected again */
+      syncdir_remove_child_(ctx, c);
+      ctx->modified = true;
+      --ctx->unseen;
     }
 
-    if (HEDLEY_UNLIKELY(!found)) {
-      uint8_t* path;
-      const size_t pathlen = syncdir_stack_child_path_(
-        ctx, &path, (uint8_t*) ne.name, utf8size_lazy(ne.name));
+    if (HEDLEY_LIKELY(syncdir_add_child_(ctx, name, len, hash, dir))) {
+      ctx->modified = true;
+    }
+  }
 
-      uint8_t* npath;
-      const size_t npathlen = syncdir_stack_child_npath_(
-        ctx, &npath, (uint8_t*) ne.name, utf8size_lazy(ne.name));
+  /* compacts the children in place */
+  ctx->unseen = 0;
+  size_t j = 0;
+  for (size_t i = 0; i < ctx->children.n; ++i) {
+    child_t_* c = ctx->children.p[i];
+    if (HEDLEY_LIKELY(c->seen)) {
+      c->index = j;
+      ctx->children.p[j++] = c;
+      continue;
+    }
+    syncdir_drop_child_(ctx, c);
+    ctx->modified = true;
+  }
+  while (ctx->children.n > j) {
+    upd_array_remove(&ctx->children, ctx->children.n-1);
+  }
 
-      const upd_driver_t* d;
-      if (dir) {
-        d = &upd_driver_syncdir;
-      } else {
-        d = upd_driver_select(&ctx->drvmap->rules, (uint8_t*) npath);
-        if (HEDLEY_UNLIKELY(d == NULL)) {
-          d = &upd_driver_bin_r;
-        }
-      }
+  ctx->last_scandir = upd_iso_now(ctx->file->iso);
+  ctx->scanned      = true;
 
-      upd_file_t* fc = upd_file_new(&(upd_file_t) {
-          .iso      = iso,
-          .driver   = d,
-          .path     = path,
-          .pathlen  = pathlen,
-          .npath    = npath,
-          .npathlen = npathlen,
-        });
-      upd_iso_unstack(iso, path);
-      upd_iso_unstack(iso, npath);
-      if (HEDLEY_UNLIKELY(fc == NULL)) {
-        continue;
-      }
-      if (dir) {
-        syncdir_inherit_drvmap_(fc->ctx, ctx->drvmap);
-      }
+EXIT:
+  uv_fs_req_cleanup(fsreq);
+  upd_iso_unstack(ctx->file->iso, fsreq);
 
-      const size_t         len = utf8size_lazy(ne.name);
-      upd_req_dir_entry_t* e   = NULL;
-      if (HEDLEY_UNLIKELY(!upd_malloc(&e, sizeof(*e)+len+1))) {
-        upd_file_unref(f);
-        continue;
-      }
-      *e = (upd_req_dir_entry_t) {
-        .name = (uint8_t*) (e+1),
-        .len  = len,
-        .file = fc,
-      };
-      utf8ncpy(e->name, ne.name, len);
-      e->name[len] = 0;
+  syncdir_sync_done_(lock);
+}
 
-      if (HEDLEY_UNLIKELY(!upd_array_insert(&ctx->children, e, SIZE_MAX))) {
-        upd_iso_unstack(iso, path);
-        upd_file_unref(fc);
-        upd_free(&e);
-        continue;
-      }
-      modified = true;
+static void syncdir_sync_n2u_stat_cb_(uv_fs_t* fsreq) {
+  stat_t_*         st   = (void*) fsreq;
+  upd_file_lock_t* lock = st->lock;
+  ctx_t_*          ctx  = lock->udata;
+  upd_iso_t*       iso  = ctx->file->iso;
+
+  const ssize_t    result = fsreq->result;
+  const uint64_t   mode   = fsreq->statbuf.st_mode & S_IFMT;
+  const upd_file_nstat_t ns = {
+    .size  = fsreq->statbuf.st_size,
+    .mtime = syncdir_mtime_(&fsreq->statbuf.st_mtim),
+    .type  = mode,
+    .valid = result >= 0 && mode == S_IFREG,
+  };
+  uv_fs_req_cleanup(fsreq);
+
+  const uint8_t* name = st->name;
+  const size_t   len  = st->len;
+  const uint64_t hash = upd_htable_hash_str(name, len);
+
+  child_t_* c = syncdir_index_lookup_(ctx, name, len, hash);
+
+  const bool dir = mode == S_IFDIR;
+  const bool reg = mode == S_IFREG;
+  if (result >= 0 && (dir || reg)) {
+    if (HEDLEY_UNLIKELY(c && c->dir != dir)) {
+      /* the type has been changed, so the driver must be selected again */
+      syncdir_remove_child_(ctx, c);
+      ctx->modified = true;
+      c = NULL;
+    }
+    if (HEDLEY_LIKELY(c == NULL)) {
+      c = syncdir_add_child_(ctx, name, len, hash, dir);
+      ctx->modified = ctx->modified || c;
     }
+    if (HEDLEY_LIKELY(c)) {
+      c->nstat = ns;
+    }
+  } else if (c) {
+    syncdir_remove_child_(ctx, c);
+    ctx->modified = true;
   }
 
-  for (size_t i = prev_un; i > 0;) {
-    --i;
+  upd_free(&st->name);
+  upd_iso_unstack(iso, st);
 
-    if (HEDLEY_UNLIKELY(rm[i])) {
-      upd_req_dir_entry_t* e = upd_array_remove(&ctx->children, i);
-      if (HEDLEY_UNLIKELY(e == NULL)) {
-        continue;
-      }
-      upd_file_unref(e->file);
-      upd_free(&e);
-      modified = true;
+  assert(ctx->stats);
+  if (HEDLEY_UNLIKELY(--ctx->stats == 0)) {
+    syncdir_sync_done_(lock);
+  }
+}
+
+static void syncdir_sync_n2u_mtime_cb_(uv_fs_t* fsreq) {
+  stat_t_*         st   = (void*) fsreq;
+  upd_file_lock_t* lock = st->lock;
+  ctx_t_*          ctx  = lock->udata;
+  upd_iso_t*       iso  = ctx->file->iso;
+
+  ctx->mtime =
+    fsreq->result < 0? 0: syncdir_mtime_(&fsreq->statbuf.st_mtim);
+  uv_fs_req_cleanup(fsreq);
+  upd_iso_unstack(iso, st);
+
+  /* the first scan is skipped if the snapshot is still valid */
+  if (HEDLEY_UNLIKELY(!ctx->scanned && syncdir_snap_apply_(ctx))) {
+    ctx->modified     = ctx->children.n > 0;
+    ctx->last_scandir = upd_iso_now(iso);
+    ctx->scanned      = true;
+    syncdir_sync_done_(lock);
+    return;
+  }
+  if (HEDLEY_UNLIKELY(!syncdir_scandir_(lock))) {
+    upd_file_unlock(lock);
+    upd_iso_unstack(iso, lock);
+    syncdir_sync_finalize_(ctx);
+  }
+}
+
+static void syncdir_debounce_cb_(upd_iso_timer_t* t) {
+  ctx_t_* ctx = t->udata;
+
+  if (HEDLEY_UNLIKELY(!syncdir_sync_n2u_(ctx, NULL))) {
+    upd_iso_msgf(ctx->file->iso,
+      "failed to queue task for synchronizing native to upd\n");
+  }
+}
+
+static void syncdir_nstat_main_(void* udata) {
+  nstat_t_* ns = udata;
+
+  /* npath is never changed, and the file is alive while we have its ref */
+  const char* dir = (char*) ns->file->npath;
+
+  for (size_t i = 0; i < ns->n; ++i) {
+    char path[UPD_PATH_MAX];
+    const size_t len =
+      cwk_path_join(dir, (char*) ns->names[i], path, sizeof(path));
+    if (HEDLEY_UNLIKELY(len >= sizeof(path))) {
+      continue;
     }
+
+    /* synchronous request touches nothing in the loop */
+    uv_fs_t req;
+    const int err = uv_fs_stat(ns->loop, &req, path, NULL);
+
+    const uv_stat_t* stat = &req.statbuf;
+    if (HEDLEY_LIKELY(err >= 0 && (stat->st_mode & S_IFMT) == S_IFREG)) {
+      ns->items[i] = (upd_file_nstat_t) {
+        .size  = stat->st_size,
+        .mtime = syncdir_mtime_(&stat->st_mtim),
+        .type  = S_IFREG,
+        .valid = true,
+      };
+    }
+    uv_fs_req_cleanup(&req);
   }
+}
 
-  ctx->last_scandir = upd_iso_now(ctx->file->iso);
+static void syncdir_nstat_cb_(upd_iso_t* iso, void* udata) {
+  nstat_t_*   ns  = udata;
+  upd_file_t* f   = ns->file;
+  ctx_t_*     ctx = f->ctx;
+  (void) iso;
+
+  for (size_t i = 0; i < ns->n; ++i) {
+    if (HEDLEY_UNLIKELY(!ns->items[i].valid)) {
+      continue;
+    }
+    const uint8_t* name = ns->names[i];
+    const size_t   len  = utf8size_lazy(name);
+
+    /* a targeted stat may have captured newer one */
+    child_t_* c =
+      syncdir_index_lookup_(ctx, name, len, upd_htable_hash_str(name, len));
+    if (HEDLEY_LIKELY(c && !c->dir && !c->nstat.valid)) {
+      c->nstat = ns->items[i];
+    }
+  }
+  upd_free(&ns);
+
+  ctx->nstat.running = false;
+
+  for (size_t i = 0; i < ctx->nstat.lists.n; ++i) {
+    upd_req_t* req = ctx->nstat.lists.p[i];
+    req->result = syncdir_respond_(ctx, req)? UPD_REQ_OK: UPD_REQ_NOMEM;
+    req->cb(req);
+  }
+  upd_array_clear(&ctx->nstat.lists);
+
+  if (HEDLEY_UNLIKELY(ctx->nstat.dirty)) {
+    ctx->nstat.dirty = false;
+    syncdir_nstat_(ctx);
+  }
+  upd_file_unref(f);
+}
+
+static void syncdir_snap_load_main_(void* udata) {
+  snapio_t_* io = udata;
+
+  FILE* fp = fopen((char*) io->npath, "rb");
+  if (HEDLEY_UNLIKELY(fp == NULL)) {
+    return;
+  }
+
+  long size = -1;
+  if (HEDLEY_LIKELY(0 == fseek(fp, 0, SEEK_END))) {
+    size = ftell(fp);
+  }
+  if (HEDLEY_UNLIKELY(size <= 0 || 0 != fseek(fp, 0, SEEK_SET))) {
+    goto EXIT;
+  }
+
+  io->buf = malloc(size);
+  if (HEDLEY_UNLIKELY(io->buf == NULL)) {
+    goto EXIT;
+  }
+  io->size = fread(io->buf, 1, size, fp);
+  io->ok   = io->size == (size_t) size;
 
 EXIT:
-  if (HEDLEY_LIKELY(rm)) {
-    upd_iso_unstack(ctx->file->iso, rm);
+  fclose(fp);
+}
+
+static void syncdir_snap_load_cb_(upd_iso_t* iso, void* udata) {
+  snapio_t_*  io  = udata;
+  upd_file_t* f   = io->file;
+  ctx_t_*     ctx = f->ctx;
+
+  if (HEDLEY_LIKELY(io->ok)) {
+    if (HEDLEY_UNLIKELY(!syncdir_snap_parse_(ctx->drvmap, io->buf, io->size))) {
+      upd_iso_msgf(iso,
+        "upd.syncdir: broken snapshot is ignored (%s)\n", (char*) io->npath);
+    }
   }
+  free(io->buf);
+  upd_free(&io);
 
-  uv_fs_req_cleanup(fsreq);
-  upd_iso_unstack(ctx->file->iso, fsreq);
+  ctx->busy                 = false;
+  ctx->drvmap->snap.loading = false;
+  if (HEDLEY_UNLIKELY(!syncdir_sync_n2u_(ctx, NULL))) {
+    upd_iso_msgf(iso,
+      "failed to queue task for synchronizing native to upd\n");
+  }
+  upd_file_unref(f);
+}
 
-  if (HEDLEY_UNLIKELY(modified)) {
-    upd_file_trigger(ctx->file, UPD_FILE_UPDATE);
+static void syncdir_snap_timer_cb_(upd_iso_timer_t* t) {
+  drvmap_t_* drvmap = t->udata;
+
+  if (HEDLEY_LIKELY(drvmap->snap.root && drvmap->snap.dirty)) {
+    syncdir_snap_save_(drvmap->snap.root);
   }
+}
 
-  syncdir_sync_finalize_(ctx);
+static void syncdir_snap_save_main_(void* udata) {
+  snapio_t_* io = udata;
 
-  upd_file_unlock(lock);
-  upd_iso_unstack(ctx->file->iso, lock);
+  FILE* fp = fopen((char*) io->tmp, "wb");
+  if (HEDLEY_UNLIKELY(fp == NULL)) {
+    return;
+  }
+  const bool write = fwrite(io->buf, 1, io->size, fp) == io->size;
+  const bool close = 0 == fclose(fp);
+
+  io->ok = write && close && 0 == rename((char*) io->tmp, (char*) io->npath);
+  if (HEDLEY_UNLIKELY(!io->ok)) {
+    remove((char*) io->tmp);
+  }
+}
+
+static void syncdir_snap_save_cb_(upd_iso_t* iso, void* udata) {
+  snapio_t_*  io     = udata;
+  upd_file_t* f      = io->file;
+  ctx_t_*     ctx    = f->ctx;
+  drvmap_t_*  drvmap = ctx->drvmap;
+
+  if (HEDLEY_UNLIKELY(!io->ok)) {
+    upd_iso_msgf(iso,
+      "upd.syncdir: snapshot saving failure (%s)\n", (char*) io->npath);
+  }
+  free(io->buf);
+  upd_free(&io);
+
+  drvmap->snap.saving = false;
+  if (HEDLEY_UNLIKELY(drvmap->snap.dirty)) {
+    if (HEDLEY_UNLIKELY(drvmap->snap.closing)) {
+      syncdir_snap_save_(ctx);
+    } else {
+      syncdir_snap_touch_(drvmap);
+    }
+  }
+  upd_file_unref(f);
 }
@@ -0,0 +1,121 @@
+#include "common.h"
+
+
+#define BUF_SIZE_ 512
+
+
+/* counters are formatted when someone starts reading from the head */
+typedef struct stats_t_ {
+  size_t  size;
+  uint8_t buf[BUF_SIZE_];
+} stats_t_;
+
+
+static
+bool
+stats_init_(
+  upd_file_t* f);
+
+static
+void
+stats_deinit_(
+  upd_file_t* f);
+
+static
+bool
+stats_handle_(
+  upd_req_t* req);
+
+const upd_driver_t upd_driver_sys_bcache = {
+  .name = (uint8_t*) "upd.sys.bcache",
+  .cats = (upd_req_cat_t[]) {
+    UPD_REQ_STREAM,
+    0,
+  },
+  .init   = stats_init_,
+  .deinit = stats_deinit_,
+  .handle = stats_handle_,
+};
+
+
+static
+void
+stats_format_(
+  upd_file_t* f);
+
+
+static bool stats_init_(upd_file_t* f) {
+  stats_t_* ctx = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&ctx, sizeof(*ctx)))) {
+    return false;
+  }
+  *ctx = (stats_t_) {0};
+  f->ctx = ctx;
+  f->mimetype = (uint8_t*) "text/plain";
+  return true;
+}
+
+static void stats_deinit_(upd_file_t* f) {
+  stats_t_* ctx = f->ctx;
+  upd_free(&ctx);
+}
+
+static bool stats_handle_(upd_req_t* req) {
+  upd_file_t* f   = req->file;
+  stats_t_*   ctx = f->ctx;
+
+  switch (req->type) {
+  case UPD_REQ_STREAM_ACCESS:
+    req->stream.access = (upd_req_stream_access_t) {
+      .read = true,
+    };
+    break;
+
+  case UPD_REQ_STREAM_READ: {
+    const size_t off = req->stream.io.offset;
+    if (HEDLEY_LIKELY(off == 0)) {
+      stats_format_(f);
+    }
+
+    size_t sz = req->stream.io.size;
+    if (HEDLEY_LIKELY(sz+off > ctx->size)) {
+      sz = ctx->size > off? ctx->size-off: 0;
+    }
+    req->stream.io = (upd_req_stream_io_t) {
+      .offset = off,
+      .size   = sz,
+      .buf    = ctx->buf + (sz? off: 0),
+    };
+  } break;
+
+  default:
+    req->result = UPD_REQ_INVALID;
+    return false;
+  }
+  req->result = UPD_REQ_OK;
+  req->cb(req);
+  return true;
+}
+
+
+static void stats_format_(upd_file_t* f) {
+  stats_t_*  ctx = f->ctx;
+  upd_iso_t* iso = f->iso;
+
+  const int n = snprintf((char*) ctx->buf, BUF_SIZE_,
+    "hits: %" PRIu64 "\n"
+    "misses: %" PRIu64 "\n"
+    "evicts: %" PRIu64 "\n"
+    "prefetch_hits: %" PRIu64 "\n"
+    "prefetch_waste: %" PRIu64 "\n"
+    "bytes: %zu\n"
+    "budget: %zu\n",
+    iso->bcache.hits,
+    iso->bcache.misses,
+    iso->bcache.evicts,
+    iso->bcache.prefetch_hits,
+    iso->bcache.prefetch_waste,
+    iso->bcache.bytes,
+    iso->bcache.budget);
+  ctx->size = n < 0? 0: n >= BUF_SIZE_? BUF_SIZE_-1: (size_t) n;
+}
@@ -1,8 +1,27 @@
 #include "common.h"
 
 
-#define FILE_POLL_INTERVAL_ 1500
+#define FILE_POLL_INTERVAL_ 1500  /* fallback of nwatch */
 
+#define FILE_SLOTS_MIN_ 64
+
+
+static
+bool
+file_reserve_id_(
+  upd_iso_t*     iso,
+  upd_file_id_t* id);
+
+static
+void
+file_release_id_(
+  upd_iso_t*    iso,
+  upd_file_id_t id);
+
+static
+bool
+file_init_nwatch_(
+  upd_file_t_* f);
 
 static
 bool
@@ -63,8 +82,19 @@ void
 file_handle_close_cb_(
   uv_handle_t* handle);
 
+static
+void
+file_uncache_cb_(
+  upd_iso_timer_t* t);
 
-upd_file_t* upd_file_new_(const upd_file_t* src) {
+static
+void
+file_lock_timeout_cb_(
+  upd_iso_timer_t* t);
+
+
+upd_file_t* upd_file_new_(
+    const upd_file_t* src, const upd_file_nstat_t* nstat) {
   upd_iso_t*          iso = src->iso;
   const upd_driver_t* d   = src->driver;
 
@@ -74,21 +104,40 @@ upd_file_t* upd_file_new_(const upd_file_t* src) {
 
   const size_t size = pathlen + npathlen + paramlen;
 
+  upd_file_id_t id;
+  if (HEDLEY_UNLIKELY(!file_reserve_id_(iso, &id))) {
+    return NULL;
+  }
+
   upd_file_t_* f = NULL;
   if (HEDLEY_UNLIKELY(!upd_malloc(&f, sizeof(*f)+size))) {
+    file_release_id_(iso, id);
     return NULL;
   }
   *f = (upd_file_t_) {
     .super = {
       .iso      = iso,
       .driver   = d,
-      .id       = iso->files_created++,
+      .id       = id,
       .refcnt   = 1,
 
       .last_update = 0,
       .last_req    = 0,
     },
+    .uncache = {
+      .udata = f,
+      .cb    = file_uncache_cb_,
+    },
+    .lock = {
+      .timeout = {
+        .udata = f,
+        .cb    = file_lock_timeout_cb_,
+      },
+    },
   };
+  if (HEDLEY_UNLIKELY(nstat)) {
+    f->nstat = *nstat;
+  }
 
   size_t offset = 0;
 # define assign_(N) do {  \
@@ -108,7 +157,7 @@ upd_file_t* upd_file_new_(const upd_file_t* src) {
 # undef assign_
 
   const bool ok =
-    (!d->flags.npoll || !npathlen || file_init_poll_(f))    &&
+    (!d->flags.npoll || !npathlen || file_init_nwatch_(f))  &&
     (!d->flags.preproc            || file_init_prepare_(f)) &&
     (!d->flags.postproc           || file_init_check_(f))   &&
     (!d->flags.async              || file_init_async_(f))   &&
@@ -117,13 +166,12 @@ upd_file_t* upd_file_new_(const upd_file_t* src) {
 
   if (HEDLEY_UNLIKELY(!ok)) {
     file_close_all_handlers_(f);
+    file_release_id_(iso, id);
     upd_free(&f);
     return NULL;
   }
-  if (HEDLEY_UNLIKELY(!upd_array_insert(&iso->files, f, SIZE_MAX))) {
-    upd_file_unref(&f->super);
-    return NULL;
-  }
+  iso->files.p[id & UINT32_MAX].file = &f->super;
+  ++iso->files.used;
   return &f->super;
 }
 
@@ -135,16 +183,72 @@ void upd_file_delete(upd_file_t* f) {
   assert(!f_->lock.refcnt);
 
   file_close_all_handlers_(f_);
+  upd_iso_timer_stop(f->iso, &f_->uncache);
+  upd_iso_timer_stop(f->iso, &f_->lock.timeout);
 
   upd_file_trigger(f, UPD_FILE_DELETE);
   upd_array_clear(&f_->watch);
 
-  upd_array_find_and_remove(&f->iso->files, f);
+  file_release_id_(f->iso, f->id);
+  --f->iso->files.used;
   f->driver->deinit(f);
   upd_free(&f_);
 }
 
 
+static bool file_reserve_id_(upd_iso_t* iso, upd_file_id_t* id) {
+  size_t i = iso->files.free;
+  if (HEDLEY_LIKELY(i != UINT32_MAX)) {
+    iso->files.free = iso->files.p[i].next;
+
+  } else {
+    if (HEDLEY_UNLIKELY(iso->files.n >= iso->files.cap)) {
+      const size_t cap = iso->files.cap? iso->files.cap*2: FILE_SLOTS_MIN_;
+      if (HEDLEY_UNLIKELY(cap >= UINT32_MAX)) {
+        return false;
+      }
+
+      upd_iso_file_slot_t* p = NULL;
+      if (HEDLEY_UNLIKELY(!upd_malloc(&p, sizeof(*p)*cap))) {
+        return false;
+      }
+      if (HEDLEY_LIKELY(iso->files.p)) {
+        memcpy(p, iso->files.p, sizeof(*p)*iso->files.n);
+        upd_free(&iso->files.p);
+      }
+      iso->files.p   = p;
+      iso->files.cap = cap;
+    }
+    i = iso->files.n++;
+    iso->files.p[i] = (upd_iso_file_slot_t) {0};
+  }
+
+  upd_iso_file_slot_t* s = &iso->files.p[i];
+  s->file = NULL;
+  s->next = UINT32_MAX;
+
+  *id = (upd_file_id_t) s->gen << 32 | i;
+  return true;
+}
+
+static void file_release_id_(upd_iso_t* iso, upd_file_id_t id) {
+  const size_t i = id & UINT32_MAX;
+  assert(i < iso->files.n);
+
+  /* generation is bumped to make the old id stale */
+  upd_iso_file_slot_t* s = &iso->files.p[i];
+  *s = (upd_iso_file_slot_t) {
+    .gen  = s->gen+1,
+    .next = iso->files.free,
+  };
+  iso->files.free = i;
+}
+
+static bool file_init_nwatch_(upd_file_t_* f) {
+  /* polling is a fallback for the case native watcher is unavailable */
+  return upd_nwatch_add(&f->super) || file_init_poll_(f);
+}
+
 static bool file_init_poll_(upd_file_t_* f) {
   upd_iso_t* iso = f->super.iso;
 
@@ -247,6 +351,7 @@ static bool file_init_timer_(upd_file_t_* f) {
 }
 
 static void file_close_all_handlers_(upd_file_t_* f) {
+  upd_nwatch_remove(&f->super);
   if (f->poll) {
     uv_fs_poll_stop(f->poll);
     uv_close((uv_handle_t*) f->poll, file_handle_close_cb_);
@@ -308,3 +413,60 @@ static void file_async_cb_(uv_async_t* handle) {
 static void file_handle_close_cb_(uv_handle_t* handle) {
   upd_free(&handle);
 }
+
+static void file_uncache_cb_(upd_iso_timer_t* t) {
+  upd_file_t_* f   = t->udata;
+  upd_iso_t*   iso = f->super.iso;
+
+  const uint64_t now    = upd_iso_now(iso);
+  const uint64_t period = f->super.driver->uncache_period;
+
+  /*  The timer is armed again by the next unlock, so it sleeps while the
+   * file is locked or nothing has been requested since the last uncache. */
+  const bool uncache =
+    f->super.last_req > 0 &&
+    f->super.last_req >= f->super.last_uncache &&
+    f->lock.refcnt == 0;
+  if (HEDLEY_UNLIKELY(!uncache)) {
+    return;
+  }
+  if (HEDLEY_UNLIKELY(now - f->super.last_req <= period)) {
+    upd_iso_timer_start(iso, t, f->super.last_req + period + 1);
+    return;
+  }
+  upd_file_ref(&f->super);
+  upd_file_trigger(&f->super, UPD_FILE_UNCACHE);
+  f->super.last_uncache = now;
+  upd_file_unref(&f->super);
+}
+
+static void file_lock_timeout_cb_(upd_iso_timer_t* t) {
+  upd_file_t_* f   = t->udata;
+  upd_iso_t*   iso = f->super.iso;
+
+  const uint64_t now = upd_iso_now(iso);
+
+  upd_file_ref(&f->super);
+  uint64_t next = UINT64_MAX;
+  for (size_t i = 0; i < f->lock.pending.n;) {
+    upd_file_lock_t* k = f->lock.pending.p[i];
+
+    const uint64_t thresh = k->basetime + k->timeout;
+    if (HEDLEY_UNLIKELY(now >= thresh)) {
+      upd_file_unlock(k);
+      continue;
+    }
+    if (next > thresh) {
+      next = thresh;
+    }
+    ++i;
+  }
+
+  /* callbacks may have armed the timer again */
+  const bool rearm =
+    next != UINT64_MAX && (t->prev == NULL || next < t->deadline);
+  if (HEDLEY_LIKELY(rearm)) {
+    upd_iso_timer_start(iso, t, next);
+  }
+  upd_file_unref(&f->super);
+}
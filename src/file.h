@@ -3,6 +3,14 @@
 #include "common.h"
 
 
+/* metadata of the native file captured by someone else, such as a scan */
+struct upd_file_nstat_t {
+  uint64_t size;
+  uint64_t mtime;  /* in nanoseconds */
+  uint32_t type;   /* S_IFMT bits of st_mode */
+  bool     valid;
+};
+
 typedef struct upd_file_t_ {
   upd_file_t super;
 
@@ -14,10 +22,36 @@ typedef struct upd_file_t_ {
   uv_async_t*   async;
   uv_timer_t*   timer;
 
+  struct {
+    upd_nwatch_t*  dir;
+    upd_nwatch_t*  self;
+    const uint8_t* name;
+    size_t         namelen;
+    uint64_t       hash;  /* of the name */
+
+    /* native events caused by the driver itself are ignored */
+    size_t   writes;
+    uint64_t quiet;  /* deadline after the last write */
+
+    /* names changed in the directory, available only for directories */
+    upd_array_of(uint8_t*) changes;
+
+    unsigned stat     : 1;
+    unsigned dirty    : 1;
+    unsigned overflow : 1;  /* some changes are unknown */
+  } nwatch;
+
+  upd_iso_timer_t uncache;
+
+  /* given at creation, so the driver can skip its own stat */
+  upd_file_nstat_t nstat;
+
   struct {
     size_t refcnt;
     bool   ex;
     upd_array_of(upd_file_lock_t*) pending;
+
+    upd_iso_timer_t timeout;  /* fired at the earliest deadline of pendings */
   } lock;
 } upd_file_t_;
 
@@ -25,7 +59,8 @@ typedef struct upd_file_t_ {
 HEDLEY_NON_NULL(1)
 upd_file_t*
 upd_file_new_(
-  const upd_file_t* src);
+  const upd_file_t*       src,
+  const upd_file_nstat_t* nstat);
 
 HEDLEY_NON_NULL(1)
 void
@@ -41,26 +76,28 @@ upd_file_try_lock(
 
 
 static inline upd_file_t* upd_file_new(const upd_file_t* src) {
-  return upd_file_new_(src);
+  return upd_file_new_(src, NULL);
+}
+
+static inline upd_file_t* upd_file_new_with_nstat(
+    const upd_file_t* src, const upd_file_nstat_t* nstat) {
+  return upd_file_new_(src, nstat);
+}
+
+/* Returns NULL if the creator didn't know the metadata. */
+static inline const upd_file_nstat_t* upd_file_get_nstat(upd_file_t* f) {
+  const upd_file_t_* f_ = (void*) f;
+  return f_->nstat.valid? &f_->nstat: NULL;
 }
 
 static inline upd_file_t* upd_file_get(upd_iso_t* iso, upd_file_id_t id) {
-  upd_file_t** f = (upd_file_t**) iso->files.p;
-
-  ssize_t l = 0;
-  ssize_t r = (ssize_t) iso->files.n - 1;
-  while (l <= r) {
-    const size_t i = (l+r)/2;
-    if (HEDLEY_UNLIKELY(f[i]->id == id)) {
-      return f[i];
-    }
-    if (f[i]->id > id) {
-      r = i-1;
-    } else {
-      l = i+1;
-    }
+  const size_t   i   = id & UINT32_MAX;
+  const uint32_t gen = id >> 32;
+  if (HEDLEY_UNLIKELY(i >= iso->files.n)) {
+    return NULL;
   }
-  return NULL;
+  const upd_iso_file_slot_t* s = &iso->files.p[i];
+  return s->gen == gen? s->file: NULL;
 }
 
 
@@ -95,6 +132,11 @@ static inline void upd_file_trigger(upd_file_t* f, upd_file_event_t e) {
   switch (e) {
   case UPD_FILE_UPDATE:
     f->last_update = upd_iso_now(f->iso);
+    /* fallthrough */
+  case UPD_FILE_DELETE:
+    if (HEDLEY_UNLIKELY(f->iso->dcache.paths.n)) {
+      upd_dcache_invalidate(f);
+    }
     break;
   }
 
@@ -176,6 +218,13 @@ static inline bool upd_file_lock(upd_file_lock_t* l) {
   if (HEDLEY_UNLIKELY(l->timeout == 0)) {
     l->timeout = UPD_FILE_LOCK_DEFAULT_TIMEOUT;
   }
+
+  upd_iso_timer_t* t = &f->lock.timeout;
+
+  const uint64_t deadline = l->basetime + l->timeout;
+  if (HEDLEY_UNLIKELY(t->prev == NULL || deadline < t->deadline)) {
+    upd_iso_timer_start(f->super.iso, t, deadline);
+  }
   upd_file_ref(&f->super);  /* for queing */
   return true;
 }
@@ -198,6 +247,13 @@ static inline void upd_file_unlock(upd_file_lock_t* l) {
     return;
   }
 
+  /* requests are done under the lock, so the file may get idle from here */
+  const uint64_t period = f->super.driver->uncache_period;
+  if (HEDLEY_UNLIKELY(period && f->uncache.prev == NULL)) {
+    upd_iso_t* iso = f->super.iso;
+    upd_iso_timer_start(iso, &f->uncache, upd_iso_now(iso) + period + 1);
+  }
+
   upd_array_t* pen = &f->lock.pending;
 
   upd_file_lock_t* k;
@@ -0,0 +1,91 @@
+#include "common.h"
+
+
+static
+void
+htable_put_(
+  upd_htable_t* t,
+  void*         item);
+
+
+bool upd_htable_insert(upd_htable_t* t, void* item) {
+  /* keeps the load factor under 1/2 */
+  if (HEDLEY_UNLIKELY((t->n+1)*2 > t->cap)) {
+    const size_t cap = t->cap? t->cap*2: UPD_HTABLE_MIN;
+
+    void** slots = NULL;
+    if (HEDLEY_UNLIKELY(!upd_malloc(&slots, sizeof(*slots)*cap))) {
+      return false;
+    }
+    memset(slots, 0, sizeof(*slots)*cap);
+
+    void**       old  = t->slots;
+    const size_t oldn = t->cap;
+
+    /*  Walks from an empty slot, so no cluster is split at the end of the
+     * table and items with the same key keep their order. */
+    size_t beg = 0;
+    while (beg < oldn && old[beg]) {
+      ++beg;
+    }
+
+    t->slots = slots;
+    t->cap   = cap;
+    for (size_t i = 0; i < oldn; ++i) {
+      void* o = old[(beg+i) % oldn];
+      if (HEDLEY_LIKELY(o)) {
+        htable_put_(t, o);
+      }
+    }
+    upd_free(&old);
+  }
+  htable_put_(t, item);
+  ++t->n;
+  return true;
+}
+
+void upd_htable_remove(upd_htable_t* t, const void* item) {
+  const size_t mask = t->cap-1;
+
+  size_t i = t->hash(item) & mask;
+  while (t->slots[i] != item) {
+    assert(t->slots[i]);
+    i = (i+1) & mask;
+  }
+
+  /* backward shift deletion, instead of tombstones */
+  for (size_t j = (i+1) & mask;; j = (j+1) & mask) {
+    void* o = t->slots[j];
+    if (HEDLEY_UNLIKELY(o == NULL)) {
+      break;
+    }
+    const size_t home = t->hash(o) & mask;
+
+    const bool movable = i <= j?
+      (home <= i || home > j):
+      (home <= i && home > j);
+    if (HEDLEY_UNLIKELY(movable)) {
+      t->slots[i] = o;
+      i = j;
+    }
+  }
+  t->slots[i] = NULL;
+  --t->n;
+}
+
+void upd_htable_clear(upd_htable_t* t) {
+  upd_free(&t->slots);
+  t->cap = 0;
+  t->n   = 0;
+}
+
+
+static void htable_put_(upd_htable_t* t, void* item) {
+  const size_t mask = t->cap-1;
+
+  size_t i = t->hash(item) & mask;
+  while (t->slots[i]) {
+    i = (i+1) & mask;
+  }
+  t->slots[i] = item;
+}
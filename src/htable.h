@@ -0,0 +1,92 @@
+#pragma once
+
+#include "common.h"
+
+
+#define UPD_HTABLE_MIN 16
+
+
+/*  Open addressing (linear probing) table of pointers, used as an index of
+ * items owned by someone else. The table never compares keys, so items with
+ * the same key can be inserted and the caller compares keys while walking
+ * the items probed from the hash with upd_htable_next. */
+struct upd_htable_t {
+  void** slots;
+  size_t cap;
+  size_t n;
+
+  /* must return the same value while the item is in the table */
+  uint64_t
+  (*hash)(
+    const void* item);
+};
+
+
+/* FNV-1a */
+HEDLEY_NON_NULL(1)
+static inline
+uint64_t
+upd_htable_hash_str(
+  const uint8_t* str,
+  size_t         len);
+
+/* Fibonacci hashing, lower bits of pointers are always zero */
+static inline
+uint64_t
+upd_htable_hash_ptr(
+  const void* ptr);
+
+/* Items with the same key are walked in the inserted order. */
+HEDLEY_NON_NULL(1, 2)
+HEDLEY_WARN_UNUSED_RESULT
+bool
+upd_htable_insert(
+  upd_htable_t* t,
+  void*         item);
+
+/* The item must be in the table. */
+HEDLEY_NON_NULL(1, 2)
+void
+upd_htable_remove(
+  upd_htable_t* t,
+  const void*   item);
+
+/*  Returns the next item probed from the hash, or NULL at the end.
+ * *i must be SIZE_MAX at the first call. */
+HEDLEY_NON_NULL(1, 3)
+static inline
+void*
+upd_htable_next(
+  const upd_htable_t* t,
+  uint64_t            hash,
+  size_t*             i);
+
+HEDLEY_NON_NULL(1)
+void
+upd_htable_clear(
+  upd_htable_t* t);
+
+
+static inline uint64_t upd_htable_hash_str(const uint8_t* str, size_t len) {
+  uint64_t h = UINT64_C(0xcbf29ce484222325);
+  for (size_t i = 0; i < len; ++i) {
+    h ^= str[i];
+    h *= UINT64_C(0x100000001b3);
+  }
+  return h;
+}
+
+static inline uint64_t upd_htable_hash_ptr(const void* ptr) {
+  const uint64_t h = (uintptr_t) ptr * UINT64_C(0x9e3779b97f4a7c15);
+  return h ^ (h >> 32);
+}
+
+static inline void* upd_htable_next(
+    const upd_htable_t* t, uint64_t hash, size_t* i) {
+  if (HEDLEY_UNLIKELY(t->n == 0)) {
+    return NULL;
+  }
+  const size_t mask = t->cap-1;
+  *i = *i == SIZE_MAX? hash & mask: (*i+1) & mask;
+  return t->slots[*i];
+}
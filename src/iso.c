@@ -5,8 +5,7 @@
 
 #define DESTROYER_PERIOD_ 100
 
-#define WALKER_PERIOD_           1000
-#define WALKER_FILES_PER_PERIOD_ 1000
+#define WHEEL_TICKS_(t) ((t) / UPD_ISO_WHEEL_TICK)
 
 
 typedef struct curl_t_ {
@@ -41,10 +40,22 @@ iso_abort_all_pkg_installations_(
   upd_iso_t* iso);
 
 
+static
+uint64_t
+wheel_insert_(
+  upd_iso_t*       iso,
+  upd_iso_timer_t* t);
+
 static
 void
-walker_handle_(
-  upd_file_t* f);
+wheel_arm_(
+  upd_iso_t* iso,
+  uint64_t   tick);
+
+static
+void
+wheel_unlink_(
+  upd_iso_timer_t* t);
 
 
 static
@@ -78,7 +89,7 @@ destroyer_cb_(
 
 static
 void
-walker_cb_(
+wheel_cb_(
   uv_timer_t* timer);
 
 
@@ -130,16 +141,22 @@ upd_iso_t* upd_iso_new(size_t stacksz) {
     .shutdown_timer = { .data = iso, },
     .destroyer      = { .data = iso, },
 
+    .files = {
+      .free = UINT32_MAX,
+    },
     .stack = {
       .size = stacksz,
       .ptr  = (uint8_t*) (iso+1),
     },
-    .walker = {
+    .wheel = {
       .timer = { .data = iso, },
     },
     .curl = {
       .timer = { .data = iso, },
     },
+    .bcache = {
+      .budget = UPD_BCACHE_DEFAULT,
+    },
   };
 
   /* init uv handles */
@@ -149,20 +166,18 @@ upd_iso_t* upd_iso_new(size_t stacksz) {
     0 <= uv_tty_init(&iso->loop, &iso->out, 1, 0) &&
     0 <= uv_signal_init(&iso->loop, &iso->sigint) &&
     0 <= uv_signal_init(&iso->loop, &iso->sighup) &&
-    0 <= uv_timer_init(&iso->loop, &iso->walker.timer) &&
+    0 <= uv_timer_init(&iso->loop, &iso->wheel.timer) &&
     0 <= uv_timer_init(&iso->loop, &iso->shutdown_timer) &&
     0 <= uv_timer_init(&iso->loop, &iso->destroyer) &&
     0 <= uv_signal_start(&iso->sigint, iso_signal_cb_, SIGINT) &&
     0 <= uv_signal_start(&iso->sighup, iso_signal_cb_, SIGHUP) &&
-    0 <= uv_timer_start(
-      &iso->walker.timer, walker_cb_, WALKER_PERIOD_, WALKER_PERIOD_) &&
     0 <= uv_mutex_init(&iso->mtx);
   if (HEDLEY_UNLIKELY(!uv_ok)) {
     return NULL;
   }
   uv_unref((uv_handle_t*) &iso->sigint);
   uv_unref((uv_handle_t*) &iso->sighup);
-  uv_unref((uv_handle_t*) &iso->walker.timer);
+  uv_unref((uv_handle_t*) &iso->wheel.timer);
 
   /* init curl */
   iso->curl.ctx = curl_multi_init();
@@ -204,21 +219,37 @@ upd_iso_status_t upd_iso_run(upd_iso_t* iso) {
 
   iso_abort_all_pkg_installations_(iso);
 
+  if (HEDLEY_LIKELY(iso->bcache.hits || iso->bcache.misses)) {
+    upd_iso_msgf(iso,
+      "block cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evicts\n",
+      iso->bcache.hits,
+      iso->bcache.misses,
+      iso->bcache.evicts);
+    upd_iso_msgf(iso,
+      "block cache: %" PRIu64 " prefetch hits, %" PRIu64 " prefetch waste\n",
+      iso->bcache.prefetch_hits,
+      iso->bcache.prefetch_waste);
+  }
+
+  if (HEDLEY_LIKELY(iso->dcache.hits || iso->dcache.misses)) {
+    upd_iso_msgf(iso,
+      "path cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+      iso->dcache.hits,
+      iso->dcache.misses);
+  }
+  upd_dcache_clear(iso);
+
   /* disalbe signal handler */
   uv_signal_stop(&iso->sigint);
   uv_signal_stop(&iso->sighup);
 
   /* trigger shutdown event */
-  upd_file_unref(iso->files.p[0]);
-  for (size_t i = iso->files.n; ;) {
-    if (HEDLEY_UNLIKELY(i > iso->files.n)) {
-      i = iso->files.n;
+  upd_file_unref(upd_file_get(iso, UPD_FILE_ID_ROOT));
+  for (size_t i = iso->files.n; i > 0;) {
+    upd_file_t* f = iso->files.p[--i].file;
+    if (HEDLEY_LIKELY(f)) {
+      upd_file_trigger(f, UPD_FILE_SHUTDOWN);
     }
-    if (HEDLEY_UNLIKELY(i == 0)) {
-      break;
-    }
-    upd_file_t* f = iso->files.p[--i];
-    upd_file_trigger(f, UPD_FILE_SHUTDOWN);
   }
 
   /* start destroyer */
@@ -237,17 +268,31 @@ upd_iso_status_t upd_iso_run(upd_iso_t* iso) {
   uv_close((uv_handle_t*) &iso->sighup,         NULL);
   uv_close((uv_handle_t*) &iso->shutdown_timer, NULL);
   uv_close((uv_handle_t*) &iso->destroyer,      NULL);
-  uv_close((uv_handle_t*) &iso->walker.timer,   NULL);
+  uv_close((uv_handle_t*) &iso->wheel.timer,    NULL);
   uv_close((uv_handle_t*) &iso->curl.timer,     NULL);
   if (HEDLEY_UNLIKELY(0 > uv_run(&iso->loop, UV_RUN_DEFAULT))) {
     return UPD_ISO_PANIC;
   }
   assert(iso->stack.refcnt == 0);
-  assert(iso->files.n      == 0);
+  assert(iso->files.used   == 0);
+  assert(iso->nwatch.n     == 0);
+  assert(iso->wheel.n      == 0);
   assert(iso->threads.n    == 0);
 
   uv_mutex_destroy(&iso->mtx);
 
+  upd_free(&iso->files.p);
+  upd_bcache_clear(iso);
+
+  for (size_t i = 0; i < UPD_ISO_RBUF_CLASSES; ++i) {
+    upd_iso_block_t* b = iso->rbuf.free[i];
+    while (b) {
+      upd_iso_block_t* next = b->hdr.next;
+      upd_free(&b);
+      b = next;
+    }
+  }
+
   /* forget all packages */
   for (size_t i = 0; i < iso->pkgs.n; ++i) {
     upd_pkg_t* pkg = iso->pkgs.p[i];
@@ -312,6 +357,36 @@ bool upd_iso_curl_perform(
 }
 
 
+void upd_iso_timer_start(
+    upd_iso_t* iso, upd_iso_timer_t* t, uint64_t deadline) {
+  if (HEDLEY_UNLIKELY(t->prev)) {
+    wheel_unlink_(t);
+  } else {
+    ++iso->wheel.n;
+  }
+
+  if (HEDLEY_UNLIKELY(iso->wheel.n == 1)) {
+    /* the wheel is idle while no timers are active */
+    iso->wheel.tick = WHEEL_TICKS_(upd_iso_now(iso));
+  }
+  t->deadline = deadline;
+  wheel_arm_(iso, wheel_insert_(iso, t));
+}
+
+void upd_iso_timer_stop(upd_iso_t* iso, upd_iso_timer_t* t) {
+  if (HEDLEY_UNLIKELY(t->prev == NULL)) {
+    return;
+  }
+  wheel_unlink_(t);
+
+  assert(iso->wheel.n);
+  if (HEDLEY_UNLIKELY(--iso->wheel.n == 0)) {
+    uv_timer_stop(&iso->wheel.timer);
+    iso->wheel.next = 0;
+  }
+}
+
+
 static bool iso_get_paths_(upd_iso_t* iso) {
   uint8_t cwd[UPD_PATH_MAX];
   size_t  cwdlen = UPD_PATH_MAX;
@@ -362,7 +437,7 @@ static bool iso_get_paths_(upd_iso_t* iso) {
 
 
 static void iso_create_dir_(upd_iso_t* iso, const char* path) {
-  const bool ok = upd_pathfind_with_dup(&(upd_pathfind_t) {
+  const bool ok = upd_dcache_pathfind_with_dup(&(upd_pathfind_t) {
       .iso    = iso,
       .path   = (uint8_t*) path,
       .len    = utf8size_lazy(path),
@@ -386,36 +461,40 @@ static void iso_abort_all_pkg_installations_(upd_iso_t* iso) {
 }
 
 
-static void walker_handle_(upd_file_t* f) {
-  upd_file_t_* f_ = (void*) f;
+static uint64_t wheel_insert_(upd_iso_t* iso, upd_iso_timer_t* t) {
+  uint64_t tick = WHEEL_TICKS_(t->deadline);
+  if (HEDLEY_UNLIKELY(tick <= iso->wheel.tick)) {
+    tick = iso->wheel.tick+1;
+  }
 
-  const uint64_t now = upd_iso_now(f->iso);
+  upd_iso_timer_t** slot = &iso->wheel.slots[tick%UPD_ISO_WHEEL_SLOTS];
+  t->next = *slot;
+  t->prev = slot;
+  if (HEDLEY_LIKELY(t->next)) {
+    t->next->prev = &t->next;
+  }
+  *slot = t;
+  return tick;
+}
 
-  /* lock timeout handling */
-  for (size_t i = 0; i < f_->lock.pending.n;) {
-    upd_file_lock_t* k = f_->lock.pending.p[i];
+static void wheel_arm_(upd_iso_t* iso, uint64_t tick) {
+  if (HEDLEY_LIKELY(iso->wheel.next && iso->wheel.next <= tick)) {
+    return;
+  }
+  iso->wheel.next = tick;
 
-    const uint64_t thresh = k->basetime + k->timeout;
-    if (HEDLEY_UNLIKELY(now >= thresh)) {
-      upd_file_unlock(k);
-      continue;
-    }
-    ++i;
-  }
-
-  /* trigger uncache event */
-  const bool uncache =
-    f->driver->uncache_period > 0 &&
-    f->last_req > 0 &&
-    f->last_req >= f->last_uncache &&
-    f_->lock.refcnt == 0;
-  if (HEDLEY_UNLIKELY(uncache)) {
-    const uint64_t t = now > f->last_req? now - f->last_req: 0;
-    if (HEDLEY_UNLIKELY(t > f->driver->uncache_period)) {
-      upd_file_trigger(f, UPD_FILE_UNCACHE);
-      f->last_uncache = now;
-    }
+  const uint64_t now = upd_iso_now(iso);
+  const uint64_t at  = tick*UPD_ISO_WHEEL_TICK;
+  uv_timer_start(&iso->wheel.timer, wheel_cb_, at > now? at-now: 0, 0);
+}
+
+static void wheel_unlink_(upd_iso_timer_t* t) {
+  *t->prev = t->next;
+  if (HEDLEY_LIKELY(t->next)) {
+    t->next->prev = t->prev;
   }
+  t->next = NULL;
+  t->prev = NULL;
 }
 
 
@@ -491,45 +570,67 @@ static void destroyer_cb_(uv_timer_t* timer) {
 
   iso_abort_all_pkg_installations_(iso);
 
-  if (HEDLEY_UNLIKELY(iso->files.n == 0)) {
+  if (HEDLEY_UNLIKELY(iso->files.used == 0)) {
     uv_timer_stop(&iso->destroyer);
   }
 }
 
 
-static void walker_cb_(uv_timer_t* timer) {
-  upd_iso_t*   iso   = timer->data;
-  upd_file_t** files = (void*) iso->files.p;
+static void wheel_cb_(uv_timer_t* timer) {
+  upd_iso_t* iso = timer->data;
 
-  if (HEDLEY_UNLIKELY(iso->files.n == 0)) {
-    return;
+  const uint64_t now  = upd_iso_now(iso);
+  const uint64_t last = WHEEL_TICKS_(now);
+
+  /* callbacks starting timers arm it again */
+  iso->wheel.next = 0;
+
+  /* every slot is visited once if it's too late */
+  if (HEDLEY_UNLIKELY(last - iso->wheel.tick > UPD_ISO_WHEEL_SLOTS)) {
+    iso->wheel.tick = last - UPD_ISO_WHEEL_SLOTS;
   }
 
-  const upd_file_id_t needle = iso->walker.last_seen;
+  while (iso->wheel.tick < last && iso->wheel.n) {
+    ++iso->wheel.tick;
+
+    /*  Detaches the slot because callbacks can start or stop any timers,
+     * and timers in the later rounds are put back into the same slot. */
+    upd_iso_timer_t** slot =
+      &iso->wheel.slots[iso->wheel.tick%UPD_ISO_WHEEL_SLOTS];
 
-  ssize_t i = 0, l = 0, r = (ssize_t) iso->files.n - 1;
-  while (l < r) {
-    i = (l+r)/2;
-    if (HEDLEY_UNLIKELY(files[i]->id == needle)) {
-      break;
+    upd_iso_timer_t* head = *slot;
+    *slot = NULL;
+    if (HEDLEY_UNLIKELY(head == NULL)) {
+      continue;
     }
-    if (files[i]->id > needle) {
-      r = i-1;
-    } else {
-      l = i+1;
+    head->prev = &head;
+
+    while (head) {
+      upd_iso_timer_t* t = head;
+      wheel_unlink_(t);
+
+      if (HEDLEY_LIKELY(t->deadline <= now)) {
+        --iso->wheel.n;
+        t->cb(t);
+      } else {
+        wheel_insert_(iso, t);
+      }
     }
   }
-  if (files[i]->id <= needle) {
-    ++i;
+  if (HEDLEY_UNLIKELY(iso->wheel.n == 0)) {
+    uv_timer_stop(&iso->wheel.timer);
+    iso->wheel.next = 0;
+    return;
   }
 
-  for (size_t j = 0; j < iso->files.n && j < WALKER_FILES_PER_PERIOD_; ++j) {
-    if (HEDLEY_UNLIKELY((size_t) i >= iso->files.n)) {
-      i = 0;
+  /*  The first occupied slot comes no later than the earliest deadline,
+   * although timers in it may be in the later rounds. */
+  for (uint64_t i = 1; i <= UPD_ISO_WHEEL_SLOTS; ++i) {
+    const uint64_t tick = iso->wheel.tick + i;
+    if (HEDLEY_UNLIKELY(iso->wheel.slots[tick%UPD_ISO_WHEEL_SLOTS])) {
+      wheel_arm_(iso, tick);
+      return;
     }
-    upd_file_t* f = iso->files.p[i++];
-    walker_handle_(f);
-    iso->walker.last_seen = f->id;
   }
 }
 
@@ -3,8 +3,29 @@
 #include "common.h"
 
 
+/*  Blocks smaller than UPD_ISO_STACK_MIN<<(UPD_ISO_STACK_CLASSES-1) bytes
+ * are served from the size-class free lists of stack. */
+#define UPD_ISO_STACK_MIN     ((uint64_t) 16)
+#define UPD_ISO_STACK_CLASSES 13  /* = 16 B ~ 64 KiB */
+
+/*  Receive buffers of sockets are pooled by size classes,
+ * UPD_ISO_RBUF_MIN<<0 ~ UPD_ISO_RBUF_MIN<<(UPD_ISO_RBUF_CLASSES-1) bytes. */
+#define UPD_ISO_RBUF_MIN     ((uint64_t) 512)
+#define UPD_ISO_RBUF_CLASSES 8  /* = 512 B ~ 64 KiB */
+#define UPD_ISO_RBUF_KEEP    (1024*1024*4)  /* = 4 MiB of idle buffers */
+
+/*  hashed timing wheel for the deadlines of files, whose timer is armed only
+ * for the next occupied slot, so empty ticks never wake the loop up */
+#define UPD_ISO_WHEEL_TICK  10  /* ms */
+#define UPD_ISO_WHEEL_SLOTS 1024
+
+
 typedef struct upd_iso_thread_t upd_iso_thread_t;
 typedef struct upd_iso_work_t   upd_iso_work_t;
+typedef union  upd_iso_block_t  upd_iso_block_t;
+
+typedef struct upd_iso_file_slot_t upd_iso_file_slot_t;
+typedef struct upd_iso_timer_t     upd_iso_timer_t;
 
 
 struct upd_iso_t {
@@ -26,18 +47,33 @@ struct upd_iso_t {
   upd_array_of(uv_lib_t*)         libs;
 
   upd_array_of(const upd_driver_t*) drivers;
-  upd_array_of(upd_file_t*)         files;
   upd_array_of(upd_pkg_t*)          pkgs;
+  upd_array_of(upd_nwatch_t*)       nwatch;
 
-  size_t files_created;
+  /*  File table indexed by lower 32 bits of upd_file_id_t,
+   * and upper 32 bits are generation of the slot. */
+  struct {
+    upd_iso_file_slot_t* p;
+    size_t               n;
+    size_t               cap;
+    size_t               used;
+    uint32_t             free;
+  } files;
 
   struct {
     size_t   used;
     size_t   size;
     size_t   refcnt;
     uint8_t* ptr;
+
+    upd_iso_block_t* free[UPD_ISO_STACK_CLASSES];
   } stack;
 
+  struct {
+    upd_iso_block_t* free[UPD_ISO_RBUF_CLASSES];
+    size_t           bytes;  /* total size of idle buffers */
+  } rbuf;
+
   struct {
     uint8_t runtime[UPD_PATH_MAX];
     uint8_t pkg    [UPD_PATH_MAX];
@@ -45,14 +81,71 @@ struct upd_iso_t {
   } path;
 
   struct {
-    uv_timer_t    timer;
-    upd_file_id_t last_seen;
-  } walker;
+    uv_timer_t       timer;
+    uint64_t         tick;  /* the last processed tick */
+    uint64_t         next;  /* tick the timer is armed for, 0 while idle */
+    size_t           n;
+    upd_iso_timer_t* slots[UPD_ISO_WHEEL_SLOTS];
+  } wheel;
 
   struct {
     CURLM*     ctx;
     uv_timer_t timer;
   } curl;
+
+  struct {
+    upd_bcache_block_t** buckets;
+    size_t               nbuckets;
+
+    upd_array_of(upd_bcache_block_t*) ring;
+    size_t                            hand;
+
+    size_t bytes;
+    size_t budget;
+
+    size_t write_behind;  /* buffer size of upd.bin for each file */
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evicts;
+    uint64_t prefetch_hits;
+    uint64_t prefetch_waste;
+  } bcache;
+
+  struct {
+    upd_htable_t paths;
+    upd_htable_t files;  /* the same file can be cached by some paths */
+
+    uint64_t hits;
+    uint64_t misses;
+  } dcache;
+};
+
+/* header of the blocks in stack */
+union upd_iso_block_t {
+  struct {
+    size_t           cls;
+    upd_iso_block_t* next;
+  } hdr;
+  uint8_t align[16];
+};
+
+struct upd_iso_file_slot_t {
+  upd_file_t* file;
+  uint32_t    gen;
+  uint32_t    next;  /* next free slot */
+};
+
+struct upd_iso_timer_t {
+  upd_iso_timer_t*  next;
+  upd_iso_timer_t** prev;  /* NULL when inactive */
+
+  uint64_t deadline;
+
+  void* udata;
+  void
+  (*cb)(
+    upd_iso_timer_t* t);
 };
 
 struct upd_iso_thread_t {
@@ -93,6 +186,21 @@ upd_iso_exit(
   upd_iso_status_t status);
 
 
+/* The timer is fired on the first tick after the deadline. */
+HEDLEY_NON_NULL(1, 2)
+void
+upd_iso_timer_start(
+  upd_iso_t*       iso,
+  upd_iso_timer_t* t,
+  uint64_t         deadline);
+
+HEDLEY_NON_NULL(1, 2)
+void
+upd_iso_timer_stop(
+  upd_iso_t*       iso,
+  upd_iso_timer_t* t);
+
+
 typedef
 void
 (*upd_iso_curl_cb_t)(
@@ -110,22 +218,42 @@ upd_iso_curl_perform(
 
 
 static inline void* upd_iso_stack(upd_iso_t* iso, uint64_t len) {
-  if (HEDLEY_UNLIKELY(iso->stack.used+len > iso->stack.size || len > 1024*4)) {
-    void* ptr = NULL;
-    if (HEDLEY_UNLIKELY(!upd_malloc(&ptr, len))) {
-      return NULL;
-    }
-    return ptr;
+  size_t cls = 0;
+  while (cls < UPD_ISO_STACK_CLASSES && (UPD_ISO_STACK_MIN << cls) < len) {
+    ++cls;
+  }
+  if (HEDLEY_UNLIKELY(cls >= UPD_ISO_STACK_CLASSES)) {
+    goto HEAP;
   }
 
-  void* ret = iso->stack.ptr + iso->stack.used;
-  iso->stack.used += len;
+  upd_iso_block_t* b = iso->stack.free[cls];
+  if (HEDLEY_LIKELY(b)) {
+    iso->stack.free[cls] = b->hdr.next;
+  } else {
+    const size_t sz = sizeof(*b) + (UPD_ISO_STACK_MIN << cls);
+    if (HEDLEY_UNLIKELY(iso->stack.used+sz > iso->stack.size)) {
+      goto HEAP;
+    }
+    b = (void*) (iso->stack.ptr + iso->stack.used);
+    iso->stack.used += sz;
+  }
+  b->hdr.cls = cls;
   ++iso->stack.refcnt;
 
+  void* ret = b+1;
+
 # if UPD_USE_VALGRIND
     VALGRIND_MALLOCLIKE_BLOCK(ret, len, 0, 0);
 # endif
   return ret;
+
+HEAP: {
+    void* ptr = NULL;
+    if (HEDLEY_UNLIKELY(!upd_malloc(&ptr, len))) {
+      return NULL;
+    }
+    return ptr;
+  }
 }
 
 static inline void upd_iso_unstack(upd_iso_t* iso, void* ptr) {
@@ -144,9 +272,57 @@ static inline void upd_iso_unstack(upd_iso_t* iso, void* ptr) {
     VALGRIND_FREELIKE_BLOCK(ptr, 0);
 # endif
 
+  /* all blocks are returned, so classes can be carved again */
   if (--iso->stack.refcnt == 0) {
     iso->stack.used = 0;
+    for (size_t i = 0; i < UPD_ISO_STACK_CLASSES; ++i) {
+      iso->stack.free[i] = NULL;
+    }
+    return;
+  }
+
+  upd_iso_block_t* b = (upd_iso_block_t*) ptr - 1;
+  b->hdr.next = iso->stack.free[b->hdr.cls];
+  iso->stack.free[b->hdr.cls] = b;
+}
+
+/* Returns a receive buffer of UPD_ISO_RBUF_MIN<<cls bytes. */
+static inline void* upd_iso_rbuf_alloc(upd_iso_t* iso, size_t cls) {
+  assert(cls < UPD_ISO_RBUF_CLASSES);
+
+  upd_iso_block_t* b = iso->rbuf.free[cls];
+  if (HEDLEY_LIKELY(b)) {
+    iso->rbuf.free[cls] = b->hdr.next;
+    iso->rbuf.bytes    -= UPD_ISO_RBUF_MIN << cls;
+  } else {
+    if (HEDLEY_UNLIKELY(!upd_malloc(&b, sizeof(*b)+(UPD_ISO_RBUF_MIN<<cls)))) {
+      return NULL;
+    }
+    b->hdr.cls = cls;
+  }
+  return b+1;
+}
+
+static inline size_t upd_iso_rbuf_size(const void* ptr) {
+  const upd_iso_block_t* b = (const upd_iso_block_t*) ptr - 1;
+  return UPD_ISO_RBUF_MIN << b->hdr.cls;
+}
+
+static inline void upd_iso_rbuf_free(upd_iso_t* iso, void* ptr) {
+  if (HEDLEY_UNLIKELY(ptr == NULL)) {
+    return;
+  }
+  upd_iso_block_t* b   = (upd_iso_block_t*) ptr - 1;
+  const size_t     cls = b->hdr.cls;
+
+  const size_t sz = UPD_ISO_RBUF_MIN << cls;
+  if (HEDLEY_UNLIKELY(iso->rbuf.bytes+sz > UPD_ISO_RBUF_KEEP)) {
+    upd_free(&b);
+    return;
   }
+  b->hdr.next         = iso->rbuf.free[cls];
+  iso->rbuf.free[cls] = b;
+  iso->rbuf.bytes    += sz;
 }
 
 static inline uint64_t upd_iso_now(upd_iso_t* iso) {
@@ -0,0 +1,454 @@
+#include "common.h"
+
+
+#define CHANGES_MAX_ 64
+
+
+typedef struct stat_t_ {
+  uv_fs_t     fsreq;
+  upd_file_t* file;
+} stat_t_;
+
+
+static
+bool
+nwatch_is_dir_(
+  const upd_driver_t* d);
+
+static
+uint64_t
+nwatch_hash_(
+  const void* item);
+
+static
+bool
+nwatch_is_quiet_(
+  upd_file_t_* f);
+
+static
+bool
+nwatch_find_(
+  upd_iso_t*     iso,
+  size_t*        i,
+  const uint8_t* npath,
+  size_t         len);
+
+static
+upd_nwatch_t*
+nwatch_get_(
+  upd_iso_t*     iso,
+  const uint8_t* npath,
+  size_t         len);
+
+static
+void
+nwatch_release_(
+  upd_nwatch_t* w);
+
+static
+void
+nwatch_stat_(
+  upd_file_t* f);
+
+static
+void
+nwatch_record_(
+  upd_file_t* f,
+  const char* name);
+
+static
+void
+nwatch_forget_(
+  upd_file_t* f);
+
+
+static
+void
+nwatch_event_cb_(
+  uv_fs_event_t* event,
+  const char*    name,
+  int            events,
+  int            status);
+
+static
+void
+nwatch_stat_cb_(
+  uv_fs_t* fsreq);
+
+static
+void
+nwatch_close_cb_(
+  uv_handle_t* handle);
+
+
+bool upd_nwatch_add(upd_file_t* f) {
+  upd_file_t_* f_  = (void*) f;
+  upd_iso_t*   iso = f->iso;
+
+  assert(f->npath);
+
+  size_t namebeg = 0;
+  cwk_path_get_dirname((char*) f->npath, &namebeg);
+  if (HEDLEY_UNLIKELY(namebeg == 0 || namebeg >= f->npathlen)) {
+    return false;
+  }
+
+  size_t dirlen = namebeg;
+  while (dirlen > 1 && (f->npath[dirlen-1] == '/' || f->npath[dirlen-1] == '\\')) {
+    --dirlen;
+  }
+
+  upd_nwatch_t* dir = nwatch_get_(iso, f->npath, dirlen);
+  if (HEDLEY_UNLIKELY(dir == NULL)) {
+    return false;
+  }
+  f_->nwatch.name    = f->npath + namebeg;
+  f_->nwatch.namelen = f->npathlen - namebeg;
+  f_->nwatch.hash    =
+    upd_htable_hash_str(f_->nwatch.name, f_->nwatch.namelen);
+
+  if (HEDLEY_UNLIKELY(!upd_htable_insert(&dir->files, f))) {
+    nwatch_release_(dir);
+    return false;
+  }
+  f_->nwatch.dir = dir;
+
+  if (nwatch_is_dir_(f->driver)) {
+    upd_nwatch_t* self = nwatch_get_(iso, f->npath, f->npathlen);
+    if (HEDLEY_UNLIKELY(self == NULL)) {
+      upd_nwatch_remove(f);
+      return false;
+    }
+    if (HEDLEY_UNLIKELY(!upd_array_insert(&self->dirs, f, SIZE_MAX))) {
+      nwatch_release_(self);
+      upd_nwatch_remove(f);
+      return false;
+    }
+    f_->nwatch.self = self;
+  }
+  return true;
+}
+
+void upd_nwatch_remove(upd_file_t* f) {
+  upd_file_t_* f_ = (void*) f;
+
+  upd_nwatch_t* dir = f_->nwatch.dir;
+  if (HEDLEY_LIKELY(dir)) {
+    upd_htable_remove(&dir->files, f);
+
+    f_->nwatch.dir = NULL;
+    nwatch_release_(dir);
+  }
+
+  upd_nwatch_t* self = f_->nwatch.self;
+  if (HEDLEY_UNLIKELY(self)) {
+    upd_array_find_and_remove(&self->dirs, f);
+
+    f_->nwatch.self = NULL;
+    nwatch_release_(self);
+  }
+  nwatch_forget_(f);
+}
+
+void upd_nwatch_begin_write(upd_file_t* f) {
+  upd_file_t_* f_ = (void*) f;
+  ++f_->nwatch.writes;
+}
+
+void upd_nwatch_end_write(upd_file_t* f) {
+  upd_file_t_* f_ = (void*) f;
+  assert(f_->nwatch.writes);
+
+  /* the event of the last write may arrive after its completion */
+  --f_->nwatch.writes;
+  f_->nwatch.quiet = upd_iso_now(f->iso) + UPD_NWATCH_QUIET;
+}
+
+bool upd_nwatch_take_changes(upd_file_t* f, upd_array_of(uint8_t*)* dst) {
+  upd_file_t_* f_ = (void*) f;
+
+  if (HEDLEY_UNLIKELY(f_->nwatch.self == NULL || f_->nwatch.overflow)) {
+    nwatch_forget_(f);
+    return false;
+  }
+  *dst = f_->nwatch.changes;
+  f_->nwatch.changes = (upd_array_t) {0};
+  return true;
+}
+
+bool upd_nwatch_is_active(upd_file_t* f) {
+  const upd_file_t_* f_ = (void*) f;
+  return f_->nwatch.self;
+}
+
+bool upd_nwatch_has_changes(upd_file_t* f) {
+  const upd_file_t_* f_ = (void*) f;
+  return
+    f_->nwatch.stat       ||
+    f_->nwatch.overflow   ||
+    f_->nwatch.changes.n;
+}
+
+
+static bool nwatch_is_dir_(const upd_driver_t* d) {
+  for (const upd_req_cat_t* c = d->cats; *c; ++c) {
+    if (HEDLEY_UNLIKELY(*c == UPD_REQ_DIR)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint64_t nwatch_hash_(const void* item) {
+  const upd_file_t_* f = item;
+  return f->nwatch.hash;
+}
+
+static bool nwatch_is_quiet_(upd_file_t_* f) {
+  return
+    f->nwatch.writes ||
+    upd_iso_now(f->super.iso) < f->nwatch.quiet;
+}
+
+static bool nwatch_find_(
+    upd_iso_t* iso, size_t* i, const uint8_t* npath, size_t len) {
+  upd_nwatch_t** w = (void*) iso->nwatch.p;
+
+  size_t l = 0, r = iso->nwatch.n;
+  while (l < r) {
+    *i = (l+r)/2;
+
+    const size_t n = w[*i]->npathlen < len? w[*i]->npathlen: len;
+
+    int cmp = memcmp(w[*i]->npath, npath, n);
+    if (HEDLEY_LIKELY(cmp == 0)) {
+      cmp = w[*i]->npathlen < len? -1: w[*i]->npathlen > len? 1: 0;
+    }
+    if (HEDLEY_UNLIKELY(cmp == 0)) {
+      return true;
+    }
+    if (cmp > 0) {
+      r = *i;
+    } else {
+      l = *i+1;
+    }
+  }
+  *i = l;
+  return false;
+}
+
+static upd_nwatch_t* nwatch_get_(
+    upd_iso_t* iso, const uint8_t* npath, size_t len) {
+  size_t i;
+  if (HEDLEY_LIKELY(nwatch_find_(iso, &i, npath, len))) {
+    return iso->nwatch.p[i];
+  }
+
+  upd_nwatch_t* w = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&w, sizeof(*w)+len+1))) {
+    return NULL;
+  }
+  *w = (upd_nwatch_t) {
+    .event    = { .data = w, },
+    .iso      = iso,
+    .files    = { .hash = nwatch_hash_, },
+    .npath    = (uint8_t*) (w+1),
+    .npathlen = len,
+  };
+  utf8ncpy(w->npath, npath, len);
+  w->npath[len] = 0;
+
+  if (HEDLEY_UNLIKELY(0 > uv_fs_event_init(&iso->loop, &w->event))) {
+    upd_free(&w);
+    return NULL;
+  }
+  uv_unref((uv_handle_t*) &w->event);
+
+  const int start =
+    uv_fs_event_start(&w->event, nwatch_event_cb_, (char*) w->npath, 0);
+  if (HEDLEY_UNLIKELY(0 > start)) {
+    uv_close((uv_handle_t*) &w->event, nwatch_close_cb_);
+    return NULL;
+  }
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&iso->nwatch, w, i))) {
+    uv_fs_event_stop(&w->event);
+    uv_close((uv_handle_t*) &w->event, nwatch_close_cb_);
+    return NULL;
+  }
+  return w;
+}
+
+static void nwatch_release_(upd_nwatch_t* w) {
+  upd_iso_t* iso = w->iso;
+
+  if (HEDLEY_LIKELY(w->files.n || w->dirs.n)) {
+    return;
+  }
+  upd_htable_clear(&w->files);
+  upd_array_clear(&w->dirs);
+
+  size_t i;
+  if (HEDLEY_LIKELY(nwatch_find_(iso, &i, w->npath, w->npathlen))) {
+    upd_array_remove(&iso->nwatch, i);
+  }
+  uv_fs_event_stop(&w->event);
+  uv_close((uv_handle_t*) &w->event, nwatch_close_cb_);
+}
+
+static void nwatch_stat_(upd_file_t* f) {
+  upd_file_t_* f_  = (void*) f;
+  upd_iso_t*   iso = f->iso;
+
+  /* coalesce bursts of events into one stat */
+  if (HEDLEY_UNLIKELY(f_->nwatch.stat)) {
+    f_->nwatch.dirty = true;
+    return;
+  }
+
+  stat_t_* st = upd_iso_stack(iso, sizeof(*st));
+  if (HEDLEY_UNLIKELY(st == NULL)) {
+    upd_iso_msgf(iso, "nwatch: stat req allocation failure\n");
+    return;
+  }
+  *st = (stat_t_) {
+    .fsreq = { .data = st, },
+    .file  = f,
+  };
+
+  const int err =
+    uv_fs_stat(&iso->loop, &st->fsreq, (char*) f->npath, nwatch_stat_cb_);
+  if (HEDLEY_UNLIKELY(0 > err)) {
+    upd_iso_unstack(iso, st);
+    upd_iso_msgf(iso, "nwatch: stat failure (%s)\n", uv_err_name(err));
+    return;
+  }
+  f_->nwatch.stat  = true;
+  f_->nwatch.dirty = false;
+  upd_file_ref(f);
+}
+
+static void nwatch_record_(upd_file_t* f, const char* name) {
+  upd_file_t_* f_ = (void*) f;
+
+  if (HEDLEY_UNLIKELY(f_->nwatch.overflow)) {
+    return;
+  }
+
+  /* a file being written repeats the same name */
+  const size_t len = utf8size_lazy(name);
+  for (size_t i = 0; i < f_->nwatch.changes.n; ++i) {
+    if (HEDLEY_UNLIKELY(utf8cmp(f_->nwatch.changes.p[i], name) == 0)) {
+      return;
+    }
+  }
+  if (HEDLEY_UNLIKELY(f_->nwatch.changes.n >= CHANGES_MAX_)) {
+    goto OVERFLOW;
+  }
+
+  uint8_t* str = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&str, len+1))) {
+    goto OVERFLOW;
+  }
+  utf8ncpy(str, name, len);
+  str[len] = 0;
+
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&f_->nwatch.changes, str, SIZE_MAX))) {
+    upd_free(&str);
+    goto OVERFLOW;
+  }
+  return;
+
+OVERFLOW:
+  nwatch_forget_(f);
+  f_->nwatch.overflow = true;
+}
+
+static void nwatch_forget_(upd_file_t* f) {
+  upd_file_t_* f_ = (void*) f;
+
+  for (size_t i = 0; i < f_->nwatch.changes.n; ++i) {
+    upd_free(&f_->nwatch.changes.p[i]);
+  }
+  upd_array_clear(&f_->nwatch.changes);
+  f_->nwatch.overflow = false;
+}
+
+
+static void nwatch_event_cb_(
+    uv_fs_event_t* event, const char* name, int events, int status) {
+  upd_nwatch_t* w = event->data;
+
+  if (HEDLEY_UNLIKELY(status < 0 || name == NULL)) {
+    /* we don't know what happened, so check all files */
+    for (size_t i = 0; i < w->files.cap; ++i) {
+      upd_file_t* f = w->files.slots[i];
+      if (HEDLEY_UNLIKELY(f)) {
+        nwatch_stat_(f);
+      }
+    }
+    for (size_t i = 0; i < w->dirs.n; ++i) {
+      upd_file_t_* d = w->dirs.p[i];
+      nwatch_forget_(&d->super);
+      d->nwatch.overflow = true;
+      nwatch_stat_(&d->super);
+    }
+    return;
+  }
+
+  const size_t   len = utf8size_lazy(name);
+  const uint64_t h   = upd_htable_hash_str((uint8_t*) name, len);
+
+  /* the same native file can be opened as some upd files */
+  bool opened = false;
+
+  size_t       i = SIZE_MAX;
+  upd_file_t_* f;
+  while ((f = upd_htable_next(&w->files, h, &i))) {
+    const bool match =
+      f->nwatch.hash    == h   &&
+      f->nwatch.namelen == len &&
+      utf8ncmp(f->nwatch.name, name, len) == 0;
+    if (HEDLEY_UNLIKELY(!match)) {
+      continue;
+    }
+    opened = true;
+    if (HEDLEY_LIKELY(!nwatch_is_quiet_(f))) {
+      nwatch_stat_(&f->super);
+    }
+  }
+
+  /*  Contents changes of files not opened yet are also told to the directory,
+   * because it caches metadata only for such children. */
+  const bool rename = events & UV_RENAME;
+  const bool change = (events & UV_CHANGE) && !opened;
+  if (HEDLEY_UNLIKELY(rename || change)) {
+    for (size_t j = 0; j < w->dirs.n; ++j) {
+      nwatch_record_(w->dirs.p[j], name);
+      nwatch_stat_(w->dirs.p[j]);
+    }
+  }
+}
+
+static void nwatch_stat_cb_(uv_fs_t* fsreq) {
+  stat_t_*     st  = fsreq->data;
+  upd_file_t*  f   = st->file;
+  upd_file_t_* f_  = (void*) f;
+  upd_iso_t*   iso = f->iso;
+
+  const ssize_t result = fsreq->result;
+  uv_fs_req_cleanup(fsreq);
+  upd_iso_unstack(iso, st);
+
+  f_->nwatch.stat = false;
+
+  upd_file_trigger(f, result < 0? UPD_FILE_DELETE_N: UPD_FILE_UPDATE_N);
+  if (HEDLEY_UNLIKELY(f_->nwatch.dirty && f_->nwatch.dir)) {
+    nwatch_stat_(f);
+  }
+  upd_file_unref(f);
+}
+
+static void nwatch_close_cb_(uv_handle_t* handle) {
+  upd_nwatch_t* w = handle->data;
+  upd_free(&w);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common.h"
+
+
+/* events arrived later than this after the driver's write are not its own */
+#define UPD_NWATCH_QUIET 50  /* ms */
+
+
+/*  Native change watcher shared by all files in the same native directory.
+ * Each directory has at most one uv_fs_event_t (inotify on Linux), and the
+ * events are dispatched to the files as UPD_FILE_UPDATE_N/UPD_FILE_DELETE_N. */
+struct upd_nwatch_t {
+  uv_fs_event_t event;
+  upd_iso_t*    iso;
+
+  upd_htable_t              files;  /* files in the directory by name */
+  upd_array_of(upd_file_t*) dirs;   /* files which are the directory itself */
+
+  uint8_t* npath;
+  size_t   npathlen;
+};
+
+
+/* Returns false when the native watcher is unavailable,
+ * so the caller should fall back to polling. */
+HEDLEY_NON_NULL(1)
+bool
+upd_nwatch_add(
+  upd_file_t* f);
+
+HEDLEY_NON_NULL(1)
+void
+upd_nwatch_remove(
+  upd_file_t* f);
+
+/*  Tells that the driver starts writing the native file by itself,
+ * so events caused by the write don't come back to the file as
+ * UPD_FILE_UPDATE_N. Every call must be paired with upd_nwatch_end_write. */
+HEDLEY_NON_NULL(1)
+void
+upd_nwatch_begin_write(
+  upd_file_t* f);
+
+HEDLEY_NON_NULL(1)
+void
+upd_nwatch_end_write(
+  upd_file_t* f);
+
+/*  Moves names changed in the directory since the last call into dst.
+ * Returns false when some changes are unknown, so the caller should rescan
+ * the whole directory. The caller takes the ownership of the names. */
+HEDLEY_NON_NULL(1, 2)
+bool
+upd_nwatch_take_changes(
+  upd_file_t*             f,
+  upd_array_of(uint8_t*)* dst);
+
+/*  Returns true when changes in the directory are told by the native watcher.
+ * Otherwise metadata captured before can't be trusted. */
+HEDLEY_NON_NULL(1)
+bool
+upd_nwatch_is_active(
+  upd_file_t* f);
+
+/* Returns true when some changes in the directory are not taken yet. */
+HEDLEY_NON_NULL(1)
+bool
+upd_nwatch_has_changes(
+  upd_file_t* f);